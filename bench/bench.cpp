@@ -0,0 +1,600 @@
+// Microbenchmarks for the intersection and shading kernels.
+//
+//   make bench                      builds and runs everything, writes bench.json
+//   ./pathtracer-bench [--json file] [--filter text] [--repetitions n]
+//
+// Every benchmark is calibrated to batches of at least minBatchTime, run a
+// few times to warm up, then timed over a number of repetitions. ns/op and
+// the derived Mrays/s (millions of operations per second; samples for
+// GetSample, paths for tracePath) are reported with their spread, along with
+// the heap allocations per op of the timed runs. The run fails when a hot
+// path benchmark (see isHotPath) allocates.
+#include "allocation.h"
+#include "camera.h"
+#include "instance.h"
+#include "light.h"
+#include "material.h"
+#include "sampler.h"
+#include "scene.h"
+#include "sceneloader.h"
+#include "shape.h"
+#include "widekernels.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const double minBatchTime = 0.01; // seconds
+    const int warmupRepetitions = 3;
+    const int numRays = 4096;
+
+    // keeps the compiler from dropping a result that is never used
+    template<typename T>
+    inline void doNotOptimize(const T& value)
+    {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    struct Result
+    {
+        std::string name;
+        long long opsPerBatch;
+        int repetitions;
+        double meanNs;
+        double medianNs;
+        double minNs;
+        double stddevNs;
+        double allocationsPerOp;
+    };
+
+    // per ray and per path kernels, which must not touch the heap
+    bool isHotPath(const std::string& name)
+    {
+        for (const char* prefix : { "leaf.", "scene.intersect", "scene.tracePath" })
+        {
+            if (name.compare(0, std::strlen(prefix), prefix) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    class Runner
+    {
+        private:
+            std::vector<Result> results;
+            std::string filter;
+            int repetitions;
+
+        public:
+            Runner(const std::string& filter, int repetitions) : filter(filter), repetitions(repetitions) {}
+
+            bool enabled(const std::string& name) const
+            {
+                return filter.empty() || name.find(filter) != std::string::npos;
+            }
+
+            // runOps(first, count) performs operations first .. first + count - 1
+            void run(const std::string& name, const std::function<void(long long first, long long count)>& runOps)
+            {
+                if (!enabled(name))
+                {
+                    return;
+                }
+
+                using Clock = std::chrono::steady_clock;
+                auto timeBatch = [&](long long ops)
+                {
+                    auto start = Clock::now();
+                    runOps(0, ops);
+                    return std::chrono::duration<double>(Clock::now() - start).count();
+                };
+
+                long long ops = 1;
+                while (timeBatch(ops) < minBatchTime)
+                {
+                    ops *= 2;
+                }
+                for (int r = 0; r < warmupRepetitions; r++)
+                {
+                    timeBatch(ops);
+                }
+
+                std::vector<double> samples(repetitions);
+                uint64_t allocations = getAllocationCount();
+                for (int r = 0; r < repetitions; r++)
+                {
+                    samples[r] = timeBatch(ops) * 1e9 / ops;
+                }
+                allocations = getAllocationCount() - allocations;
+
+                Result result;
+                result.name = name;
+                result.opsPerBatch = ops;
+                result.repetitions = repetitions;
+                result.allocationsPerOp = static_cast<double>(allocations) / (static_cast<double>(ops) * repetitions);
+                double sum = 0.0;
+                for (double s : samples)
+                {
+                    sum += s;
+                }
+                result.meanNs = sum / repetitions;
+                double squares = 0.0;
+                for (double s : samples)
+                {
+                    squares += (s - result.meanNs) * (s - result.meanNs);
+                }
+                result.stddevNs = repetitions > 1 ? std::sqrt(squares / (repetitions - 1)) : 0.0;
+                std::sort(samples.begin(), samples.end());
+                result.minNs = samples.front();
+                result.medianNs = samples[repetitions / 2];
+                results.push_back(result);
+
+                std::printf("%-32s %10.2f ns/op  +- %6.2f  (min %8.2f)  %9.3f Mrays/s  %8.3g allocs/op\n", name.c_str(),
+                            result.meanNs, result.stddevNs, result.minNs, 1e3 / result.meanNs, result.allocationsPerOp);
+                std::fflush(stdout);
+            }
+
+            const std::vector<Result>& getResults() const { return results; }
+    };
+
+    bool writeJSON(const std::string& filename, const std::vector<Result>& results)
+    {
+        std::ofstream file(filename);
+        if (!file)
+        {
+            std::cerr << "Failed to open file for writing: " << filename << std::endl;
+            return false;
+        }
+        file << "{\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result& r = results[i];
+            file << "    {\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.meanNs
+                 << ", \"median_ns\": " << r.medianNs << ", \"min_ns\": " << r.minNs
+                 << ", \"stddev_ns\": " << r.stddevNs << ", \"mrays_per_s\": " << 1e3 / r.meanNs
+                 << ", \"allocs_per_op\": " << r.allocationsPerOp
+                 << ", \"ops_per_batch\": " << r.opsPerBatch << ", \"repetitions\": " << r.repetitions << "}"
+                 << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        file << "  ]\n}\n";
+        return static_cast<bool>(file);
+    }
+
+    // rays from a sphere of the given radius towards points inside the target
+    // box, so that some hit and some miss what sits at the center
+    std::vector<Ray> makeRays(float radius, float target, uint64_t seed)
+    {
+        std::vector<Ray> rays;
+        rays.reserve(numRays);
+        for (int i = 0; i < numRays; i++)
+        {
+            Sampler sampler(i, 0, seed);
+            glm::vec2 u = sampler.next2D();
+            float z = 1.0f - 2.0f * u.x;
+            float r = std::sqrt(glm::max(0.0f, 1.0f - z * z));
+            float phi = 6.2831853f * u.y;
+            glm::vec3 origin = radius * glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+            glm::vec3 to = target * (2.0f * glm::vec3(sampler.next1D(), sampler.next1D(), sampler.next1D()) - 1.0f);
+            rays.push_back(Ray(origin, to - origin));
+        }
+        return rays;
+    }
+
+    void benchShapes(Runner& runner)
+    {
+        std::vector<Ray> rays = makeRays(5.0f, 1.5f, 1);
+        Sphere sphere(glm::vec3(0.0f), 1.0f);
+        Box box(glm::vec3(-1.0f), glm::vec3(1.0f));
+
+        runner.run("sphere.intersect", [&](long long first, long long count)
+        {
+            Hit hit;
+            int hits = 0;
+            for (long long op = first; op < first + count; op++)
+            {
+                hits += sphere.intersect(rays[op % numRays], std::numeric_limits<float>::infinity(), &hit);
+            }
+            doNotOptimize(hits);
+        });
+        runner.run("box.intersect", [&](long long first, long long count)
+        {
+            Hit hit;
+            int hits = 0;
+            for (long long op = first; op < first + count; op++)
+            {
+                hits += box.intersect(rays[op % numRays], std::numeric_limits<float>::infinity(), &hit);
+            }
+            doNotOptimize(hits);
+        });
+        runner.run("sphere.occluded", [&](long long first, long long count)
+        {
+            int hits = 0;
+            for (long long op = first; op < first + count; op++)
+            {
+                hits += sphere.occluded(rays[op % numRays], std::numeric_limits<float>::infinity());
+            }
+            doNotOptimize(hits);
+        });
+    }
+
+    void benchInstances(Runner& runner)
+    {
+        std::vector<Ray> rays = makeRays(5.0f, 1.5f, 2);
+        PhongMaterial material(glm::vec3(0.5f));
+
+        // the same box under each kind of transform
+        const char* names[] = { "instance.identity", "instance.translated", "instance.rotated", "instance.scaled" };
+        std::vector<std::unique_ptr<Instance>> instances;
+        for (int i = 0; i < 4; i++)
+        {
+            instances.push_back(std::make_unique<Instance>(std::make_unique<Box>(glm::vec3(-1.0f), glm::vec3(1.0f))));
+            instances.back()->setMaterial(&material);
+        }
+        instances[1]->translate(glm::vec3(0.1f, -0.2f, 0.3f));
+        instances[2]->rotate(30.0f, glm::vec3(1.0f, 1.0f, 0.0f));
+        instances[3]->scale(glm::vec3(1.5f, 0.5f, 1.0f));
+
+        for (int i = 0; i < 4; i++)
+        {
+            const Instance* instance = instances[i].get();
+            runner.run(names[i], [&](long long first, long long count)
+            {
+                Hit hit;
+                int hits = 0;
+                for (long long op = first; op < first + count; op++)
+                {
+                    hits += instance->computeIntersection(rays[op % numRays], std::numeric_limits<float>::infinity(), &hit);
+                }
+                doNotOptimize(hits);
+            });
+        }
+    }
+
+    // speedups of the named results over the baseline, labels[i] for names[i]
+    void reportSpeedup(const Runner& runner, const std::string& baseline, const std::vector<std::string>& names,
+                       const std::vector<std::string>& labels)
+    {
+        auto find = [&](const std::string& name) -> const Result*
+        {
+            for (const Result& result : runner.getResults())
+            {
+                if (result.name == name)
+                {
+                    return &result;
+                }
+            }
+            return nullptr;
+        };
+        const Result* base = find(baseline);
+        if (!base)
+        {
+            return;
+        }
+        std::printf("%-32s", (baseline + " speedup").c_str());
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (const Result* result = find(names[i]))
+            {
+                std::printf("  %s %.2fx", labels[i].c_str(), base->meanNs / result->meanNs);
+            }
+        }
+        std::printf("\n");
+    }
+
+    // one ray against a leaf of 8 spheres or boxes, tested one by one through
+    // the Shape interface and with each set of wide kernels
+    void benchLeaves(Runner& runner)
+    {
+        const int leafSize = WideKernels::maxWidth;
+        std::vector<Ray> rays = makeRays(5.0f, 1.5f, 7);
+        std::vector<std::unique_ptr<Shape>> sphereShapes;
+        std::vector<std::unique_ptr<Shape>> boxShapes;
+        // with padding like CompiledScene's arrays
+        std::vector<float> sphereData[4];
+        std::vector<float> boxData[6];
+        for (int i = 0; i < leafSize; i++)
+        {
+            Sampler sampler(i, 0, 8);
+            glm::vec3 center = 2.0f * glm::vec3(sampler.next1D(), sampler.next1D(), sampler.next1D()) - 1.0f;
+            float size = 0.2f + 0.3f * sampler.next1D();
+            sphereShapes.push_back(std::make_unique<Sphere>(center, size));
+            boxShapes.push_back(std::make_unique<Box>(center - glm::vec3(size), center + glm::vec3(size)));
+            for (int axis = 0; axis < 3; axis++)
+            {
+                sphereData[axis].push_back(center[axis]);
+                boxData[axis].push_back(center[axis] - size);
+                boxData[axis + 3].push_back(center[axis] + size);
+            }
+            sphereData[3].push_back(size);
+        }
+        SphereBlock spheres = { sphereData[0].data(), sphereData[1].data(), sphereData[2].data(), sphereData[3].data(), leafSize };
+        BoxBlock boxes = { boxData[0].data(), boxData[1].data(), boxData[2].data(),
+                           boxData[3].data(), boxData[4].data(), boxData[5].data(), leafSize };
+
+        const char* shapeNames[] = { "leaf.spheres8", "leaf.boxes8" };
+        for (int s = 0; s < 2; s++)
+        {
+            const std::vector<std::unique_ptr<Shape>>& shapes = s == 0 ? sphereShapes : boxShapes;
+            std::string baseline = std::string(shapeNames[s]) + ".loop";
+            runner.run(baseline, [&](long long first, long long count)
+            {
+                Hit hit;
+                int hits = 0;
+                for (long long op = first; op < first + count; op++)
+                {
+                    const Ray& ray = rays[op % numRays];
+                    float tMax = std::numeric_limits<float>::infinity();
+                    for (const auto& shape : shapes)
+                    {
+                        if (shape->intersect(ray, tMax, &hit))
+                        {
+                            tMax = hit.t;
+                            hits++;
+                        }
+                    }
+                }
+                doNotOptimize(hits);
+            });
+
+            std::vector<std::string> names;
+            std::vector<std::string> labels;
+            for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2 })
+            {
+                const WideKernels& kernels = getWideKernels(level);
+                std::string name = std::string(shapeNames[s]) + "." + getSimdLevelName(level);
+                if (kernels.level != level)
+                {
+                    std::cout << "Skipping " << name << ", not supported by this CPU" << std::endl;
+                    continue;
+                }
+                names.push_back(name);
+                labels.push_back(getSimdLevelName(level));
+                runner.run(name, [&](long long first, long long count)
+                {
+                    int hits = 0;
+                    for (long long op = first; op < first + count; op++)
+                    {
+                        WideRay ray(rays[op % numRays]);
+                        WideHit hit = s == 0 ? kernels.intersectSpheres(ray, spheres, std::numeric_limits<float>::infinity())
+                                             : kernels.intersectBoxes(ray, boxes, std::numeric_limits<float>::infinity());
+                        hits += hit.lane >= 0;
+                    }
+                    doNotOptimize(hits);
+                });
+            }
+            reportSpeedup(runner, baseline, names, labels);
+        }
+    }
+
+    // count small spheres and boxes spread over a cube of side 100
+    std::unique_ptr<Scene> makeRandomScene(int count)
+    {
+        auto scene = std::make_unique<Scene>();
+        Material* material = scene->addMaterial(std::make_unique<PhongMaterial>(glm::vec3(0.5f)));
+        float size = 0.5f * std::cbrt(1000.0f / count);
+        for (int i = 0; i < count; i++)
+        {
+            Sampler sampler(i, 0, 3);
+            glm::vec3 center = 100.0f * glm::vec3(sampler.next1D(), sampler.next1D(), sampler.next1D()) - 50.0f;
+            std::unique_ptr<Shape> shape;
+            if (i % 2)
+            {
+                shape = std::make_unique<Sphere>(center, size);
+            }
+            else
+            {
+                shape = std::make_unique<Box>(center - glm::vec3(size), center + glm::vec3(size));
+            }
+            auto instance = std::make_unique<Instance>(std::move(shape));
+            instance->setMaterial(material);
+            scene->addObject(std::move(instance));
+        }
+        scene->finalize();
+        return scene;
+    }
+
+    void benchScenes(Runner& runner)
+    {
+        std::vector<Ray> rays = makeRays(100.0f, 50.0f, 4);
+        for (int count : { 1, 10, 100, 1000, 10000, 100000 })
+        {
+            std::string name = "scene.intersect." + std::to_string(count);
+            std::string compiledName = "scene.intersectCompiled." + std::to_string(count);
+            if (!runner.enabled(name) && !runner.enabled(compiledName))
+            {
+                continue;
+            }
+            auto scene = makeRandomScene(count);
+            auto intersect = [&](long long first, long long count)
+            {
+                Hit hit;
+                int hits = 0;
+                for (long long op = first; op < first + count; op++)
+                {
+                    hits += scene->computeIntersection(rays[op % numRays], &hit);
+                }
+                doNotOptimize(hits);
+            };
+            runner.run(name, intersect);
+
+            // the same rays against the type sorted arrays
+            scene->setCompiled(true);
+            runner.run(compiledName, intersect);
+            reportSpeedup(runner, name, { compiledName }, { "compiled" });
+        }
+    }
+
+    // count emitting boxes with powers spread over two orders of magnitude
+    void benchLights(Runner& runner)
+    {
+        for (int count : { 1, 1000, 100000 })
+        {
+            std::string name = "scene.sampleLight." + std::to_string(count);
+            std::string hierarchyName = "scene.sampleLightBVH." + std::to_string(count);
+            if (!runner.enabled(name) && !runner.enabled(hierarchyName))
+            {
+                continue;
+            }
+            Scene scene;
+            for (int i = 0; i < count; i++)
+            {
+                Sampler sampler(i, 0, 5);
+                glm::vec3 position = 100.0f * glm::vec3(sampler.next1D(), sampler.next1D(), sampler.next1D()) - 50.0f;
+                glm::vec3 power = glm::vec3(std::pow(100.0f, sampler.next1D()));
+                Light* light = scene.addLight(std::make_unique<AreaLight>(position, power, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), 1));
+                auto instance = std::make_unique<Instance>(std::make_unique<Box>(position, position + glm::vec3(1.0f, 0.01f, 1.0f)));
+                instance->setLight(light);
+                scene.addObject(std::move(instance));
+            }
+            scene.finalize();
+            runner.run(name, [&](long long first, long long count)
+            {
+                Sampler sampler(first, 0);
+                float pdf;
+                for (long long op = first; op < first + count; op++)
+                {
+                    Light* light = scene.SampleLight(sampler, &pdf);
+                    doNotOptimize(light);
+                }
+            });
+
+            // shading points on the plane below the lights, facing up
+            std::vector<glm::vec3> points;
+            for (int i = 0; i < numRays; i++)
+            {
+                Sampler sampler(i, 0, 6);
+                points.push_back(glm::vec3(100.0f * sampler.next1D() - 50.0f, -50.0f, 100.0f * sampler.next1D() - 50.0f));
+            }
+            runner.run(hierarchyName, [&](long long first, long long count)
+            {
+                Sampler sampler(first, 0);
+                float pdf;
+                for (long long op = first; op < first + count; op++)
+                {
+                    Light* light = scene.SampleLight(points[op % numRays], glm::vec3(0.0f, 1.0f, 0.0f), sampler, &pdf);
+                    doNotOptimize(light);
+                }
+            });
+        }
+    }
+
+    void benchShading(Runner& runner)
+    {
+        const int width = 800;
+        const int height = 600;
+        Camera camera(glm::vec3(0.0f, 2.5f, 7.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 50.0f, 1.0f, width, height);
+        runner.run("camera.generateRay", [&](long long first, long long count)
+        {
+            for (long long op = first; op < first + count; op++)
+            {
+                Ray ray = camera.generateRay((op % width + 0.5f) / width, (op / width % height + 0.5f) / height);
+                doNotOptimize(ray);
+            }
+        });
+
+        PhongMaterial material(glm::vec3(0.8f));
+        runner.run("material.GetSample", [&](long long first, long long count)
+        {
+            Sampler sampler(0, 0);
+            float pdf;
+            for (long long op = first; op < first + count; op++)
+            {
+                glm::vec3 direction = material.GetSample(sampler, &pdf);
+                doNotOptimize(direction);
+            }
+        });
+
+        if (!runner.enabled("scene.tracePath"))
+        {
+            return;
+        }
+        RenderSettings settings;
+        auto scene = loadScene("scenes/default.scene", &settings, false);
+        if (!scene)
+        {
+            std::cerr << "Skipping scene.tracePath, run from the repository root" << std::endl;
+            return;
+        }
+        Camera sceneCamera(settings.eye, settings.lookAt, settings.up, settings.fov, settings.focalDistance, settings.width, settings.height);
+        auto tracePaths = [&](long long first, long long count)
+        {
+            glm::vec3 sum(0.0f);
+            for (long long op = first; op < first + count; op++)
+            {
+                // walk the film in pixel order, one path per pixel
+                int pixel = static_cast<int>(op % (settings.width * settings.height));
+                Sampler sampler(pixel, op / (settings.width * settings.height));
+                glm::vec2 u = sampler.next2D();
+                Ray ray = sceneCamera.generateRay((pixel % settings.width + u.x) / settings.width,
+                                                  (pixel / settings.width + u.y) / settings.height);
+                sum += scene->tracePath(ray, settings.dMax, sampler);
+            }
+            doNotOptimize(sum);
+        };
+        runner.run("scene.tracePath", tracePaths);
+        scene->setIntegrator(PathIntegrator::MIS);
+        runner.run("scene.tracePath.mis", tracePaths);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string jsonFile = "bench.json";
+    std::string filter;
+    int repetitions = 10;
+    for (int a = 1; a < argc; a++)
+    {
+        if (std::strcmp(argv[a], "--json") == 0 && a + 1 < argc)
+        {
+            jsonFile = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--filter") == 0 && a + 1 < argc)
+        {
+            filter = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--repetitions") == 0 && a + 1 < argc)
+        {
+            repetitions = std::max(1, std::stoi(argv[++a]));
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--json file] [--filter text] [--repetitions n]" << std::endl;
+            return 1;
+        }
+    }
+
+    Runner runner(filter, repetitions);
+    benchShapes(runner);
+    benchInstances(runner);
+    benchLeaves(runner);
+    benchScenes(runner);
+    benchLights(runner);
+    benchShading(runner);
+
+    if (!writeJSON(jsonFile, runner.getResults()))
+    {
+        return 1;
+    }
+    std::cout << "Results written to " << jsonFile << std::endl;
+
+    bool allocates = false;
+    for (const Result& result : runner.getResults())
+    {
+        if (isHotPath(result.name) && result.allocationsPerOp > 0.0)
+        {
+            std::cerr << result.name << " makes " << result.allocationsPerOp << " heap allocations per op on a hot path" << std::endl;
+            allocates = true;
+        }
+    }
+    return allocates ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+# Writes manylights.scene: 1024 small colored lamps on a jittered grid over
+# a floor with a few pillars. The seed is fixed, so running it again gives
+# the same file:
+#
+#   python3 scenes/manylights.py > scenes/manylights.scene
+
+import random
+
+random.seed(16)
+
+lines = [
+    "# Many-light scene: 1024 small colored lamps over a floor with pillars.",
+    "# Picking lights by power alone rarely finds the lamps near a point,",
+    "# compare --light-sampling power and bvh on it.",
+    "# Generated by scenes/manylights.py, edit that instead.",
+    "",
+    "film 400 300",
+    "samples 16",
+    "depth 3",
+    "camera eye 0 6 22 lookat 0 0 0 up 0 1 0 fov 55 distance 1",
+    "ambient 0 0 0",
+    "",
+    "material floor phong 0.8 0.8 0.8",
+    "material pillar phong 0.6 0.5 0.4",
+    "",
+    "box -22 -0.1 -22  22 0 22  material floor",
+]
+
+# unit wide pillars of random height
+for i in range(12):
+    x = random.uniform(-18, 18)
+    z = random.uniform(-18, 18)
+    h = random.uniform(1, 5)
+    lines.append("box %.2f 0 %.2f  %.2f %.2f %.2f  material pillar" % (x - 0.5, z - 0.5, x + 0.5, h, z + 0.5))
+lines.append("")
+
+# one lamp per cell of a 32x32 grid, each a 0.2 wide quad with a thin box
+# around it, with a random hue and power
+grid = 32
+for j in range(grid):
+    for i in range(grid):
+        x = -20 + 40 * (i + random.random()) / grid
+        z = -20 + 40 * (j + random.random()) / grid
+        y = random.uniform(0.5, 3.0)
+        hue = random.random()
+        color = [min(1, max(0.05, abs((hue * 6 + k * 2) % 6 - 3) - 1)) for k in (0, 1, 2)]
+        power = random.uniform(2, 20) / 20
+        name = "l%d" % (j * grid + i)
+        lines.append("arealight %s position %.3f %.3f %.3f power %.3f %.3f %.3f ei 0.2 0 0 ej 0 0 0.2"
+                     % ((name, x, y, z) + tuple(power * c for c in color)))
+        lines.append("box %.3f %.3f %.3f  %.3f %.3f %.3f  light %s" % (x, y, z, x + 0.2, y + 0.02, z + 0.2, name))
+
+print("\n".join(lines))
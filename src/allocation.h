@@ -0,0 +1,10 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <cstdint>
+
+// Number of calls to the global operator new since program start, over all
+// threads. Used to check that rendering does not touch the heap per ray.
+uint64_t getAllocationCount();
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <glm/glm.hpp>
+#include <limits>
+
+// Axis aligned bounding box
+class AABB
+{
+    public:
+        glm::vec3 bMin;
+        glm::vec3 bMax;
+
+        // an empty box, growing it by anything yields that thing's bounds
+        AABB()
+            : bMin(std::numeric_limits<float>::infinity())
+            , bMax(-std::numeric_limits<float>::infinity()) {}
+
+        AABB(const glm::vec3& bMin, const glm::vec3& bMax)
+            : bMin(bMin), bMax(bMax) {}
+
+        void grow(const glm::vec3& p)
+        {
+            bMin = glm::min(bMin, p);
+            bMax = glm::max(bMax, p);
+        }
+
+        void grow(const AABB& other)
+        {
+            bMin = glm::min(bMin, other.bMin);
+            bMax = glm::max(bMax, other.bMax);
+        }
+
+        bool isEmpty() const { return bMin.x > bMax.x || bMin.y > bMax.y || bMin.z > bMax.z; }
+        glm::vec3 centroid() const { return 0.5f * (bMin + bMax); }
+        glm::vec3 extent() const { return bMax - bMin; }
+
+        float surfaceArea() const
+        {
+            if (isEmpty())
+            {
+                return 0.0f;
+            }
+            glm::vec3 e = extent();
+            return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+        }
+
+        int maxAxis() const
+        {
+            glm::vec3 e = extent();
+            if (e.x > e.y && e.x > e.z) return 0;
+            return e.y > e.z ? 1 : 2;
+        }
+
+        // slab test against [0, tMax], tNear receives the entry distance
+        bool intersect(const glm::vec3& origin, const glm::vec3& invDirection, float tMax, float* tNear) const
+        {
+            glm::vec3 t0 = (bMin - origin) * invDirection;
+            glm::vec3 t1 = (bMax - origin) * invDirection;
+            glm::vec3 tSmall = glm::min(t0, t1);
+            glm::vec3 tBig = glm::max(t0, t1);
+
+            float tEnter = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, 0.0f));
+            float tExit = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tMax));
+            *tNear = tEnter;
+            return tEnter <= tExit;
+        }
+};
+#endif
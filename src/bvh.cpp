@@ -0,0 +1,196 @@
+#include "bvh.h"
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+void BVH::clear()
+{
+    nodes.clear();
+    primIndices.clear();
+}
+
+void BVH::assign(const BVHNode* nodes, int nodeCount, const int* primIndices, int primCount)
+{
+    this->nodes.assign(nodes, nodes + nodeCount);
+    this->primIndices.assign(primIndices, primIndices + primCount);
+}
+
+bool BVH::isValid(const BVHNode* nodes, int nodeCount, const int* primIndices, int primCount, int numPrims)
+{
+    if (nodeCount <= 0 || primCount < 0)
+    {
+        return nodeCount == 0 && primCount == 0;
+    }
+    for (int i = 0; i < primCount; i++)
+    {
+        if (primIndices[i] < 0 || primIndices[i] >= numPrims)
+        {
+            return false;
+        }
+    }
+
+    // children come later, so one pass in order sees every parent first
+    std::vector<int> depth(nodeCount, 0);
+    for (int i = 0; i < nodeCount; i++)
+    {
+        const BVHNode& node = nodes[i];
+        if (node.isLeaf())
+        {
+            if (node.offset < 0 || node.count > primCount - node.offset)
+            {
+                return false;
+            }
+            continue;
+        }
+        int rightChild = node.offset;
+        if (node.count != 0 || rightChild <= i + 1 || rightChild >= nodeCount || depth[i] + 1 > maxDepth - 1)
+        {
+            return false;
+        }
+        depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+        depth[rightChild] = std::max(depth[rightChild], depth[i] + 1);
+    }
+    return true;
+}
+
+void BVH::build(const std::vector<AABB>& primBounds)
+{
+    clear();
+    int numPrims = static_cast<int>(primBounds.size());
+    if (numPrims == 0)
+    {
+        return;
+    }
+
+    std::vector<glm::vec3> centroids(numPrims);
+    for (int i = 0; i < numPrims; i++)
+    {
+        centroids[i] = primBounds[i].centroid();
+    }
+
+    primIndices.resize(numPrims);
+    std::iota(primIndices.begin(), primIndices.end(), 0);
+    nodes.reserve(2 * numPrims - 1);
+
+    buildRecursive(0, numPrims, 0, primBounds, centroids);
+    nodes.shrink_to_fit();
+}
+
+void BVH::makeLeaf(int nodeIndex, int begin, int end)
+{
+    nodes[nodeIndex].offset = begin;
+    nodes[nodeIndex].count = end - begin;
+}
+
+int BVH::buildRecursive(int begin, int end, int depth, const std::vector<AABB>& primBounds, const std::vector<glm::vec3>& centroids)
+{
+    int nodeIndex = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+
+    AABB bounds;
+    AABB centroidBounds;
+    for (int i = begin; i < end; i++)
+    {
+        bounds.grow(primBounds[primIndices[i]]);
+        centroidBounds.grow(centroids[primIndices[i]]);
+    }
+    nodes[nodeIndex].bMin = bounds.bMin;
+    nodes[nodeIndex].bMax = bounds.bMax;
+
+    int count = end - begin;
+    if (count == 1 || depth >= maxDepth - 1)
+    {
+        makeLeaf(nodeIndex, begin, end);
+        return nodeIndex;
+    }
+
+    // evaluate binned SAH splits on all three axes
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestBin = 0;
+    glm::vec3 centroidExtent = centroidBounds.extent();
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (centroidExtent[axis] <= 0.0f)
+        {
+            continue;
+        }
+
+        int binCounts[numBins] = {};
+        AABB binBounds[numBins];
+        float scale = numBins / centroidExtent[axis];
+        for (int i = begin; i < end; i++)
+        {
+            int prim = primIndices[i];
+            int bin = glm::min(static_cast<int>((centroids[prim][axis] - centroidBounds.bMin[axis]) * scale), numBins - 1);
+            binCounts[bin]++;
+            binBounds[bin].grow(primBounds[prim]);
+        }
+
+        // sweep from the right to get the cost of everything above each split plane
+        float rightArea[numBins - 1];
+        int rightCount[numBins - 1];
+        AABB accumulated;
+        int accumulatedCount = 0;
+        for (int b = numBins - 1; b > 0; b--)
+        {
+            accumulated.grow(binBounds[b]);
+            accumulatedCount += binCounts[b];
+            rightArea[b - 1] = accumulated.surfaceArea();
+            rightCount[b - 1] = accumulatedCount;
+        }
+
+        accumulated = AABB();
+        accumulatedCount = 0;
+        for (int b = 0; b < numBins - 1; b++)
+        {
+            accumulated.grow(binBounds[b]);
+            accumulatedCount += binCounts[b];
+            if (accumulatedCount == 0 || rightCount[b] == 0)
+            {
+                continue;
+            }
+            float cost = accumulatedCount * accumulated.surfaceArea() + rightCount[b] * rightArea[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    // compare against the cost of keeping everything in one leaf (traversal cost 1, intersection cost 1)
+    float area = bounds.surfaceArea();
+    float splitCost = 1.0f + (area > 0.0f ? bestCost / area : 0.0f);
+    if (count <= maxLeafSize && (bestAxis < 0 || splitCost >= count))
+    {
+        makeLeaf(nodeIndex, begin, end);
+        return nodeIndex;
+    }
+
+    int mid;
+    if (bestAxis >= 0)
+    {
+        float scale = numBins / centroidExtent[bestAxis];
+        float minCentroid = centroidBounds.bMin[bestAxis];
+        auto it = std::partition(primIndices.begin() + begin, primIndices.begin() + end, [&](int prim)
+        {
+            int bin = glm::min(static_cast<int>((centroids[prim][bestAxis] - minCentroid) * scale), numBins - 1);
+            return bin <= bestBin;
+        });
+        mid = static_cast<int>(it - primIndices.begin());
+    }
+    else
+    {
+        // all centroids coincide, split the range in half
+        mid = begin + count / 2;
+    }
+
+    buildRecursive(begin, mid, depth + 1, primBounds, centroids);
+    int rightChild = buildRecursive(mid, end, depth + 1, primBounds, centroids);
+    nodes[nodeIndex].offset = rightChild;
+    nodes[nodeIndex].count = 0;
+    return nodeIndex;
+}
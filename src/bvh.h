@@ -0,0 +1,349 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "bounds.h"
+#include "ray.h"
+#include "packet.h"
+#include "widekernels.h"
+#include <utility>
+#include <vector>
+
+// Flattened BVH node (32 bytes). Nodes are stored depth first, so the left
+// child of an interior node directly follows it in the array.
+struct BVHNode
+{
+    glm::vec3 bMin;
+    int offset;     // leaf: first entry in primIndices, interior: index of the right child
+    glm::vec3 bMax;
+    int count;      // leaf: number of primitives, interior: 0
+
+    bool isLeaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over an arbitrary list of primitive bounds,
+// built with the binned surface area heuristic.
+class BVH
+{
+    private:
+        static const int maxDepth = 64;
+        static const int maxLeafSize = 4;
+        static const int numBins = 12;
+
+        std::vector<BVHNode> nodes;
+        std::vector<int> primIndices;
+
+        int buildRecursive(int begin, int end, int depth, const std::vector<AABB>& primBounds, const std::vector<glm::vec3>& centroids);
+        void makeLeaf(int nodeIndex, int begin, int end);
+
+        static bool intersectNode(const BVHNode& node, const glm::vec3& origin, const glm::vec3& invDirection, float tMax, float* tNear)
+        {
+            return AABB(node.bMin, node.bMax).intersect(origin, invDirection, tMax, tNear);
+        }
+
+    public:
+        BVH() = default;
+
+        void build(const std::vector<AABB>& primBounds);
+        // adopts a hierarchy built earlier, e.g. one loaded from a scene cache
+        void assign(const BVHNode* nodes, int nodeCount, const int* primIndices, int primCount);
+        // true if the traversals can walk the hierarchy safely: every child comes
+        // after its parent, leaves stay inside primIndices, those index one of
+        // numPrims primitives and no node is deeper than build makes them
+        static bool isValid(const BVHNode* nodes, int nodeCount, const int* primIndices, int primCount, int numPrims);
+        void clear();
+
+        bool isEmpty() const { return nodes.empty(); }
+        int getNodeCount() const { return static_cast<int>(nodes.size()); }
+        const std::vector<BVHNode>& getNodes() const { return nodes; }
+        const std::vector<int>& getPrimIndices() const { return primIndices; }
+        AABB getBounds() const { return nodes.empty() ? AABB() : AABB(nodes[0].bMin, nodes[0].bMax); }
+
+        // Closest hit traversal. intersectPrimitive(primIndex, tMax) tests one
+        // primitive, shrinks tMax and returns true when it found a closer hit.
+        // Children are visited front to back and nodes beyond tMax are skipped.
+        template<typename IntersectFn>
+        bool traverse(const Ray& ray, float tMax, IntersectFn&& intersectPrimitive) const
+        {
+            return traverseLeaves(ray, tMax, [&](int first, int count, float& tMax)
+            {
+                bool hitAnything = false;
+                for (int i = first; i < first + count; i++)
+                {
+                    if (intersectPrimitive(primIndices[i], tMax))
+                    {
+                        hitAnything = true;
+                    }
+                }
+                return hitAnything;
+            });
+        }
+
+        // traverse() handing over whole leaves, intersectLeaf(first, count, tMax)
+        // tests the primIndices entries first .. first + count - 1
+        template<typename IntersectFn>
+        bool traverseLeaves(const Ray& ray, float tMax, IntersectFn&& intersectLeaf) const
+        {
+            if (nodes.empty())
+            {
+                return false;
+            }
+
+            const glm::vec3& origin = ray.getRayOrigin();
+            glm::vec3 invDirection = 1.0f / ray.getRayDirection();
+
+            float tNear;
+            if (!intersectNode(nodes[0], origin, invDirection, tMax, &tNear))
+            {
+                return false;
+            }
+
+            int stackNodes[maxDepth];
+            float stackT[maxDepth];
+            int stackSize = 0;
+            int nodeIndex = 0;
+            bool hitAnything = false;
+
+            while (true)
+            {
+                const BVHNode& node = nodes[nodeIndex];
+                if (node.isLeaf())
+                {
+                    if (intersectLeaf(node.offset, node.count, tMax))
+                    {
+                        hitAnything = true;
+                    }
+                }
+                else
+                {
+                    int nearChild = nodeIndex + 1;
+                    int farChild = node.offset;
+                    float tNearChild, tFarChild;
+                    bool hitNear = intersectNode(nodes[nearChild], origin, invDirection, tMax, &tNearChild);
+                    bool hitFar = intersectNode(nodes[farChild], origin, invDirection, tMax, &tFarChild);
+
+                    if (hitNear && hitFar)
+                    {
+                        if (tFarChild < tNearChild)
+                        {
+                            std::swap(nearChild, farChild);
+                            std::swap(tNearChild, tFarChild);
+                        }
+                        stackNodes[stackSize] = farChild;
+                        stackT[stackSize] = tFarChild;
+                        stackSize++;
+                        nodeIndex = nearChild;
+                        continue;
+                    }
+                    if (hitNear || hitFar)
+                    {
+                        nodeIndex = hitNear ? nearChild : farChild;
+                        continue;
+                    }
+                }
+
+                // pop the next node that is still closer than the current hit
+                do
+                {
+                    if (stackSize == 0)
+                    {
+                        return hitAnything;
+                    }
+                    stackSize--;
+                } while (stackT[stackSize] > tMax);
+                nodeIndex = stackNodes[stackSize];
+            }
+        }
+
+        // Closest hit traversal of a coherent ray packet. intersectPrimitive(primIndex,
+        // laneMask) tests the lanes in laneMask against one primitive and lowers
+        // their entries in tMax. Nodes are skipped once no active lane overlaps them.
+        // The nodes are tested with the packet kernel of the given set.
+        template<typename IntersectFn>
+        void traversePacket(const RayPacket& packet, float* tMax, const WideKernels& kernels, IntersectFn&& intersectPrimitive) const
+        {
+            if (nodes.empty() || packet.activeMask == 0)
+            {
+                return;
+            }
+
+            alignas(32) float invX[PacketSize];
+            alignas(32) float invY[PacketSize];
+            alignas(32) float invZ[PacketSize];
+            for (int k = 0; k < PacketSize; k++)
+            {
+                invX[k] = 1.0f / packet.directionX[k];
+                invY[k] = 1.0f / packet.directionY[k];
+                invZ[k] = 1.0f / packet.directionZ[k];
+            }
+
+            int stackNodes[maxDepth];
+            int stackSize = 0;
+            stackNodes[stackSize++] = 0;
+
+            while (stackSize > 0)
+            {
+                int nodeIndex = stackNodes[--stackSize];
+                const BVHNode& node = nodes[nodeIndex];
+                float tNear;
+                uint32_t laneMask = kernels.intersectPacketBounds(node.bMin, node.bMax, packet, invX, invY, invZ, tMax,
+                                                                  packet.activeMask, &tNear);
+                if (laneMask == 0)
+                {
+                    continue;
+                }
+
+                if (node.isLeaf())
+                {
+                    for (int i = 0; i < node.count; i++)
+                    {
+                        intersectPrimitive(primIndices[node.offset + i], laneMask);
+                    }
+                    continue;
+                }
+
+                // push the farther child first so the nearer one is visited next
+                int nearChild = nodeIndex + 1;
+                int farChild = node.offset;
+                float tNearChild, tFarChild;
+                uint32_t nearMask = kernels.intersectPacketBounds(nodes[nearChild].bMin, nodes[nearChild].bMax, packet,
+                                                                  invX, invY, invZ, tMax, laneMask, &tNearChild);
+                uint32_t farMask = kernels.intersectPacketBounds(nodes[farChild].bMin, nodes[farChild].bMax, packet,
+                                                                 invX, invY, invZ, tMax, laneMask, &tFarChild);
+                if (nearMask && farMask && tFarChild < tNearChild)
+                {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearMask, farMask);
+                }
+                if (farMask)
+                {
+                    stackNodes[stackSize++] = farChild;
+                }
+                if (nearMask)
+                {
+                    stackNodes[stackSize++] = nearChild;
+                }
+            }
+        }
+
+        // Any hit traversal of a packet. occludedBy(primIndex, laneMask) returns
+        // the lanes in laneMask that one primitive blocks within their tMax, those
+        // lanes drop out and the walk ends once none is left. Returns the mask of
+        // blocked lanes. The lanes need not be coherent, only close together.
+        template<typename OccludedFn>
+        uint32_t traverseAnyPacket(const RayPacket& packet, const float* tMax, const WideKernels& kernels, OccludedFn&& occludedBy) const
+        {
+            uint32_t blocked = 0;
+            if (nodes.empty() || packet.activeMask == 0)
+            {
+                return blocked;
+            }
+
+            alignas(32) float invX[PacketSize];
+            alignas(32) float invY[PacketSize];
+            alignas(32) float invZ[PacketSize];
+            for (int k = 0; k < PacketSize; k++)
+            {
+                invX[k] = 1.0f / packet.directionX[k];
+                invY[k] = 1.0f / packet.directionY[k];
+                invZ[k] = 1.0f / packet.directionZ[k];
+            }
+
+            int stackNodes[maxDepth];
+            int stackSize = 0;
+            stackNodes[stackSize++] = 0;
+
+            while (stackSize > 0)
+            {
+                int nodeIndex = stackNodes[--stackSize];
+                const BVHNode& node = nodes[nodeIndex];
+                float tNear;
+                uint32_t laneMask = kernels.intersectPacketBounds(node.bMin, node.bMax, packet, invX, invY, invZ, tMax,
+                                                                  packet.activeMask & ~blocked, &tNear);
+                if (laneMask == 0)
+                {
+                    continue;
+                }
+
+                if (node.isLeaf())
+                {
+                    for (int i = 0; i < node.count && laneMask != 0; i++)
+                    {
+                        uint32_t hit = occludedBy(primIndices[node.offset + i], laneMask);
+                        blocked |= hit;
+                        laneMask &= ~hit;
+                    }
+                    if (blocked == packet.activeMask)
+                    {
+                        return blocked;
+                    }
+                }
+                else
+                {
+                    stackNodes[stackSize++] = node.offset;
+                    stackNodes[stackSize++] = nodeIndex + 1;
+                }
+            }
+            return blocked;
+        }
+
+        // Any hit traversal for occlusion queries. Returns as soon as
+        // occludedBy(primIndex) reports a blocker within tMax.
+        template<typename OccludedFn>
+        bool traverseAny(const Ray& ray, float tMax, OccludedFn&& occludedBy) const
+        {
+            return traverseAnyLeaves(ray, tMax, [&](int first, int count)
+            {
+                for (int i = first; i < first + count; i++)
+                {
+                    if (occludedBy(primIndices[i]))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        // traverseAny() handing over whole leaves like traverseLeaves()
+        template<typename OccludedFn>
+        bool traverseAnyLeaves(const Ray& ray, float tMax, OccludedFn&& occludedLeaf) const
+        {
+            if (nodes.empty())
+            {
+                return false;
+            }
+
+            const glm::vec3& origin = ray.getRayOrigin();
+            glm::vec3 invDirection = 1.0f / ray.getRayDirection();
+
+            int stackNodes[maxDepth];
+            int stackSize = 0;
+            stackNodes[stackSize++] = 0;
+
+            while (stackSize > 0)
+            {
+                int nodeIndex = stackNodes[--stackSize];
+                const BVHNode& node = nodes[nodeIndex];
+                float tNear;
+                if (!intersectNode(node, origin, invDirection, tMax, &tNear))
+                {
+                    continue;
+                }
+
+                if (node.isLeaf())
+                {
+                    if (occludedLeaf(node.offset, node.count))
+                    {
+                        return true;
+                    }
+                }
+                else
+                {
+                    stackNodes[stackSize++] = node.offset;
+                    stackNodes[stackSize++] = nodeIndex + 1;
+                }
+            }
+            return false;
+        }
+};
+#endif
@@ -1,40 +1,84 @@
-#include "camera.h"
-#include "ray.h"
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-
-Camera::Camera(const glm::vec3& eye, const glm::vec3& lookAt, const glm::vec3& up, 
-               float fov, float distance, int width, int height)
-    : eye(eye)
-    , lookAt(lookAt)
-    , up(up)
-    , fov(fov)
-    , distance(distance)
-    , aspectRatio(static_cast<float>(width) / height)
-{
-    viewMatrix = glm::lookAt(eye, lookAt, up);
-    inverseViewMatrix = glm::inverse(viewMatrix);
-}
-
-Ray Camera::generateRay(float Xn, float Yn) const
-{
-    // calculate view plane dimensions at the focal distance
-    float deltaV = distance * std::tan(glm::radians(fov) / 2.0f);
-    float deltaU = deltaV * aspectRatio;
-    
-    // calculate ray direction in camera space
-    glm::vec4 p;
-    p.x = -deltaU + 2.0f * deltaU * Xn;
-    //p.y = -deltaV + 2.0f * deltaV * Yn;
-    p.y = deltaV - 2.0f * deltaV * Yn;
-    p.z = -distance;
-    p.w = 1.0f;
-    
-    glm::vec4 o = inverseViewMatrix * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-    glm::vec4 t = inverseViewMatrix * p;
-
-    glm::vec3 rayOrigin = glm::vec3(o) / o.w;
-    glm::vec3 rayDirection = glm::normalize(glm::vec3(t) / t.w - rayOrigin);
-
-    return Ray(rayOrigin, rayDirection);
-}
\ No newline at end of file
+#include "camera.h"
+#include "ray.h"
+#include "hash.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+Camera::Camera(const glm::vec3& eye, const glm::vec3& lookAt, const glm::vec3& up, 
+               float fov, float distance, int width, int height)
+    : eye(eye)
+    , lookAt(lookAt)
+    , up(up)
+    , fov(fov)
+    , distance(distance)
+    , aspectRatio(static_cast<float>(width) / height)
+{
+    viewMatrix = glm::lookAt(eye, lookAt, up);
+    inverseViewMatrix = glm::inverse(viewMatrix);
+}
+
+Ray Camera::generateRay(float Xn, float Yn) const
+{
+    // calculate view plane dimensions at the focal distance
+    float deltaV = distance * std::tan(glm::radians(fov) / 2.0f);
+    float deltaU = deltaV * aspectRatio;
+    
+    // calculate ray direction in camera space
+    glm::vec4 p;
+    p.x = -deltaU + 2.0f * deltaU * Xn;
+    //p.y = -deltaV + 2.0f * deltaV * Yn;
+    p.y = deltaV - 2.0f * deltaV * Yn;
+    p.z = -distance;
+    p.w = 1.0f;
+    
+    glm::vec4 o = inverseViewMatrix * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    glm::vec4 t = inverseViewMatrix * p;
+
+    glm::vec3 rayOrigin = glm::vec3(o) / o.w;
+    glm::vec3 rayDirection = glm::normalize(glm::vec3(t) / t.w - rayOrigin);
+
+    return Ray(rayOrigin, rayDirection);
+}
+
+void Camera::generatePacket(const glm::vec2* samples, uint32_t laneMask, RayPacket* packet) const
+{
+    // calculate view plane dimensions at the focal distance
+    float deltaV = distance * std::tan(glm::radians(fov) / 2.0f);
+    float deltaU = deltaV * aspectRatio;
+
+    // all rays leave the eye, the view matrix is affine so w stays 1
+    const glm::mat4& m = inverseViewMatrix;
+    glm::vec3 rayOrigin = glm::vec3(m[3]);
+
+    for (int k = 0; k < PacketSize; k++)
+    {
+        float px = -deltaU + 2.0f * deltaU * samples[k].x;
+        float py = deltaV - 2.0f * deltaV * samples[k].y;
+        float pz = -distance;
+
+        float dx = m[0][0] * px + m[1][0] * py + m[2][0] * pz;
+        float dy = m[0][1] * px + m[1][1] * py + m[2][1] * pz;
+        float dz = m[0][2] * px + m[1][2] * py + m[2][2] * pz;
+        float invLength = 1.0f / std::sqrt(dx * dx + dy * dy + dz * dz);
+
+        packet->originX[k] = rayOrigin.x;
+        packet->originY[k] = rayOrigin.y;
+        packet->originZ[k] = rayOrigin.z;
+        packet->directionX[k] = dx * invLength;
+        packet->directionY[k] = dy * invLength;
+        packet->directionZ[k] = dz * invLength;
+    }
+    packet->activeMask = laneMask;
+}
+
+uint64_t Camera::getHash() const
+{
+    Hasher hasher;
+    hasher.add(eye);
+    hasher.add(lookAt);
+    hasher.add(up);
+    hasher.add(fov);
+    hasher.add(distance);
+    hasher.add(aspectRatio);
+    return hasher.get();
+}
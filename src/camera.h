@@ -1,24 +1,30 @@
-#ifndef CAMERA_H
-#define CAMERA_H
-
-#include <glm/glm.hpp>
-#include "ray.h"
-
-class Camera
-{
-    private:
-        float fov;
-        float aspectRatio;
-        float distance;
-        glm::vec3 eye;
-        glm::vec3 lookAt;
-        glm::vec3 up;
-        glm::mat4 viewMatrix;
-        glm::mat4 inverseViewMatrix;
-
-    public:
-        Camera(const glm::vec3& eye, const glm::vec3& lookAt, const glm::vec3& up, 
-               float fov, float distance, int width, int height);
-        Ray generateRay(float x, float y) const;
-};
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "packet.h"
+#include <cstdint>
+
+class Camera
+{
+    private:
+        float fov;
+        float aspectRatio;
+        float distance;
+        glm::vec3 eye;
+        glm::vec3 lookAt;
+        glm::vec3 up;
+        glm::mat4 viewMatrix;
+        glm::mat4 inverseViewMatrix;
+
+    public:
+        Camera(const glm::vec3& eye, const glm::vec3& lookAt, const glm::vec3& up, 
+               float fov, float distance, int width, int height);
+        Ray generateRay(float x, float y) const;
+        // primary rays through the normalized film positions of the lanes in laneMask
+        void generatePacket(const glm::vec2* samples, uint32_t laneMask, RayPacket* packet) const;
+        // the same for cameras that generate the same rays
+        uint64_t getHash() const;
+};
 #endif
\ No newline at end of file
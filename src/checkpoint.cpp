@@ -0,0 +1,169 @@
+#include "checkpoint.h"
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char checkpointMagic[8] = { 'P', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+    const uint32_t checkpointVersion = 2;
+    // header and slots start on page boundaries so they can be flushed separately
+    const size_t pageSize = 4096;
+
+    size_t roundToPage(size_t size)
+    {
+        return (size + pageSize - 1) / pageSize * pageSize;
+    }
+}
+
+Checkpoint::Checkpoint()
+    : fd(-1), mapping(nullptr), mappingSize(0), slotSize(0), width(0), height(0) {}
+
+Checkpoint::~Checkpoint()
+{
+    close();
+}
+
+void Checkpoint::close()
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+        mapping = nullptr;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+uint8_t* Checkpoint::slot(int index) const
+{
+    return mapping + pageSize + slotSize * index;
+}
+
+int Checkpoint::latestSlot() const
+{
+    const Header* h = header();
+    if (h->sequence[0] == 0 && h->sequence[1] == 0)
+    {
+        return -1;
+    }
+    return h->sequence[0] > h->sequence[1] ? 0 : 1;
+}
+
+bool Checkpoint::open(const std::string& filename, int width, int height, uint64_t settingsKey)
+{
+    close();
+    this->filename = filename;
+    this->width = width;
+    this->height = height;
+
+    size_t numPixels = static_cast<size_t>(width) * height;
+    slotSize = roundToPage(numPixels * sizeof(PixelAccumulator));
+    mappingSize = pageSize + 2 * slotSize;
+
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to open checkpoint file: " << filename << std::endl;
+        return false;
+    }
+
+    struct stat info;
+    bool matches = fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == mappingSize;
+    if (!matches && ftruncate(fd, mappingSize) != 0)
+    {
+        std::cerr << "Failed to resize checkpoint file: " << filename << std::endl;
+        close();
+        return false;
+    }
+
+    void* address = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        std::cerr << "Failed to map checkpoint file: " << filename << std::endl;
+        mapping = nullptr;
+        close();
+        return false;
+    }
+    mapping = static_cast<uint8_t*>(address);
+
+    // anything written for another film, scene or settings cannot be resumed
+    Header* h = header();
+    bool isCheckpoint = matches && std::memcmp(h->magic, checkpointMagic, sizeof(checkpointMagic)) == 0
+        && h->version == checkpointVersion;
+    matches = isCheckpoint && h->width == width && h->height == height && h->settingsKey == settingsKey;
+    if (!matches)
+    {
+        if (isCheckpoint && (h->sequence[0] || h->sequence[1]))
+        {
+            std::cout << "Checkpoint " << filename << " was saved for another scene, camera or settings, starting over" << std::endl;
+        }
+        std::memset(h, 0, sizeof(Header));
+        std::memcpy(h->magic, checkpointMagic, sizeof(checkpointMagic));
+        h->version = checkpointVersion;
+        h->width = width;
+        h->height = height;
+        h->settingsKey = settingsKey;
+        msync(mapping, pageSize, MS_SYNC);
+    }
+    return true;
+}
+
+bool Checkpoint::hasState() const
+{
+    return mapping && latestSlot() >= 0;
+}
+
+bool Checkpoint::restore(Film* film) const
+{
+    if (!hasState() || film->getWidth() != width || film->getHeight() != height)
+    {
+        return false;
+    }
+
+    film->restoreAccumulation(reinterpret_cast<const PixelAccumulator*>(slot(latestSlot())));
+    return true;
+}
+
+bool Checkpoint::save(const Film& film)
+{
+    if (!mapping || film.getWidth() != width || film.getHeight() != height)
+    {
+        return false;
+    }
+
+    // overwrite the older slot and invalidate it while it is being written
+    Header* h = header();
+    int latest = latestSlot();
+    int target = latest == 0 ? 1 : 0;
+    uint64_t sequence = latest >= 0 ? h->sequence[latest] + 1 : 1;
+    h->sequence[target] = 0;
+    if (msync(mapping, pageSize, MS_SYNC) != 0)
+    {
+        std::cerr << "Failed to write checkpoint: " << filename << std::endl;
+        return false;
+    }
+
+    uint8_t* data = slot(target);
+    const std::vector<PixelAccumulator>& pixels = film.getAccumulationBuffer();
+    std::memcpy(data, pixels.data(), pixels.size() * sizeof(PixelAccumulator));
+    if (msync(data, slotSize, MS_SYNC) != 0)
+    {
+        std::cerr << "Failed to write checkpoint: " << filename << std::endl;
+        return false;
+    }
+
+    h->sequence[target] = sequence;
+    if (msync(mapping, pageSize, MS_SYNC) != 0)
+    {
+        std::cerr << "Failed to write checkpoint: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "film.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Accumulation state of a Film kept in a memory mapped file, so a render
+// that gets killed can be resumed where its last checkpoint left off. The
+// file holds two slots that are written alternately; a slot only becomes
+// current once it is fully on disk, so a crash mid write keeps the
+// previous checkpoint intact.
+class Checkpoint
+{
+    private:
+        struct Header
+        {
+            char magic[8];
+            uint32_t version;
+            int32_t width;
+            int32_t height;
+            uint32_t reserved;
+            // scene, camera and settings the accumulated samples depend on
+            uint64_t settingsKey;
+            // sequence number of the state in each slot, 0 while being written
+            uint64_t sequence[2];
+        };
+
+        std::string filename;
+        int fd;
+        uint8_t* mapping;
+        size_t mappingSize;
+        size_t slotSize;
+        int width;
+        int height;
+
+        Header* header() const { return reinterpret_cast<Header*>(mapping); }
+        uint8_t* slot(int index) const;
+        int latestSlot() const;
+        void close();
+
+    public:
+        Checkpoint();
+        ~Checkpoint();
+        Checkpoint(const Checkpoint&) = delete;
+        Checkpoint& operator=(const Checkpoint&) = delete;
+
+        // maps the file, creating or resetting it when it does not match the film and settings
+        bool open(const std::string& filename, int width, int height, uint64_t settingsKey);
+        bool isOpen() const { return mapping != nullptr; }
+        // true when the file holds a complete checkpoint
+        bool hasState() const;
+        // copies the latest checkpoint into the film
+        bool restore(Film* film) const;
+        // writes the film state to the older slot and flushes it to disk
+        bool save(const Film& film);
+};
+
+#endif
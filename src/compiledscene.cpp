@@ -0,0 +1,551 @@
+#include "compiledscene.h"
+#include "shape.h"
+#include "stats.h"
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+namespace
+{
+    // first primIndices entry and primitive count of every node's subtree
+    struct NodeRange
+    {
+        int first;
+        int count;
+    };
+
+    // copies the subtree at nodeIndex, turning every subtree of at most
+    // maxLeafSize primitives into a single leaf
+    void collapseNodes(const std::vector<BVHNode>& nodes, const std::vector<NodeRange>& ranges, int nodeIndex,
+                       int maxLeafSize, std::vector<BVHNode>* out)
+    {
+        const BVHNode& node = nodes[nodeIndex];
+        int outIndex = static_cast<int>(out->size());
+        out->push_back(node);
+        if (node.isLeaf())
+        {
+            return;
+        }
+        if (ranges[nodeIndex].count <= maxLeafSize)
+        {
+            (*out)[outIndex].offset = ranges[nodeIndex].first;
+            (*out)[outIndex].count = ranges[nodeIndex].count;
+            return;
+        }
+        collapseNodes(nodes, ranges, nodeIndex + 1, maxLeafSize, out);
+        (*out)[outIndex].offset = static_cast<int>(out->size());
+        collapseNodes(nodes, ranges, node.offset, maxLeafSize, out);
+    }
+
+    // spheres and boxes without a transform can share a kernel call
+    enum BatchKey { BatchSpheres, BatchBoxes, NoBatch };
+
+    BatchKey getBatchKey(const Instance& instance)
+    {
+        if (!instance.getTransform()->isIdentity())
+        {
+            return NoBatch;
+        }
+        if (dynamic_cast<const Sphere*>(instance.getShape()))
+        {
+            return BatchSpheres;
+        }
+        return dynamic_cast<const Box*>(instance.getShape()) ? BatchBoxes : NoBatch;
+    }
+}
+
+void CompiledScene::build(const std::vector<std::unique_ptr<Instance>>& objects, const BVH& sceneBVH, SimdLevel simd)
+{
+    clear();
+    kernels = &getWideKernels(simd);
+    std::vector<int> order = sceneBVH.getPrimIndices();
+    const std::vector<BVHNode>& sceneNodes = sceneBVH.getNodes();
+
+    // wide kernels test a full leaf for little more than one primitive
+    std::vector<BVHNode> nodes;
+    if (kernels->level == SimdLevel::Scalar || sceneNodes.empty())
+    {
+        nodes = sceneNodes;
+    }
+    else
+    {
+        std::vector<NodeRange> ranges(sceneNodes.size());
+        for (int i = static_cast<int>(sceneNodes.size()) - 1; i >= 0; i--)
+        {
+            const BVHNode& node = sceneNodes[i];
+            if (node.isLeaf())
+            {
+                ranges[i] = { node.offset, node.count };
+            }
+            else
+            {
+                ranges[i] = { ranges[i + 1].first, ranges[i + 1].count + ranges[node.offset].count };
+            }
+        }
+        nodes.reserve(sceneNodes.size());
+        collapseNodes(sceneNodes, ranges, 0, WideKernels::maxWidth, &nodes);
+    }
+
+    // batchable primitives first in every leaf, so they form runs
+    std::vector<BatchKey> keys(objects.size());
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        keys[i] = getBatchKey(*objects[i]);
+    }
+    for (const BVHNode& node : nodes)
+    {
+        if (node.isLeaf())
+        {
+            std::stable_sort(order.begin() + node.offset, order.begin() + node.offset + node.count, [&](int a, int b)
+            {
+                return keys[a] < keys[b];
+            });
+        }
+    }
+
+    primitives.reserve(order.size());
+    std::unordered_map<const Light*, uint32_t> lightSlots;
+    std::unordered_map<const Material*, uint32_t> materialSlots;
+    for (int index : order)
+    {
+        const Instance& instance = *objects[index];
+        const Shape* shape = instance.getShape();
+        Primitive primitive;
+        primitive.batch = 1;
+
+        if (const Sphere* sphere = dynamic_cast<const Sphere*>(shape))
+        {
+            primitive.type = PrimitiveType::Sphere;
+            primitive.slot = static_cast<uint32_t>(sphereCount++);
+            spheres.centerX.push_back(sphere->getCenter().x);
+            spheres.centerY.push_back(sphere->getCenter().y);
+            spheres.centerZ.push_back(sphere->getCenter().z);
+            spheres.radius.push_back(sphere->getRadius());
+        }
+        else if (const Box* box = dynamic_cast<const Box*>(shape))
+        {
+            primitive.type = PrimitiveType::Box;
+            primitive.slot = static_cast<uint32_t>(boxCount++);
+            boxes.minX.push_back(box->getMin().x);
+            boxes.minY.push_back(box->getMin().y);
+            boxes.minZ.push_back(box->getMin().z);
+            boxes.maxX.push_back(box->getMax().x);
+            boxes.maxY.push_back(box->getMax().y);
+            boxes.maxZ.push_back(box->getMax().z);
+        }
+        else
+        {
+            primitive.type = PrimitiveType::Instance;
+            primitive.slot = static_cast<uint32_t>(instances.size());
+            instances.push_back(&instance);
+        }
+
+        const Transform* transform = instance.getTransform();
+        primitive.transform = -1;
+        if (primitive.type != PrimitiveType::Instance && !transform->isIdentity())
+        {
+            primitive.transform = static_cast<int32_t>(transforms.size());
+            transforms.push_back(*transform);
+        }
+
+        // lights and materials are shared by many instances, keep one entry each
+        primitive.surfaceType = SurfaceType::None;
+        primitive.surface = 0;
+        if (instance.isLight())
+        {
+            auto inserted = lightSlots.emplace(instance.getLight(), static_cast<uint32_t>(lights.size()));
+            if (inserted.second)
+            {
+                lights.push_back(instance.getLight());
+            }
+            primitive.surfaceType = SurfaceType::Light;
+            primitive.surface = inserted.first->second;
+        }
+        else if (instance.isMaterial())
+        {
+            auto inserted = materialSlots.emplace(instance.getMaterial(), static_cast<uint32_t>(materials.size()));
+            if (inserted.second)
+            {
+                materials.push_back(instance.getMaterial());
+            }
+            primitive.surfaceType = SurfaceType::Material;
+            primitive.surface = inserted.first->second;
+        }
+        primitives.push_back(primitive);
+    }
+
+    // runs of the same key within a leaf have consecutive slots, mark where they start
+    for (const BVHNode& node : nodes)
+    {
+        if (!node.isLeaf())
+        {
+            continue;
+        }
+        int end = node.offset + node.count;
+        for (int i = node.offset; i < end; )
+        {
+            BatchKey key = keys[order[i]];
+            int run = 1;
+            while (key != NoBatch && i + run < end && run < WideKernels::maxWidth && keys[order[i + run]] == key)
+            {
+                primitives[i + run].batch = 0;
+                run++;
+            }
+            primitives[i].batch = static_cast<uint8_t>(run);
+            i += run;
+        }
+    }
+
+    for (std::vector<float>* values : { &spheres.centerX, &spheres.centerY, &spheres.centerZ, &spheres.radius,
+                                        &boxes.minX, &boxes.minY, &boxes.minZ, &boxes.maxX, &boxes.maxY, &boxes.maxZ })
+    {
+        values->resize(values->size() + WideKernels::maxWidth, 0.0f);
+    }
+
+    std::vector<int> identity(order.size());
+    for (size_t i = 0; i < identity.size(); i++)
+    {
+        identity[i] = static_cast<int>(i);
+    }
+    bvh.assign(nodes.data(), static_cast<int>(nodes.size()), identity.data(), static_cast<int>(identity.size()));
+}
+
+void CompiledScene::clear()
+{
+    primitives.clear();
+    spheres = Spheres();
+    boxes = Boxes();
+    sphereCount = 0;
+    boxCount = 0;
+    instances.clear();
+    transforms.clear();
+    lights.clear();
+    materials.clear();
+    bvh.clear();
+    kernels = nullptr;
+}
+
+int CompiledScene::getCount(PrimitiveType type) const
+{
+    switch (type)
+    {
+        case PrimitiveType::Sphere: return sphereCount;
+        case PrimitiveType::Box:    return boxCount;
+        default:                    return static_cast<int>(instances.size());
+    }
+}
+
+SphereBlock CompiledScene::getSpheres(uint32_t slot, int count) const
+{
+    return { &spheres.centerX[slot], &spheres.centerY[slot], &spheres.centerZ[slot], &spheres.radius[slot], count };
+}
+
+BoxBlock CompiledScene::getBoxes(uint32_t slot, int count) const
+{
+    return { &boxes.minX[slot], &boxes.minY[slot], &boxes.minZ[slot],
+             &boxes.maxX[slot], &boxes.maxY[slot], &boxes.maxZ[slot], count };
+}
+
+void CompiledScene::setSurface(const Primitive& primitive, Hit* hit) const
+{
+    if (primitive.surfaceType == SurfaceType::Light)
+    {
+        hit->setLight(lights[primitive.surface]);
+    }
+    else if (primitive.surfaceType == SurfaceType::Material)
+    {
+        hit->setMaterial(materials[primitive.surface]);
+    }
+    else
+    {
+        hit->clearSurface();
+    }
+}
+
+bool CompiledScene::intersectPrimitive(int index, const Ray& ray, float tMax, Hit* hit) const
+{
+    const Primitive& primitive = primitives[index];
+    uint32_t slot = primitive.slot;
+    if (primitive.type == PrimitiveType::Instance)
+    {
+        return instances[slot]->computeIntersection(ray, tMax, hit);
+    }
+
+    // local rays keep the scale of the transform like Instance::toLocal
+    const Transform* transform = primitive.transform >= 0 ? &transforms[primitive.transform] : nullptr;
+    Ray localRay = transform ? Ray::unnormalized(transform->inverseTransformPoint(ray.getRayOrigin()),
+                                                 transform->inverseTransformVector(ray.getRayDirection()))
+                             : ray;
+
+    bool found;
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        glm::vec3 center(spheres.centerX[slot], spheres.centerY[slot], spheres.centerZ[slot]);
+        found = Sphere::intersectSphere(center, spheres.radius[slot], localRay, tMax, hit);
+    }
+    else
+    {
+        glm::vec3 bMin(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+        glm::vec3 bMax(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+        found = Box::intersectBox(bMin, bMax, localRay, tMax, hit);
+    }
+    if (!found)
+    {
+        return false;
+    }
+
+    setSurface(primitive, hit);
+    if (transform)
+    {
+        hit->position = transform->transformPoint(hit->position);
+        hit->normal = transform->transformNormal(hit->normal);
+    }
+    return true;
+}
+
+bool CompiledScene::occludedBy(int index, const Ray& ray, float tMax, const Light* source) const
+{
+    const Primitive& primitive = primitives[index];
+    if (emits(primitive, source))
+    {
+        return false;
+    }
+
+    uint32_t slot = primitive.slot;
+    if (primitive.type == PrimitiveType::Instance)
+    {
+        return instances[slot]->occluded(ray, tMax);
+    }
+
+    const Transform* transform = primitive.transform >= 0 ? &transforms[primitive.transform] : nullptr;
+    Ray localRay = transform ? Ray::unnormalized(transform->inverseTransformPoint(ray.getRayOrigin()),
+                                                 transform->inverseTransformVector(ray.getRayDirection()))
+                             : ray;
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        glm::vec3 center(spheres.centerX[slot], spheres.centerY[slot], spheres.centerZ[slot]);
+        return Sphere::occludedSphere(center, spheres.radius[slot], localRay, tMax);
+    }
+    glm::vec3 bMin(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+    glm::vec3 bMax(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+    return Box::occludedBox(bMin, bMax, localRay, tMax);
+}
+
+uint32_t CompiledScene::intersectPrimitivePacket(int index, const RayPacket& packet, uint32_t laneMask, float* tMax, Hit* hits) const
+{
+    const Primitive& primitive = primitives[index];
+    uint32_t slot = primitive.slot;
+    if (primitive.type == PrimitiveType::Instance)
+    {
+        return instances[slot]->computeIntersectionPacket(packet, laneMask, tMax, hits, *kernels);
+    }
+
+    // the packet goes to local space once, unnormalized like in intersectPrimitive()
+    const Transform* transform = primitive.transform >= 0 ? &transforms[primitive.transform] : nullptr;
+    RayPacket localPacket;
+    if (transform)
+    {
+        transform->inverseTransformPacket(packet, &localPacket);
+    }
+    const RayPacket& local = transform ? localPacket : packet;
+
+    float t[PacketSize];
+    uint32_t backface;
+    uint32_t hitMask;
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        PT_STAT_ADD(StatSphereTests, __builtin_popcount(laneMask));
+        glm::vec3 center(spheres.centerX[slot], spheres.centerY[slot], spheres.centerZ[slot]);
+        float radius = spheres.radius[slot];
+        hitMask = kernels->intersectSpherePacket(center, radius, local, laneMask, tMax, t, &backface);
+        for (uint32_t lanes = hitMask; lanes; lanes &= lanes - 1)
+        {
+            int k = __builtin_ctz(lanes);
+            Sphere::setHit(center, radius, local.getOrigin(k), local.getDirection(k), t[k], (backface >> k) & 1u, &hits[k]);
+        }
+    }
+    else
+    {
+        PT_STAT_ADD(StatBoxTests, __builtin_popcount(laneMask));
+        glm::vec3 bMin(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+        glm::vec3 bMax(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+        hitMask = kernels->intersectBoxPacket(bMin, bMax, local, laneMask, tMax, t, &backface);
+        for (uint32_t lanes = hitMask; lanes; lanes &= lanes - 1)
+        {
+            int k = __builtin_ctz(lanes);
+            Box::setHit(bMin, bMax, local.getOrigin(k), local.getDirection(k), t[k], (backface >> k) & 1u, &hits[k]);
+        }
+    }
+
+    for (uint32_t lanes = hitMask; lanes; lanes &= lanes - 1)
+    {
+        int k = __builtin_ctz(lanes);
+        setSurface(primitive, &hits[k]);
+        if (transform)
+        {
+            hits[k].position = transform->transformPoint(hits[k].position);
+            hits[k].normal = transform->transformNormal(hits[k].normal);
+        }
+        tMax[k] = hits[k].t;
+    }
+    return hitMask;
+}
+
+uint32_t CompiledScene::occludedByPacket(int index, const RayPacket& packet, uint32_t laneMask, const float* tMax, const Light* source) const
+{
+    const Primitive& primitive = primitives[index];
+    if (emits(primitive, source))
+    {
+        return 0;
+    }
+
+    uint32_t slot = primitive.slot;
+    if (primitive.type == PrimitiveType::Instance)
+    {
+        return instances[slot]->occludedPacket(packet, laneMask, tMax, *kernels);
+    }
+
+    const Transform* transform = primitive.transform >= 0 ? &transforms[primitive.transform] : nullptr;
+    RayPacket localPacket;
+    if (transform)
+    {
+        transform->inverseTransformPacket(packet, &localPacket);
+    }
+    const RayPacket& local = transform ? localPacket : packet;
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        PT_STAT_ADD(StatSphereTests, __builtin_popcount(laneMask));
+        glm::vec3 center(spheres.centerX[slot], spheres.centerY[slot], spheres.centerZ[slot]);
+        return kernels->occludedSpherePacket(center, spheres.radius[slot], local, laneMask, tMax);
+    }
+    PT_STAT_ADD(StatBoxTests, __builtin_popcount(laneMask));
+    glm::vec3 bMin(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+    glm::vec3 bMax(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+    return kernels->occludedBoxPacket(bMin, bMax, local, laneMask, tMax);
+}
+
+bool CompiledScene::intersectLeaf(int first, int count, const Ray& ray, const WideRay& wideRay, float& tMax, Hit* hit) const
+{
+    bool hitAnything = false;
+    for (int i = first; i < first + count; i += primitives[i].batch)
+    {
+        const Primitive& primitive = primitives[i];
+        if (primitive.batch == 1)
+        {
+            if (intersectPrimitive(i, ray, tMax, hit))
+            {
+                tMax = hit->t;
+                hitAnything = true;
+            }
+            continue;
+        }
+
+        WideHit wideHit;
+        if (primitive.type == PrimitiveType::Sphere)
+        {
+            PT_STAT_ADD(StatSphereTests, primitive.batch);
+            wideHit = kernels->intersectSpheres(wideRay, getSpheres(primitive.slot, primitive.batch), tMax);
+            if (wideHit.lane >= 0)
+            {
+                uint32_t slot = primitive.slot + wideHit.lane;
+                glm::vec3 center(spheres.centerX[slot], spheres.centerY[slot], spheres.centerZ[slot]);
+                Sphere::setHit(center, spheres.radius[slot], wideRay.origin, wideRay.direction, wideHit.t, wideHit.backface, hit);
+            }
+        }
+        else
+        {
+            PT_STAT_ADD(StatBoxTests, primitive.batch);
+            wideHit = kernels->intersectBoxes(wideRay, getBoxes(primitive.slot, primitive.batch), tMax);
+            if (wideHit.lane >= 0)
+            {
+                uint32_t slot = primitive.slot + wideHit.lane;
+                glm::vec3 bMin(boxes.minX[slot], boxes.minY[slot], boxes.minZ[slot]);
+                glm::vec3 bMax(boxes.maxX[slot], boxes.maxY[slot], boxes.maxZ[slot]);
+                Box::setHit(bMin, bMax, wideRay.origin, wideRay.direction, wideHit.t, wideHit.backface, hit);
+            }
+        }
+        if (wideHit.lane >= 0)
+        {
+            setSurface(primitives[i + wideHit.lane], hit);
+            tMax = wideHit.t;
+            hitAnything = true;
+        }
+    }
+    return hitAnything;
+}
+
+bool CompiledScene::occludedLeaf(int first, int count, const Ray& ray, const WideRay& wideRay, float tMax, const Light* source) const
+{
+    for (int i = first; i < first + count; i += primitives[i].batch)
+    {
+        const Primitive& primitive = primitives[i];
+        if (primitive.batch == 1)
+        {
+            if (occludedBy(i, ray, tMax, source))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        uint32_t hitMask;
+        if (primitive.type == PrimitiveType::Sphere)
+        {
+            PT_STAT_ADD(StatSphereTests, primitive.batch);
+            hitMask = kernels->occludedSpheres(wideRay, getSpheres(primitive.slot, primitive.batch), tMax);
+        }
+        else
+        {
+            PT_STAT_ADD(StatBoxTests, primitive.batch);
+            hitMask = kernels->occludedBoxes(wideRay, getBoxes(primitive.slot, primitive.batch), tMax);
+        }
+
+        // emitters of source in the run do not block
+        while (hitMask)
+        {
+            int lane = __builtin_ctz(hitMask);
+            hitMask &= hitMask - 1;
+            if (!emits(primitives[i + lane], source))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool CompiledScene::intersect(const Ray& ray, Hit* hit) const
+{
+    WideRay wideRay(ray);
+    return bvh.traverseLeaves(ray, std::numeric_limits<float>::infinity(), [&](int first, int count, float& tMax)
+    {
+        return intersectLeaf(first, count, ray, wideRay, tMax, hit);
+    });
+}
+
+bool CompiledScene::occluded(const Ray& ray, float tMax, const Light* source) const
+{
+    WideRay wideRay(ray);
+    return bvh.traverseAnyLeaves(ray, tMax, [&](int first, int count)
+    {
+        return occludedLeaf(first, count, ray, wideRay, tMax, source);
+    });
+}
+
+uint32_t CompiledScene::intersectPacket(const RayPacket& packet, float* tMax, Hit* hits) const
+{
+    uint32_t hitMask = 0;
+    bvh.traversePacket(packet, tMax, *kernels, [&](int index, uint32_t laneMask)
+    {
+        hitMask |= intersectPrimitivePacket(index, packet, laneMask, tMax, hits);
+    });
+    return hitMask;
+}
+
+uint32_t CompiledScene::occludedPacket(const RayPacket& packet, const float* tMax, const Light* source) const
+{
+    return bvh.traverseAnyPacket(packet, tMax, *kernels, [&](int index, uint32_t laneMask)
+    {
+        return occludedByPacket(index, packet, laneMask, tMax, source);
+    });
+}
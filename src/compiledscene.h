@@ -0,0 +1,99 @@
+#ifndef COMPILEDSCENE_H
+#define COMPILEDSCENE_H
+
+#include "instance.h"
+#include "bvh.h"
+#include "transform.h"
+#include "widekernels.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Render time copy of a finalized scene's instances, sorted by shape type
+// instead of held behind Shape pointers. Spheres and boxes go into arrays of
+// their own, one array per coordinate, and are tested by a switch on their
+// type with the same math as Sphere and Box; other shapes keep going through
+// their Instance. Primitives are numbered in the leaf order of the scene's
+// BVH, so a leaf covers a contiguous run of them.
+//
+// With SIMD kernels available, subtrees of up to WideKernels::maxWidth
+// primitives are merged into one leaf, and the untransformed spheres and
+// boxes at the front of every leaf are tested in one go.
+class CompiledScene
+{
+    public:
+        enum class PrimitiveType : uint8_t { Sphere, Box, Instance };
+
+    private:
+        enum class SurfaceType : uint8_t { None, Light, Material };
+
+        // 16 bytes per primitive, what the traversal reads before the geometry
+        struct Primitive
+        {
+            PrimitiveType type;
+            SurfaceType surfaceType;
+            uint8_t batch;          // this and the next batch - 1 primitives go to one wide kernel call, 0 if it is not the first
+            int32_t transform;      // index into transforms, -1 for none
+            uint32_t slot;          // index into the arrays of its type, or into instances
+            uint32_t surface;       // index into lights or materials
+        };
+
+        struct Spheres
+        {
+            std::vector<float> centerX, centerY, centerZ;
+            std::vector<float> radius;
+        };
+
+        struct Boxes
+        {
+            std::vector<float> minX, minY, minZ;
+            std::vector<float> maxX, maxY, maxZ;
+        };
+
+        std::vector<Primitive> primitives;
+        // padded by maxWidth entries so a block can be loaded from any slot
+        Spheres spheres;
+        Boxes boxes;
+        int sphereCount = 0;
+        int boxCount = 0;
+        std::vector<const Instance*> instances;
+        std::vector<Transform> transforms;
+        std::vector<const Light*> lights;
+        std::vector<const Material*> materials;
+        // the scene's hierarchy with primitive i in place of the i-th primIndices entry
+        BVH bvh;
+        const WideKernels* kernels = nullptr;
+
+        bool intersectPrimitive(int index, const Ray& ray, float tMax, Hit* hit) const;
+        bool occludedBy(int index, const Ray& ray, float tMax, const Light* source) const;
+        uint32_t intersectPrimitivePacket(int index, const RayPacket& packet, uint32_t laneMask, float* tMax, Hit* hits) const;
+        uint32_t occludedByPacket(int index, const RayPacket& packet, uint32_t laneMask, const float* tMax, const Light* source) const;
+        bool intersectLeaf(int first, int count, const Ray& ray, const WideRay& wideRay, float& tMax, Hit* hit) const;
+        bool occludedLeaf(int first, int count, const Ray& ray, const WideRay& wideRay, float tMax, const Light* source) const;
+        bool emits(const Primitive& primitive, const Light* source) const
+        {
+            return source && primitive.surfaceType == SurfaceType::Light && lights[primitive.surface] == source;
+        }
+        void setSurface(const Primitive& primitive, Hit* hit) const;
+        SphereBlock getSpheres(uint32_t slot, int count) const;
+        BoxBlock getBoxes(uint32_t slot, int count) const;
+
+    public:
+        // flattens the instances, bvh must be the one built over them; simd
+        // picks the kernels, falling back to what the CPU supports
+        void build(const std::vector<std::unique_ptr<Instance>>& objects, const BVH& sceneBVH, SimdLevel simd);
+        void clear();
+        bool isEmpty() const { return primitives.empty(); }
+        int getCount(PrimitiveType type) const;
+        SimdLevel getSimdLevel() const { return kernels ? kernels->level : SimdLevel::Scalar; }
+
+        // the same results as Scene's traversal over the instances
+        bool intersect(const Ray& ray, Hit* hit) const;
+        // skips the emitters of source like Scene::occluded
+        bool occluded(const Ray& ray, float tMax, const Light* source) const;
+        // packet versions of the two, spheres and boxes go through the packet
+        // kernels; intersectPacket lowers tMax for every lane it hits
+        uint32_t intersectPacket(const RayPacket& packet, float* tMax, Hit* hits) const;
+        uint32_t occludedPacket(const RayPacket& packet, const float* tMax, const Light* source) const;
+};
+#endif
@@ -0,0 +1,263 @@
+#include "denoiser.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+namespace
+{
+    const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    const int rowsPerBlock = 16;
+
+    // runs fn(y0, y1) over blocks of rows, on the pool when there is one
+    template<typename RowFn>
+    void forEachRows(ThreadPool* pool, int height, RowFn&& fn)
+    {
+        int numBlocks = (height + rowsPerBlock - 1) / rowsPerBlock;
+        auto runBlock = [&](int block, int)
+        {
+            int y0 = block * rowsPerBlock;
+            fn(y0, std::min(y0 + rowsPerBlock, height));
+        };
+        if (pool)
+        {
+            pool->parallelFor(numBlocks, runBlock);
+        }
+        else
+        {
+            for (int block = 0; block < numBlocks; block++)
+            {
+                runBlock(block, 0);
+            }
+        }
+    }
+
+    // x ^ 32 by squaring, the normal weight; a sharper one leaves pixels on
+    // silhouettes, whose normal is a mix of both sides, without any taps
+    float pow32(float x)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            x *= x;
+        }
+        return x;
+    }
+}
+
+void Denoiser::prepare(const Film& film, Buffers* buffers, ThreadPool* pool) const
+{
+    int width = film.getWidth();
+    int height = film.getHeight();
+    size_t numPixels = static_cast<size_t>(width) * height;
+    buffers->illumination.resize(numPixels);
+    buffers->variance.resize(numPixels);
+    buffers->albedo.resize(numPixels);
+    buffers->normal.resize(numPixels);
+    buffers->depth.resize(numPixels);
+    buffers->depthGradient.resize(numPixels);
+    buffers->valid.resize(numPixels);
+
+    forEachRows(pool, height, [&](int y0, int y1)
+    {
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t index = static_cast<size_t>(j) * width + i;
+                const PixelAccumulator& pixel = film.getAccumulation(i, j);
+                const AOVAccumulator& aov = film.getAOV(i, j);
+
+                // channels without albedo, e.g. on misses, pass through undivided
+                glm::vec3 albedo = aov.count > 0 ? aov.albedo / static_cast<float>(aov.count) : glm::vec3(0.0f);
+                for (int c = 0; c < 3; c++)
+                {
+                    albedo[c] = albedo[c] > 1e-3f ? albedo[c] : 1.0f;
+                }
+                glm::vec3 mean = pixel.mean();
+                buffers->albedo[index] = albedo;
+                buffers->illumination[index] = mean / albedo;
+
+                // variance of the mean luminance, a pixel with a single sample gets
+                // one as large as its value
+                float y = luminance(mean);
+                float variance = y * y;
+                if (pixel.count > 1)
+                {
+                    float n = static_cast<float>(pixel.count);
+                    variance = std::max(0.0f, pixel.squaredSum / n - y * y) / n;
+                }
+                float albedoLuminance = luminance(albedo);
+                buffers->variance[index] = variance / (albedoLuminance * albedoLuminance);
+
+                float normalLength = glm::length(aov.normal);
+                bool valid = aov.hits > 0 && normalLength > 0.0f;
+                buffers->valid[index] = valid ? 1 : 0;
+                buffers->normal[index] = valid ? aov.normal / normalLength : glm::vec3(0.0f);
+                buffers->depth[index] = valid ? aov.depth / static_cast<float>(aov.hits) : 0.0f;
+            }
+        }
+    });
+
+    // the smaller of the one sided differences, so a silhouette next to the
+    // pixel does not count as a steep surface
+    forEachRows(pool, height, [&](int y0, int y1)
+    {
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t index = static_cast<size_t>(j) * width + i;
+                float z = buffers->depth[index];
+                auto axisGradient = [&](int di, int dj)
+                {
+                    float gradient = std::numeric_limits<float>::infinity();
+                    for (int side = -1; side <= 1; side += 2)
+                    {
+                        int x = i + side * di;
+                        int y = j + side * dj;
+                        if (x >= 0 && x < width && y >= 0 && y < height && buffers->valid[static_cast<size_t>(y) * width + x])
+                        {
+                            gradient = std::min(gradient, std::abs(buffers->depth[static_cast<size_t>(y) * width + x] - z));
+                        }
+                    }
+                    return std::isinf(gradient) ? 0.0f : gradient;
+                };
+                buffers->depthGradient[index] = buffers->valid[index] ? std::max(axisGradient(1, 0), axisGradient(0, 1)) : 0.0f;
+            }
+        }
+    });
+}
+
+void Denoiser::blurVariance(const std::vector<float>& variance, int width, int height, std::vector<float>* out, ThreadPool* pool) const
+{
+    const float weights[3] = { 0.25f, 0.5f, 0.25f };
+    forEachRows(pool, height, [&](int y0, int y1)
+    {
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                float sum = 0.0f;
+                float weightSum = 0.0f;
+                for (int dj = -1; dj <= 1; dj++)
+                {
+                    for (int di = -1; di <= 1; di++)
+                    {
+                        int x = i + di;
+                        int y = j + dj;
+                        if (x >= 0 && x < width && y >= 0 && y < height)
+                        {
+                            float w = weights[di + 1] * weights[dj + 1];
+                            sum += w * variance[static_cast<size_t>(y) * width + x];
+                            weightSum += w;
+                        }
+                    }
+                }
+                (*out)[static_cast<size_t>(j) * width + i] = sum / weightSum;
+            }
+        }
+    });
+}
+
+void Denoiser::filterPass(const Buffers& buffers, int width, int height, int step, const std::vector<glm::vec3>& in,
+                          const std::vector<float>& variance, std::vector<glm::vec3>* out, std::vector<float>* outVariance, ThreadPool* pool) const
+{
+    std::vector<float> blurred(variance.size());
+    blurVariance(variance, width, height, &blurred, pool);
+
+    forEachRows(pool, height, [&](int y0, int y1)
+    {
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                size_t p = static_cast<size_t>(j) * width + i;
+                glm::vec3 center = in[p];
+                float centerLuminance = luminance(center);
+                float luminanceScale = sigmaLuminance * std::sqrt(blurred[p]) + 1e-6f;
+                bool valid = buffers.valid[p] != 0;
+                const glm::vec3& normal = buffers.normal[p];
+                float depth = buffers.depth[p];
+                float depthScale = sigmaDepth * buffers.depthGradient[p] * step;
+                float depthEpsilon = 1e-3f * depth + 1e-6f;
+
+                float centerWeight = kernel[2] * kernel[2];
+                glm::vec3 sum = centerWeight * center;
+                float varianceSum = centerWeight * centerWeight * variance[p];
+                float weightSum = centerWeight;
+                for (int dj = -2; dj <= 2; dj++)
+                {
+                    int y = j + dj * step;
+                    if (y < 0 || y >= height)
+                    {
+                        continue;
+                    }
+                    for (int di = -2; di <= 2; di++)
+                    {
+                        int x = i + di * step;
+                        if ((di == 0 && dj == 0) || x < 0 || x >= width)
+                        {
+                            continue;
+                        }
+                        size_t q = static_cast<size_t>(y) * width + x;
+                        // surfaces only mix with surfaces, background with background
+                        if ((buffers.valid[q] != 0) != valid)
+                        {
+                            continue;
+                        }
+
+                        float w = kernel[di + 2] * kernel[dj + 2]
+                            * std::exp(-std::abs(centerLuminance - luminance(in[q])) / luminanceScale);
+                        if (valid)
+                        {
+                            float distance = std::sqrt(static_cast<float>(di * di + dj * dj));
+                            w *= pow32(std::max(0.0f, glm::dot(normal, buffers.normal[q])));
+                            w *= std::exp(-std::abs(depth - buffers.depth[q]) / (depthScale * distance + depthEpsilon));
+                        }
+                        sum += w * in[q];
+                        varianceSum += w * w * variance[q];
+                        weightSum += w;
+                    }
+                }
+                (*out)[p] = sum / weightSum;
+                (*outVariance)[p] = varianceSum / (weightSum * weightSum);
+            }
+        }
+    });
+}
+
+bool Denoiser::denoise(Film* film, ThreadPool* pool) const
+{
+    if (!film->hasAOVs())
+    {
+        std::cerr << "Cannot denoise, the film has no AOVs" << std::endl;
+        return false;
+    }
+
+    int width = film->getWidth();
+    int height = film->getHeight();
+    Buffers buffers;
+    prepare(*film, &buffers, pool);
+
+    std::vector<glm::vec3> illumination = buffers.illumination;
+    std::vector<float> variance = buffers.variance;
+    std::vector<glm::vec3> filtered(illumination.size());
+    std::vector<float> filteredVariance(variance.size());
+    for (int pass = 0; pass < iterations; pass++)
+    {
+        filterPass(buffers, width, height, 1 << pass, illumination, variance, &filtered, &filteredVariance, pool);
+        illumination.swap(filtered);
+        variance.swap(filteredVariance);
+    }
+
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            size_t index = static_cast<size_t>(j) * width + i;
+            film->setValue(i, j, illumination[index] * buffers.albedo[index]);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "film.h"
+#include "threadpool.h"
+#include <vector>
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by the
+// film's AOVs and per pixel variance as in SVGF (Schied et al. 2017). The
+// image is divided by its albedo before filtering and multiplied back after,
+// so only the lighting gets blurred. Every pass applies a 5x5 B-spline kernel
+// with taps spread twice as far as in the pass before, and a tap only counts
+// as much as its luminance, normal and depth agree with the center pixel.
+class Denoiser
+{
+    private:
+        // per pixel inputs, rows top to bottom
+        struct Buffers
+        {
+            std::vector<glm::vec3> illumination;
+            std::vector<float> variance;
+            std::vector<glm::vec3> albedo;
+            std::vector<glm::vec3> normal;
+            std::vector<float> depth;
+            // how much the depth changes from one pixel to the next
+            std::vector<float> depthGradient;
+            // some sample of the pixel hit a surface
+            std::vector<uint8_t> valid;
+        };
+
+        // three passes reach 29 pixels across; more blur shading detail away
+        // faster than they remove noise at 8 samples per pixel
+        int iterations = 3;
+        float sigmaLuminance = 8.0f;
+        float sigmaDepth = 1.0f;
+
+        void prepare(const Film& film, Buffers* buffers, ThreadPool* pool) const;
+        void filterPass(const Buffers& buffers, int width, int height, int step, const std::vector<glm::vec3>& in,
+                        const std::vector<float>& variance, std::vector<glm::vec3>* out, std::vector<float>* outVariance, ThreadPool* pool) const;
+        // 3x3 blur of the variance, steadier edge stopping than the raw estimate
+        void blurVariance(const std::vector<float>& variance, int width, int height, std::vector<float>* out, ThreadPool* pool) const;
+
+    public:
+        void setIterations(int count) { iterations = count; }
+        // replaces the film's image by the filtered one, needs a film that recorded
+        // AOVs; runs on the pool when one is given
+        bool denoise(Film* film, ThreadPool* pool = nullptr) const;
+};
+
+#endif
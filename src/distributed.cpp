@@ -0,0 +1,492 @@
+#include "distributed.h"
+#include "net.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    const uint32_t protocolVersion = 2;
+    // a result holds the accumulators of one tile, anything larger is garbage
+    const uint32_t maxMessageSize = 1u << 28;
+    // seconds a new connection has to greet
+    const double greetingTimeout = 10.0;
+    // least seconds a worker gets for a job when the deadline follows the slowest job
+    const double minJobTimeout = 30.0;
+
+    using Clock = std::chrono::steady_clock;
+
+    enum class MessageType : uint32_t { Hello = 1, Job, Result, Done };
+
+    struct MessageHeader
+    {
+        MessageType type;
+        uint32_t size;
+    };
+
+    // first message of a worker, the coordinator checks it renders the same image
+    struct HelloMessage
+    {
+        uint32_t version;
+        int32_t pid;
+        int32_t width;
+        int32_t height;
+        int32_t dMax;
+        int32_t threads;
+        uint64_t sceneHash;
+        uint64_t cameraHash;
+        uint64_t settingsKey;
+        char host[64];
+    };
+
+    struct JobMessage
+    {
+        uint32_t id;
+        int32_t x0, y0;
+        int32_t x1, y1;
+        uint32_t firstSample;
+        uint32_t lastSample;
+    };
+
+    // followed by numPixels accumulators, row by row
+    struct ResultMessage
+    {
+        uint32_t id;
+        uint32_t numPixels;
+    };
+
+    bool sendMessage(int fd, MessageType type, const void* payload, size_t size, const void* extra = nullptr, size_t extraSize = 0)
+    {
+        // one buffer, so a message leaves in as few packets as possible
+        MessageHeader header = { type, static_cast<uint32_t>(size + extraSize) };
+        std::vector<uint8_t> buffer(reinterpret_cast<const uint8_t*>(&header), reinterpret_cast<const uint8_t*>(&header + 1));
+        buffer.insert(buffer.end(), static_cast<const uint8_t*>(payload), static_cast<const uint8_t*>(payload) + size);
+        buffer.insert(buffer.end(), static_cast<const uint8_t*>(extra), static_cast<const uint8_t*>(extra) + extraSize);
+        return sendAll(fd, buffer.data(), buffer.size());
+    }
+
+    bool receiveMessage(int fd, MessageHeader* header, std::vector<uint8_t>* payload)
+    {
+        if (!receiveAll(fd, header, sizeof(*header)) || header->size > maxMessageSize)
+        {
+            return false;
+        }
+        payload->resize(header->size);
+        return header->size == 0 || receiveAll(fd, payload->data(), header->size);
+    }
+
+    int getTilePixels(const Tile& tile)
+    {
+        return (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    }
+}
+
+RenderCoordinator::RenderCoordinator(const std::string& address)
+    : address(address), jobTileSize(64), jobSamples(0), jobsPerWorker(2), jobTimeout(0.0) {}
+
+std::vector<RenderCoordinator::Job> RenderCoordinator::createJobs(const Film& film, uint32_t numSamples) const
+{
+    // whole sample ranges over the image first, so an early stop still covers every pixel
+    std::vector<Tile> tiles = film.generateTiles(jobTileSize);
+    uint32_t step = jobSamples > 0 ? jobSamples : numSamples;
+    std::vector<Job> jobs;
+    for (uint32_t first = 0; first < numSamples; first += step)
+    {
+        for (const Tile& tile : tiles)
+        {
+            jobs.push_back({ tile, first, std::min(first + step, numSamples) });
+        }
+    }
+    return jobs;
+}
+
+bool RenderCoordinator::render(Film* film, const Camera* camera, const Scene* scene, uint32_t numSamples, int dMax,
+                               uint64_t settingsKey)
+{
+    SocketAddress parsed;
+    if (!parseSocketAddress(address, &parsed))
+    {
+        return false;
+    }
+    int listenFd = listenOn(parsed);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+
+    uint64_t sceneHash = scene->getContentHash();
+    uint64_t cameraHash = camera->getHash();
+    film->clearAccumulation();
+    std::vector<Job> jobs = createJobs(*film, numSamples);
+    std::deque<int> pending;
+    for (size_t id = 0; id < jobs.size(); id++)
+    {
+        pending.push_back(static_cast<int>(id));
+    }
+    std::vector<uint8_t> finished(jobs.size(), 0);
+    size_t remaining = jobs.size();
+    std::vector<Connection> connections;
+    int numWorkers = 0;
+    int numRequeued = 0;
+    // longest a worker took to return a job, in seconds
+    double slowestJob = 0.0;
+    size_t reportedTenths = 0;
+    std::cout << "Waiting for workers on " << address << " to render " << jobs.size() << " jobs" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+
+    // closes the connection and puts its unfinished jobs back at the front of the queue
+    auto drop = [&](Connection& connection, const char* reason)
+    {
+        int requeued = 0;
+        for (auto it = connection.jobs.rbegin(); it != connection.jobs.rend(); ++it)
+        {
+            if (!finished[*it])
+            {
+                pending.push_front(*it);
+                requeued++;
+            }
+        }
+        numRequeued += requeued;
+        if (connection.ready)
+        {
+            std::cout << "Lost " << connection.name << " (" << reason << "), requeued " << requeued << " jobs" << std::endl;
+        }
+        else if (connection.name.empty())
+        {
+            std::cerr << "Closed a connection before its greeting (" << reason << ")" << std::endl;
+        }
+        ::close(connection.fd);
+        connection.fd = -1;
+        connection.ready = false;
+        connection.jobs.clear();
+        connection.buffer.clear();
+    };
+
+    // takes in one message of a connection, dropping it when the message is not
+    // what the worker should send now
+    auto handleMessage = [&](Connection& connection, const MessageHeader& header, const uint8_t* payload)
+    {
+        if (!connection.ready)
+        {
+            HelloMessage hello;
+            if (header.type != MessageType::Hello || header.size != sizeof(hello))
+            {
+                drop(connection, "no greeting");
+                return;
+            }
+            std::memcpy(&hello, payload, sizeof(hello));
+            hello.host[sizeof(hello.host) - 1] = '\0';
+            connection.name = std::string(hello.host) + ":" + std::to_string(hello.pid);
+            const char* mismatch = hello.version != protocolVersion ? "different protocol version"
+                : hello.width != film->getWidth() || hello.height != film->getHeight() ? "different resolution"
+                : hello.sceneHash != sceneHash ? "different scene"
+                : hello.cameraHash != cameraHash ? "different camera"
+                : hello.dMax != dMax || hello.settingsKey != settingsKey ? "different render settings" : nullptr;
+            if (mismatch)
+            {
+                std::cerr << "Rejected worker " << connection.name << ": " << mismatch << std::endl;
+                drop(connection, mismatch);
+                return;
+            }
+            connection.ready = true;
+            numWorkers++;
+            std::cout << "Worker " << connection.name << " joined with " << hello.threads << " threads" << std::endl;
+            return;
+        }
+
+        ResultMessage result;
+        if (header.type != MessageType::Result || header.size < sizeof(result))
+        {
+            drop(connection, "unexpected message");
+            return;
+        }
+        std::memcpy(&result, payload, sizeof(result));
+        auto assigned = std::find(connection.jobs.begin(), connection.jobs.end(), static_cast<int>(result.id));
+        if (assigned == connection.jobs.end()
+            || result.numPixels != static_cast<uint32_t>(getTilePixels(jobs[result.id].tile))
+            || header.size != sizeof(result) + result.numPixels * sizeof(PixelAccumulator))
+        {
+            drop(connection, "malformed result");
+            return;
+        }
+        connection.jobs.erase(assigned);
+        auto now = Clock::now();
+        slowestJob = std::max(slowestJob, std::chrono::duration<double>(now - connection.lastProgress).count());
+        connection.lastProgress = now;
+        if (!finished[result.id])
+        {
+            std::vector<PixelAccumulator> pixels(result.numPixels);
+            std::memcpy(pixels.data(), payload + sizeof(result), pixels.size() * sizeof(PixelAccumulator));
+            film->mergeAccumulation(jobs[result.id].tile, pixels.data());
+            finished[result.id] = 1;
+            remaining--;
+        }
+
+        size_t tenths = (jobs.size() - remaining) * 10 / jobs.size();
+        if (tenths > reportedTenths)
+        {
+            reportedTenths = tenths;
+            std::chrono::duration<double> elapsed = now - start;
+            std::cout << "Jobs done: " << jobs.size() - remaining << "/" << jobs.size() << " after "
+                      << elapsed.count() << "s" << std::endl;
+        }
+    };
+
+    // reads what arrived without waiting for the rest of a message, so a
+    // worker that stalls halfway through one cannot hold up the others
+    std::vector<uint8_t> chunk(1 << 16);
+    auto receive = [&](Connection& connection)
+    {
+        ssize_t received = ::recv(connection.fd, chunk.data(), chunk.size(), MSG_DONTWAIT);
+        if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (received <= 0)
+        {
+            drop(connection, "disconnected");
+            return;
+        }
+        std::vector<uint8_t>& buffer = connection.buffer;
+        buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + received);
+
+        size_t offset = 0;
+        while (connection.fd >= 0 && buffer.size() - offset >= sizeof(MessageHeader))
+        {
+            MessageHeader header;
+            std::memcpy(&header, buffer.data() + offset, sizeof(header));
+            // nothing but the greeting may come before the worker is accepted
+            size_t limit = connection.ready ? maxMessageSize : sizeof(HelloMessage);
+            if (header.size > limit)
+            {
+                drop(connection, "oversized message");
+                return;
+            }
+            if (buffer.size() - offset - sizeof(header) < header.size)
+            {
+                break;
+            }
+            const uint8_t* payload = buffer.data() + offset + sizeof(header);
+            offset += sizeof(header) + header.size;
+            handleMessage(connection, header, payload);
+        }
+        if (connection.fd >= 0)
+        {
+            buffer.erase(buffer.begin(), buffer.begin() + offset);
+        }
+    };
+
+    std::vector<pollfd> pollFds;
+    while (remaining > 0)
+    {
+        auto now = Clock::now();
+        for (Connection& connection : connections)
+        {
+            while (connection.ready && connection.jobs.size() < jobsPerWorker && !pending.empty())
+            {
+                int id = pending.front();
+                const Job& job = jobs[id];
+                JobMessage message = { static_cast<uint32_t>(id), job.tile.x0, job.tile.y0, job.tile.x1, job.tile.y1,
+                                       job.firstSample, job.lastSample };
+                if (!sendMessage(connection.fd, MessageType::Job, &message, sizeof(message)))
+                {
+                    drop(connection, "send failed");
+                    break;
+                }
+                if (connection.jobs.empty())
+                {
+                    connection.lastProgress = now;
+                }
+                pending.pop_front();
+                connection.jobs.push_back(id);
+            }
+        }
+
+        // a worker that froze, or whose machine is gone without the socket
+        // closing, would keep its jobs forever
+        double timeout = jobTimeout > 0.0 ? jobTimeout : std::max(10.0 * slowestJob, minJobTimeout);
+        for (Connection& connection : connections)
+        {
+            double waited = std::chrono::duration<double>(now - connection.lastProgress).count();
+            if (!connection.ready && connection.fd >= 0 && waited > greetingTimeout)
+            {
+                drop(connection, "no greeting");
+            }
+            else if (!connection.jobs.empty() && (jobTimeout > 0.0 || slowestJob > 0.0) && waited > timeout)
+            {
+                drop(connection, "job past its deadline");
+            }
+        }
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                         [](const Connection& connection) { return connection.fd < 0; }),
+                          connections.end());
+
+        pollFds.assign(1, pollfd{ listenFd, POLLIN, 0 });
+        for (const Connection& connection : connections)
+        {
+            pollFds.push_back(pollfd{ connection.fd, POLLIN, 0 });
+        }
+        // wake up now and then to check the deadlines
+        if (::poll(pollFds.data(), pollFds.size(), 1000) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Failed to wait for workers: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (size_t c = 0; c < connections.size(); c++)
+        {
+            if (pollFds[c + 1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                receive(connections[c]);
+            }
+        }
+
+        if (pollFds[0].revents & POLLIN)
+        {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                enableKeepAlive(fd);
+                connections.push_back(Connection{ fd, "", {}, {}, Clock::now(), false });
+            }
+        }
+    }
+
+    for (Connection& connection : connections)
+    {
+        if (connection.fd >= 0)
+        {
+            sendMessage(connection.fd, MessageType::Done, nullptr, 0);
+            ::close(connection.fd);
+        }
+    }
+    ::close(listenFd);
+    if (parsed.local)
+    {
+        ::unlink(parsed.path.c_str());
+    }
+    if (remaining > 0)
+    {
+        return false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Rendered " << jobs.size() << " jobs on " << numWorkers << " workers in " << elapsed.count()
+              << "s, " << numRequeued << " jobs reassigned" << std::endl;
+    return true;
+}
+
+RenderWorker::RenderWorker(const std::string& address)
+    : address(address), connectTimeout(10.0) {}
+
+bool RenderWorker::run(PathTracer* pathtracer, Film* film, Camera* camera, Scene* scene, int dMax)
+{
+    SocketAddress parsed;
+    if (!parseSocketAddress(address, &parsed))
+    {
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int fd = connectTo(parsed);
+    while (fd < 0)
+    {
+        std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+        if (waited.count() >= connectTimeout)
+        {
+            std::cerr << "Failed to connect to the coordinator at " << address << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        fd = connectTo(parsed);
+    }
+
+    HelloMessage hello = {};
+    hello.version = protocolVersion;
+    hello.pid = static_cast<int32_t>(::getpid());
+    hello.width = film->getWidth();
+    hello.height = film->getHeight();
+    hello.dMax = dMax;
+    hello.threads = pathtracer->getThreadCount();
+    hello.sceneHash = scene->getContentHash();
+    hello.cameraHash = camera->getHash();
+    hello.settingsKey = pathtracer->settingsKey(film, camera, scene, dMax);
+    ::gethostname(hello.host, sizeof(hello.host) - 1);
+    if (!sendMessage(fd, MessageType::Hello, &hello, sizeof(hello)))
+    {
+        std::cerr << "Failed to greet the coordinator at " << address << std::endl;
+        ::close(fd);
+        return false;
+    }
+    enableKeepAlive(fd);
+    std::cout << "Connected to " << address << std::endl;
+
+    int numJobs = 0;
+    uint64_t numSamples = 0;
+    MessageHeader header;
+    std::vector<uint8_t> payload;
+    std::vector<PixelAccumulator> pixels;
+    bool done = false;
+    while (!done)
+    {
+        if (!receiveMessage(fd, &header, &payload))
+        {
+            std::cerr << "Lost the coordinator at " << address << std::endl;
+            break;
+        }
+        if (header.type == MessageType::Done)
+        {
+            done = true;
+            break;
+        }
+
+        JobMessage job;
+        if (header.type != MessageType::Job || payload.size() != sizeof(job))
+        {
+            std::cerr << "Unexpected message from the coordinator" << std::endl;
+            break;
+        }
+        std::memcpy(&job, payload.data(), sizeof(job));
+        Tile tile = { job.x0, job.y0, job.x1, job.y1 };
+        if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 > film->getWidth() || tile.y1 > film->getHeight()
+            || tile.x0 >= tile.x1 || tile.y0 >= tile.y1 || job.firstSample > job.lastSample)
+        {
+            std::cerr << "Invalid job from the coordinator" << std::endl;
+            break;
+        }
+
+        pathtracer->renderRegion(film, camera, scene, tile, job.firstSample, job.lastSample, dMax);
+        pixels.clear();
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                pixels.push_back(film->getAccumulation(i, j));
+            }
+        }
+        ResultMessage result = { job.id, static_cast<uint32_t>(pixels.size()) };
+        if (!sendMessage(fd, MessageType::Result, &result, sizeof(result), pixels.data(), pixels.size() * sizeof(PixelAccumulator)))
+        {
+            std::cerr << "Lost the coordinator at " << address << std::endl;
+            break;
+        }
+        numJobs++;
+        numSamples += static_cast<uint64_t>(pixels.size()) * (job.lastSample - job.firstSample);
+    }
+    ::close(fd);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Rendered " << numJobs << " jobs (" << numSamples << " samples) for " << address << " in "
+              << elapsed.count() << "s" << std::endl;
+    return done;
+}
@@ -0,0 +1,84 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "film.h"
+#include "pathtracer.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Renders one film across processes. The coordinator splits the image into
+// jobs of a tile and a range of samples and hands them out to workers that
+// connect to it; every worker loads the same scene, renders its jobs and
+// sends back their accumulators, which the coordinator adds into its film.
+// The jobs of a worker that disconnects, or stops returning them in time,
+// go back into the queue.
+//
+// Addresses are "unix:/path/to/socket" or "host:port" for TCP. Messages are
+// raw structs in host byte order, so all processes must run the same build
+// on the same kind of machine.
+class RenderCoordinator
+{
+    private:
+        struct Job
+        {
+            Tile tile;
+            uint32_t firstSample;
+            uint32_t lastSample;
+        };
+
+        struct Connection
+        {
+            int fd;
+            std::string name;
+            // jobs sent and not yet returned
+            std::vector<int> jobs;
+            // received bytes that do not make a whole message yet
+            std::vector<uint8_t> buffer;
+            // when the connection was accepted, last returned a job or was
+            // handed one while idle
+            std::chrono::steady_clock::time_point lastProgress;
+            bool ready;
+        };
+
+        std::string address;
+        int jobTileSize;
+        uint32_t jobSamples;
+        // jobs in flight per worker, the second one hides the round trip
+        size_t jobsPerWorker;
+        double jobTimeout;
+
+        std::vector<Job> createJobs(const Film& film, uint32_t numSamples) const;
+
+    public:
+        explicit RenderCoordinator(const std::string& address);
+        void setJobTileSize(int size) { jobTileSize = size; }
+        // samples per pixel of one job, 0 renders all samples of a tile in one job
+        void setJobSamples(uint32_t samples) { jobSamples = samples; }
+        // a worker that returns no job for this many seconds is dropped and its
+        // jobs go to the others; 0 waits ten times the slowest job so far, at
+        // least 30 seconds, and not at all before the first job came back
+        void setJobTimeout(double seconds) { jobTimeout = seconds; }
+        // listens on the address and blocks until workers rendered every job; a
+        // worker is only accepted with the same film size, scene, camera and
+        // settings key
+        bool render(Film* film, const Camera* camera, const Scene* scene, uint32_t numSamples, int dMax,
+                    uint64_t settingsKey);
+};
+
+class RenderWorker
+{
+    private:
+        std::string address;
+        // keep trying to connect this long, the coordinator may still be starting
+        double connectTimeout;
+
+    public:
+        explicit RenderWorker(const std::string& address);
+        void setConnectTimeout(double seconds) { connectTimeout = seconds; }
+        // renders jobs for the coordinator until it says it is done
+        bool run(PathTracer* pathtracer, Film* film, Camera* camera, Scene* scene, int dMax);
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "distribution.h"
+
+void AliasTable::build(const std::vector<float>& weights)
+{
+    bins.clear();
+    double total = 0.0;
+    for (float weight : weights)
+    {
+        total += weight;
+    }
+    if (weights.empty() || total <= 0.0)
+    {
+        return;
+    }
+
+    // scale the weights so the average bin holds 1, then let every
+    // underfull bin take its remainder from an overfull one
+    size_t n = weights.size();
+    bins.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+    for (size_t i = 0; i < n; i++)
+    {
+        bins[i].pdf = static_cast<float>(weights[i] / total);
+        scaled[i] = weights[i] * n / total;
+        (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+    }
+
+    while (!small.empty() && !large.empty())
+    {
+        uint32_t under = small.back();
+        small.pop_back();
+        uint32_t over = large.back();
+
+        bins[under].probability = static_cast<float>(scaled[under]);
+        bins[under].alias = over;
+        scaled[over] -= 1.0 - scaled[under];
+        if (scaled[over] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(over);
+        }
+    }
+
+    // whatever is left is full up to rounding
+    for (uint32_t i : large)
+    {
+        bins[i].probability = 1.0f;
+        bins[i].alias = i;
+    }
+    for (uint32_t i : small)
+    {
+        bins[i].probability = 1.0f;
+        bins[i].alias = i;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Discrete distribution over n entries proportional to a list of weights,
+// sampled in constant time with Vose's alias method.
+class AliasTable
+{
+    private:
+        // the bin of a sample keeps it with the given probability, else
+        // hands it to alias; pdf is the entry's own probability
+        struct Bin
+        {
+            float probability;
+            uint32_t alias;
+            float pdf;
+        };
+
+        std::vector<Bin> bins;
+
+    public:
+        // weights must not be negative; a zero total leaves the table empty
+        void build(const std::vector<float>& weights);
+        void clear() { bins.clear(); }
+
+        bool empty() const { return bins.empty(); }
+        int size() const { return static_cast<int>(bins.size()); }
+
+        // maps u in [0, 1) to an entry, the table must not be empty
+        int sample(float u, float* pdf) const
+        {
+            float scaled = u * bins.size();
+            uint32_t index = static_cast<uint32_t>(scaled);
+            if (index >= bins.size())
+            {
+                index = static_cast<uint32_t>(bins.size()) - 1;
+            }
+            const Bin& bin = bins[index];
+            if (scaled - index >= bin.probability)
+            {
+                index = bin.alias;
+            }
+            *pdf = bins[index].pdf;
+            return static_cast<int>(index);
+        }
+
+        float pdf(int index) const { return bins[index].pdf; }
+};
+#endif
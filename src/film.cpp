@@ -1,71 +1,609 @@
-#include "film.h"
-#include <glm/glm.hpp>
-#include <fstream>
-#include <iostream>
-
-Film::Film(glm::ivec2 resolution)
-    : resolution(resolution)
-    , image(resolution.x * resolution.y, glm::vec3(0.0f))
-{
-}
-
-inline float Random()
-{
-    return static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-}
-
-glm::vec2 Film::pixelSampler(int i, int j)
-{
-    // Convert pixel coordinates to normalized device coordinates (0 to 1)
-    float x = static_cast<float>(i + Random()) / resolution.x;
-    float y = static_cast<float>(j + Random()) / resolution.y;
-    return glm::vec2(x, y);
-}
-
-int Film::getHeight() const
-{
-    return resolution.y;
-}
-
-int Film::getWidth() const
-{
-    return resolution.x;
-}
-
-void Film::setValue(int i, int j, glm::vec3 pixelColor)
-{
-    int index = j * resolution.x + i;
-    image[index] = pixelColor;
-}
-
-glm::vec3 Film::getValue(int i, int j) const
-{
-    int index = j * resolution.x + i;
-    return image[index];
-}
-
-bool Film::savePPM(const std::string& filename) const
-{
-    std::ofstream file(filename);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file for writing: " << filename << std::endl;
-        return false;
-    }
-
-    // Write PPM header
-    file << "P3\n" << resolution.x << " " << resolution.y << "\n255\n";
-    
-    // Write pixel data
-    for (int y = 0; y < resolution.y; y++) {
-        for (int x = 0; x < resolution.x; x++) {
-            glm::vec3 color = getValue(x, y);
-            // Convert from [0,1] to [0,255] and clamp
-            int r = static_cast<int>(glm::clamp(color.r * 255.0f, 0.0f, 255.0f));
-            int g = static_cast<int>(glm::clamp(color.g * 255.0f, 0.0f, 255.0f));
-            int b = static_cast<int>(glm::clamp(color.b * 255.0f, 0.0f, 255.0f));
-            file << r << " " << g << " " << b << "\n";
-        }
-    }
-
-    return true;
-}
\ No newline at end of file
+#include "film.h"
+#include "threadpool.h"
+#include "hit.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+void AOVAccumulator::add(const Hit* hit)
+{
+    count++;
+    if (hit)
+    {
+        albedo += hit->getAlbedo();
+        normal += hit->normal;
+        depth += hit->t;
+        hits++;
+    }
+}
+
+Film::Film(glm::ivec2 resolution)
+    : resolution(resolution)
+    , image(resolution.x * resolution.y, glm::vec3(0.0f))
+    , accumulation(resolution.x * resolution.y, PixelAccumulator{ glm::vec3(0.0f), 0.0f, 0 })
+    , converged(resolution.x * resolution.y, 0)
+    , exposure(1.0f)
+    , gamma(1.0f)
+{
+}
+
+glm::vec2 Film::pixelSampler(int i, int j, Sampler& sampler) const
+{
+    // Convert pixel coordinates to normalized device coordinates (0 to 1)
+    glm::vec2 u = sampler.next2D();
+    float x = static_cast<float>(i + u.x) / resolution.x;
+    float y = static_cast<float>(j + u.y) / resolution.y;
+    return glm::vec2(x, y);
+}
+
+int Film::getHeight() const
+{
+    return resolution.y;
+}
+
+int Film::getWidth() const
+{
+    return resolution.x;
+}
+
+void Film::setValue(int i, int j, glm::vec3 pixelColor)
+{
+    int index = j * resolution.x + i;
+    image[index] = pixelColor;
+}
+
+glm::vec3 Film::getValue(int i, int j) const
+{
+    int index = j * resolution.x + i;
+    return image[index];
+}
+
+void Film::setAccumulation(int i, int j, const PixelAccumulator& pixel)
+{
+    int index = j * resolution.x + i;
+    accumulation[index] = pixel;
+    image[index] = pixel.mean();
+}
+
+void Film::clearAccumulation()
+{
+    PixelAccumulator empty = { glm::vec3(0.0f), 0.0f, 0 };
+    std::fill(accumulation.begin(), accumulation.end(), empty);
+    std::fill(image.begin(), image.end(), glm::vec3(0.0f));
+    std::fill(aovs.begin(), aovs.end(), AOVAccumulator{ glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, 0, 0 });
+    clearConvergence();
+}
+
+void Film::enableAOVs()
+{
+    if (aovs.empty())
+    {
+        aovs.assign(image.size(), AOVAccumulator{ glm::vec3(0.0f), glm::vec3(0.0f), 0.0f, 0, 0 });
+    }
+}
+
+void Film::restoreAccumulation(const PixelAccumulator* pixels)
+{
+    std::memcpy(accumulation.data(), pixels, accumulation.size() * sizeof(PixelAccumulator));
+    for (size_t index = 0; index < image.size(); index++)
+    {
+        image[index] = accumulation[index].mean();
+    }
+}
+
+void Film::mergeAccumulation(const Tile& tile, const PixelAccumulator* pixels)
+{
+    for (int j = tile.y0; j < tile.y1; j++)
+    {
+        for (int i = tile.x0; i < tile.x1; i++)
+        {
+            PixelAccumulator& pixel = accumulation[j * resolution.x + i];
+            pixel.sum += pixels->sum;
+            pixel.squaredSum += pixels->squaredSum;
+            pixel.count += pixels->count;
+            image[j * resolution.x + i] = pixel.mean();
+            pixels++;
+        }
+    }
+}
+
+uint32_t Film::getMinSampleCount() const
+{
+    uint32_t minCount = std::numeric_limits<uint32_t>::max();
+    for (size_t index = 0; index < accumulation.size(); index++)
+    {
+        if (!converged[index])
+        {
+            minCount = glm::min(minCount, accumulation[index].count);
+        }
+    }
+    return minCount;
+}
+
+uint64_t Film::getTotalSampleCount() const
+{
+    uint64_t total = 0;
+    for (const PixelAccumulator& pixel : accumulation)
+    {
+        total += pixel.count;
+    }
+    return total;
+}
+
+float Film::getPixelError(int i, int j) const
+{
+    const PixelAccumulator& pixel = accumulation[j * resolution.x + i];
+    if (pixel.count < 2)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+
+    // dark pixels are judged by their absolute error instead
+    const float minLuminance = 0.05f;
+    float n = static_cast<float>(pixel.count);
+    float mean = luminance(pixel.sum) / n;
+    float variance = glm::max(0.0f, (pixel.squaredSum - n * mean * mean) / (n - 1.0f));
+    return std::sqrt(variance / n) / glm::max(mean, minLuminance);
+}
+
+int Film::updateConvergence(float threshold)
+{
+    std::vector<float> errors(accumulation.size());
+    for (int j = 0; j < resolution.y; j++)
+    {
+        for (int i = 0; i < resolution.x; i++)
+        {
+            errors[j * resolution.x + i] = getPixelError(i, j);
+        }
+    }
+
+    // a few lucky samples can make a single pixel look converged, so look at its neighbours too
+    int remaining = 0;
+    for (int j = 0; j < resolution.y; j++)
+    {
+        for (int i = 0; i < resolution.x; i++)
+        {
+            // once a pixel stops it stays stopped, so passes never have to catch it up
+            if (converged[j * resolution.x + i])
+            {
+                continue;
+            }
+
+            float error = 0.0f;
+            for (int y = glm::max(j - 1, 0); y <= glm::min(j + 1, resolution.y - 1); y++)
+            {
+                for (int x = glm::max(i - 1, 0); x <= glm::min(i + 1, resolution.x - 1); x++)
+                {
+                    error = glm::max(error, errors[y * resolution.x + x]);
+                }
+            }
+            if (error < threshold)
+            {
+                converged[j * resolution.x + i] = 1;
+            }
+            else
+            {
+                remaining++;
+            }
+        }
+    }
+    return remaining;
+}
+
+void Film::clearConvergence()
+{
+    std::fill(converged.begin(), converged.end(), 0);
+}
+
+float Film::getImageError() const
+{
+    double sum = 0.0;
+    for (int j = 0; j < resolution.y; j++)
+    {
+        for (int i = 0; i < resolution.x; i++)
+        {
+            float error = getPixelError(i, j);
+            sum += static_cast<double>(error) * error;
+        }
+    }
+    return static_cast<float>(std::sqrt(sum / accumulation.size()));
+}
+
+double Film::getUniformSamplesForError(float error) const
+{
+    // the squared error of a pixel falls as 1 / count, so count * error^2 is what the pixel needs
+    double sum = 0.0;
+    for (int j = 0; j < resolution.y; j++)
+    {
+        for (int i = 0; i < resolution.x; i++)
+        {
+            float pixelError = getPixelError(i, j);
+            sum += static_cast<double>(pixelError) * pixelError * getSampleCount(i, j);
+        }
+    }
+    return sum / accumulation.size() / (static_cast<double>(error) * error);
+}
+
+std::vector<Tile> Film::generateTiles(int tileSize) const
+{
+    // a size of zero or less would never advance
+    tileSize = glm::max(tileSize, 1);
+    std::vector<Tile> tiles;
+    for (int y = 0; y < resolution.y; y += tileSize)
+    {
+        for (int x = 0; x < resolution.x; x += tileSize)
+        {
+            Tile tile;
+            tile.x0 = x;
+            tile.y0 = y;
+            tile.x1 = glm::min(x + tileSize, resolution.x);
+            tile.y1 = glm::min(y + tileSize, resolution.y);
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+void Film::forEachRowBlock(ThreadPool* pool, const std::function<void(int y0, int y1)>& fn) const
+{
+    const int rowsPerBlock = 32;
+    int numBlocks = (resolution.y + rowsPerBlock - 1) / rowsPerBlock;
+    auto runBlock = [&](int block, int)
+    {
+        int y0 = block * rowsPerBlock;
+        fn(y0, glm::min(y0 + rowsPerBlock, resolution.y));
+    };
+
+    if (pool)
+    {
+        pool->parallelFor(numBlocks, runBlock);
+    }
+    else
+    {
+        for (int block = 0; block < numBlocks; block++)
+        {
+            runBlock(block, 0);
+        }
+    }
+}
+
+bool Film::writeFile(const std::string& filename, const std::vector<uint8_t>& data) const
+{
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Failed to open file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    // the whole image goes out in one block write
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = std::fclose(file) == 0 && written;
+    if (!written) {
+        std::cerr << "Failed to write file: " << filename << std::endl;
+    }
+    return written;
+}
+
+void Film::quantize(uint8_t* out, ThreadPool* pool) const
+{
+    const float* values = &image[0].x;
+
+    if (gamma == 1.0f)
+    {
+        // linear: scale, clamp and truncate, a plain loop the compiler vectorizes
+        float scale = exposure * 255.0f;
+        forEachRowBlock(pool, [&](int y0, int y1)
+        {
+            size_t begin = static_cast<size_t>(y0) * resolution.x * 3;
+            size_t end = static_cast<size_t>(y1) * resolution.x * 3;
+            for (size_t v = begin; v < end; v++)
+            {
+                out[v] = static_cast<uint8_t>(glm::clamp(values[v] * scale, 0.0f, 255.0f));
+            }
+        });
+        return;
+    }
+
+    // gamma: a table indexed by the square root of the value, which spreads
+    // the dark end where the curve is steep over many entries, gives a code
+    // at most a step or two off; thresholds[k], the least value that encodes
+    // to k or more, then moves it to what pow would round to
+    const int tableSize = 4096;
+    uint8_t table[tableSize];
+    for (int i = 0; i < tableSize; i++)
+    {
+        float root = static_cast<float>(i) / (tableSize - 1);
+        table[i] = static_cast<uint8_t>(glm::clamp(std::pow(root * root, 1.0f / gamma) * 255.0f + 0.5f, 0.0f, 255.0f));
+    }
+    float thresholds[256];
+    thresholds[0] = -std::numeric_limits<float>::infinity();
+    for (int k = 1; k < 256; k++)
+    {
+        thresholds[k] = std::pow((k - 0.5f) / 255.0f, gamma) / exposure;
+    }
+    float scale = tableSize - 1;
+    forEachRowBlock(pool, [&](int y0, int y1)
+    {
+        size_t begin = static_cast<size_t>(y0) * resolution.x * 3;
+        size_t end = static_cast<size_t>(y1) * resolution.x * 3;
+        for (size_t v = begin; v < end; v++)
+        {
+            float value = values[v];
+            // written so that NaN ends up at 0
+            float clamped = value * exposure > 0.0f ? std::min(value * exposure, 1.0f) : 0.0f;
+            int code = table[static_cast<int>(std::sqrt(clamped) * scale + 0.5f)];
+            while (code < 255 && value >= thresholds[code + 1])
+            {
+                code++;
+            }
+            while (value < thresholds[code])
+            {
+                code--;
+            }
+            out[v] = static_cast<uint8_t>(code);
+        }
+    });
+}
+
+bool Film::savePPM(const std::string& filename, ThreadPool* pool) const
+{
+    char header[64];
+    int headerSize = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", resolution.x, resolution.y);
+
+    std::vector<uint8_t> data(headerSize + image.size() * 3);
+    std::memcpy(data.data(), header, headerSize);
+    quantize(data.data() + headerSize, pool);
+    return writeFile(filename, data);
+}
+
+bool Film::savePFM(const std::string& filename, ThreadPool* pool) const
+{
+    // negative scale marks little endian data
+    char header[64];
+    int headerSize = std::snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", resolution.x, resolution.y);
+
+    size_t rowBytes = static_cast<size_t>(resolution.x) * 3 * sizeof(float);
+    std::vector<uint8_t> data(headerSize + rowBytes * resolution.y);
+    std::memcpy(data.data(), header, headerSize);
+
+    // PFM stores the bottom row first
+    uint8_t* pixels = data.data() + headerSize;
+    forEachRowBlock(pool, [&](int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            std::memcpy(pixels + rowBytes * (resolution.y - 1 - y), &image[static_cast<size_t>(y) * resolution.x], rowBytes);
+        }
+    });
+    return writeFile(filename, data);
+}
+
+namespace
+{
+    // IEEE 754 binary32 to binary16, rounding to nearest even
+    uint16_t floatToHalf(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000u;
+        uint32_t magnitude = bits & 0x7fffffffu;
+
+        if (magnitude >= 0x7f800000u) // inf or nan
+        {
+            return static_cast<uint16_t>(sign | 0x7c00u | (magnitude > 0x7f800000u ? 0x200u : 0u));
+        }
+        if (magnitude >= 0x477ff000u) // rounds past the largest half
+        {
+            return static_cast<uint16_t>(sign | 0x7c00u);
+        }
+        if (magnitude < 0x38800000u) // half denormal or zero
+        {
+            if (magnitude < 0x33000000u)
+            {
+                return static_cast<uint16_t>(sign);
+            }
+            uint32_t exponent = magnitude >> 23;
+            uint32_t mantissa = (magnitude & 0x7fffffu) | 0x800000u;
+            uint32_t shift = 126 - exponent;
+            uint32_t half = mantissa >> shift;
+            uint32_t remainder = mantissa & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+            if (remainder > halfway || (remainder == halfway && (half & 1u)))
+            {
+                half++;
+            }
+            return static_cast<uint16_t>(sign | half);
+        }
+
+        uint32_t half = (magnitude - 0x38000000u) >> 13;
+        uint32_t remainder = magnitude & 0x1fffu;
+        if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+        {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    void putBytes(std::vector<uint8_t>& out, const void* bytes, size_t size)
+    {
+        const uint8_t* p = static_cast<const uint8_t*>(bytes);
+        out.insert(out.end(), p, p + size);
+    }
+
+    void putInt(std::vector<uint8_t>& out, int32_t value)
+    {
+        // OpenEXR is little endian, like every platform this runs on
+        putBytes(out, &value, sizeof(value));
+    }
+
+    void putFloat(std::vector<uint8_t>& out, float value)
+    {
+        putBytes(out, &value, sizeof(value));
+    }
+
+    void putAttribute(std::vector<uint8_t>& out, const char* name, const char* type, int32_t size)
+    {
+        putBytes(out, name, std::strlen(name) + 1);
+        putBytes(out, type, std::strlen(type) + 1);
+        putInt(out, size);
+    }
+}
+
+bool Film::saveEXR(const std::string& filename, ThreadPool* pool) const
+{
+    std::vector<uint8_t> data;
+    const uint8_t magic[4] = { 0x76, 0x2f, 0x31, 0x01 };
+    putBytes(data, magic, sizeof(magic));
+    putInt(data, 2); // version 2, single part scanline file
+
+    // channels are listed, and stored, in alphabetical order
+    const char* channels[3] = { "B", "G", "R" };
+    putAttribute(data, "channels", "chlist", 3 * 18 + 1);
+    for (const char* channel : channels)
+    {
+        putBytes(data, channel, 2);
+        putInt(data, 1);                // HALF
+        putInt(data, 0);                // pLinear and reserved
+        putInt(data, 1);                // x sampling
+        putInt(data, 1);                // y sampling
+    }
+    data.push_back(0);
+
+    putAttribute(data, "compression", "compression", 1);
+    data.push_back(0);                  // NO_COMPRESSION
+    for (const char* window : { "dataWindow", "displayWindow" })
+    {
+        putAttribute(data, window, "box2i", 16);
+        putInt(data, 0);
+        putInt(data, 0);
+        putInt(data, resolution.x - 1);
+        putInt(data, resolution.y - 1);
+    }
+    putAttribute(data, "lineOrder", "lineOrder", 1);
+    data.push_back(0);                  // INCREASING_Y
+    putAttribute(data, "pixelAspectRatio", "float", 4);
+    putFloat(data, 1.0f);
+    putAttribute(data, "screenWindowCenter", "v2f", 8);
+    putFloat(data, 0.0f);
+    putFloat(data, 0.0f);
+    putAttribute(data, "screenWindowWidth", "float", 4);
+    putFloat(data, 1.0f);
+    data.push_back(0);                  // end of header
+
+    // one scanline per chunk: y, byte count, then B, G and R half rows
+    size_t pixelBytes = static_cast<size_t>(resolution.x) * 3 * sizeof(uint16_t);
+    size_t chunkBytes = 2 * sizeof(int32_t) + pixelBytes;
+    size_t tableOffset = data.size();
+    size_t firstChunk = tableOffset + static_cast<size_t>(resolution.y) * sizeof(uint64_t);
+    data.resize(firstChunk + chunkBytes * resolution.y);
+
+    forEachRowBlock(pool, [&](int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            uint64_t offset = firstChunk + chunkBytes * y;
+            std::memcpy(&data[tableOffset + y * sizeof(uint64_t)], &offset, sizeof(offset));
+
+            uint8_t* chunk = &data[offset];
+            int32_t lineY = y;
+            int32_t size = static_cast<int32_t>(pixelBytes);
+            std::memcpy(chunk, &lineY, sizeof(lineY));
+            std::memcpy(chunk + 4, &size, sizeof(size));
+
+            uint16_t* halves = reinterpret_cast<uint16_t*>(chunk + 8);
+            const glm::vec3* row = &image[static_cast<size_t>(y) * resolution.x];
+            for (int x = 0; x < resolution.x; x++)
+            {
+                halves[x] = floatToHalf(row[x].b);
+                halves[resolution.x + x] = floatToHalf(row[x].g);
+                halves[2 * resolution.x + x] = floatToHalf(row[x].r);
+            }
+        }
+    });
+    return writeFile(filename, data);
+}
+
+bool Film::saveImage(const std::string& filename, ThreadPool* pool) const
+{
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    if (extension == "pfm")
+    {
+        return savePFM(filename, pool);
+    }
+    if (extension == "exr")
+    {
+        return saveEXR(filename, pool);
+    }
+    return savePPM(filename, pool);
+}
+
+bool Film::compareToReference(const std::string& filename, double* rmse, double* relativeRmse, double* displayRmse) const
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Failed to open reference image: " << filename << std::endl;
+        return false;
+    }
+
+    std::string magic;
+    int width = 0;
+    int height = 0;
+    float scale = 0.0f;
+    file >> magic >> width >> height >> scale;
+    // a single whitespace character separates the header from the data
+    file.get();
+    if (!file || magic != "PF" || scale >= 0.0f)
+    {
+        std::cerr << "Reference " << filename << " is not a little endian RGB PFM" << std::endl;
+        return false;
+    }
+    if (width != resolution.x || height != resolution.y)
+    {
+        std::cerr << "Reference " << filename << " is " << width << "x" << height << ", the film is "
+                  << resolution.x << "x" << resolution.y << std::endl;
+        return false;
+    }
+
+    std::vector<glm::vec3> reference(image.size());
+    file.read(reinterpret_cast<char*>(reference.data()), reference.size() * sizeof(glm::vec3));
+    if (!file)
+    {
+        std::cerr << "Reference " << filename << " is truncated" << std::endl;
+        return false;
+    }
+
+    double squaredError = 0.0;
+    double referenceSum = 0.0;
+    double displaySquaredError = 0.0;
+    double displaySum = 0.0;
+    for (int y = 0; y < resolution.y; y++)
+    {
+        // PFM stores the bottom row first
+        const glm::vec3* row = &reference[static_cast<size_t>(resolution.y - 1 - y) * resolution.x];
+        for (int x = 0; x < resolution.x; x++)
+        {
+            glm::vec3 d = image[static_cast<size_t>(y) * resolution.x + x] - row[x];
+            squaredError += static_cast<double>(d.x) * d.x + static_cast<double>(d.y) * d.y + static_cast<double>(d.z) * d.z;
+            referenceSum += static_cast<double>(row[x].x) + row[x].y + row[x].z;
+
+            glm::vec3 displayReference = glm::clamp(row[x], 0.0f, 1.0f);
+            glm::vec3 dd = glm::clamp(image[static_cast<size_t>(y) * resolution.x + x], 0.0f, 1.0f) - displayReference;
+            displaySquaredError += static_cast<double>(dd.x) * dd.x + static_cast<double>(dd.y) * dd.y + static_cast<double>(dd.z) * dd.z;
+            displaySum += static_cast<double>(displayReference.x) + displayReference.y + displayReference.z;
+        }
+    }
+    double count = 3.0 * image.size();
+    *rmse = std::sqrt(squaredError / count);
+    *relativeRmse = referenceSum > 0.0 ? *rmse / (referenceSum / count) : 0.0;
+    if (displayRmse)
+    {
+        *displayRmse = displaySum > 0.0 ? std::sqrt(displaySquaredError / count) / (displaySum / count) : 0.0;
+    }
+    return true;
+}
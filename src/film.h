@@ -1,24 +1,137 @@
-#ifndef FILM_H
-#define FILM_H
-
-#include <glm/glm.hpp>
-#include <vector> 
-#include <string>
-
-class Film
-{
-    private:
-        glm::ivec2 resolution;
-        std::vector<glm::vec3> image;
-
-    public:
-        Film(glm::ivec2 resolution);
-        glm::vec2 pixelSampler(int i, int j);
-        int getHeight() const;
-        int getWidth() const;
-        void setValue(int i, int j, glm::vec3 pixelColor);
-        glm::vec3 getValue(int i, int j) const;
-        bool savePPM(const std::string& filename) const;
-};
-
+#ifndef FILM_H
+#define FILM_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <functional>
+#include <vector> 
+#include <string>
+#include "sampler.h"
+
+// Forward declarations
+class ThreadPool;
+class Hit;
+
+inline float luminance(const glm::vec3& color)
+{
+    return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+// Running sums over the radiance samples of one pixel
+struct PixelAccumulator
+{
+    glm::vec3 sum;
+    // sum of squared luminance, for the variance of the pixel mean
+    float squaredSum;
+    uint32_t count;
+
+    void add(const glm::vec3& radiance)
+    {
+        float y = luminance(radiance);
+        sum += radiance;
+        squaredSum += y * y;
+        count++;
+    }
+
+    glm::vec3 mean() const { return count > 0 ? sum / static_cast<float>(count) : glm::vec3(0.0f); }
+};
+
+// First hit features of one pixel summed over its samples, they guide the denoiser
+struct AOVAccumulator
+{
+    glm::vec3 albedo;
+    glm::vec3 normal;
+    // distance along the camera ray, summed over the samples that hit
+    float depth;
+    uint32_t count;
+    uint32_t hits;
+
+    // adds the first hit of a sample, null if the camera ray missed
+    void add(const Hit* hit);
+};
+
+// Rectangular block of pixels [x0, x1) x [y0, y1)
+struct Tile
+{
+    int x0, y0;
+    int x1, y1;
+};
+
+class Film
+{
+    private:
+        glm::ivec2 resolution;
+        std::vector<glm::vec3> image;
+        std::vector<PixelAccumulator> accumulation;
+        // pixels the adaptive sampler stopped sampling
+        std::vector<uint8_t> converged;
+        // empty unless enabled
+        std::vector<AOVAccumulator> aovs;
+        float exposure;
+        float gamma;
+
+        void forEachRowBlock(ThreadPool* pool, const std::function<void(int y0, int y1)>& fn) const;
+        bool writeFile(const std::string& filename, const std::vector<uint8_t>& data) const;
+
+    public:
+        Film(glm::ivec2 resolution);
+        glm::vec2 pixelSampler(int i, int j, Sampler& sampler) const;
+        int getHeight() const;
+        int getWidth() const;
+        void setValue(int i, int j, glm::vec3 pixelColor);
+        glm::vec3 getValue(int i, int j) const;
+        // tiles of tileSize x tileSize pixels, smaller at the right and bottom edges; sizes below 1 count as 1
+        std::vector<Tile> generateTiles(int tileSize) const;
+
+        // progressive accumulation: the image holds the mean of every pixel
+        const PixelAccumulator& getAccumulation(int i, int j) const { return accumulation[j * resolution.x + i]; }
+        uint32_t getSampleCount(int i, int j) const { return accumulation[j * resolution.x + i].count; }
+        void setAccumulation(int i, int j, const PixelAccumulator& pixel);
+        void clearAccumulation();
+        const std::vector<PixelAccumulator>& getAccumulationBuffer() const { return accumulation; }
+        // replaces the accumulation state and resolves the image from it
+        void restoreAccumulation(const PixelAccumulator* pixels);
+        // adds the samples of a tile rendered elsewhere, pixels row by row
+        void mergeAccumulation(const Tile& tile, const PixelAccumulator* pixels);
+        // auxiliary buffers recorded along with the samples, a checkpoint does not keep them
+        void enableAOVs();
+        bool hasAOVs() const { return !aovs.empty(); }
+        const AOVAccumulator& getAOV(int i, int j) const { return aovs[j * resolution.x + i]; }
+        void setAOV(int i, int j, const AOVAccumulator& aov) { aovs[j * resolution.x + i] = aov; }
+        // smallest sample count among the pixels that are still being sampled
+        uint32_t getMinSampleCount() const;
+        uint64_t getTotalSampleCount() const;
+
+        // adaptive sampling: relative standard error of the mean luminance of a pixel
+        float getPixelError(int i, int j) const;
+        bool isConverged(int i, int j) const { return converged[j * resolution.x + i] != 0; }
+        // marks pixels whose 3x3 neighbourhood is below the error threshold, returns how many are still sampling
+        int updateConvergence(float threshold);
+        void clearConvergence();
+        // root mean square of the pixel errors
+        float getImageError() const;
+        // samples per pixel a uniform render needs to reach the given image error
+        double getUniformSamplesForError(float error) const;
+
+        // tone mapping applied by quantize(): (exposure * value) ^ (1 / gamma)
+        void setToneMap(float exposure, float gamma) { this->exposure = exposure; this->gamma = gamma; }
+        // tone maps and quantizes the image into width * height * 3 bytes of RGB, in parallel when a pool is given
+        void quantize(uint8_t* pixels, ThreadPool* pool = nullptr) const;
+
+        // binary P6, 8 bit tone mapped
+        bool savePPM(const std::string& filename, ThreadPool* pool = nullptr) const;
+        // portable float map, linear HDR
+        bool savePFM(const std::string& filename, ThreadPool* pool = nullptr) const;
+        // uncompressed scanline OpenEXR, linear HDR as half floats
+        bool saveEXR(const std::string& filename, ThreadPool* pool = nullptr) const;
+        // picks the writer from the file extension (.ppm, .pfm or .exr)
+        bool saveImage(const std::string& filename, ThreadPool* pool = nullptr) const;
+        // root mean square difference of the RGB values to a PFM reference of the
+        // same size, and that difference relative to the mean reference value;
+        // displayRmse gets the relative difference with both clamped to [0, 1],
+        // which a few bright emitter pixels cannot dominate
+        bool compareToReference(const std::string& filename, double* rmse, double* relativeRmse,
+                                double* displayRmse = nullptr) const;
+};
+
 #endif
\ No newline at end of file
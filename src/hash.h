@@ -0,0 +1,35 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// 64 bit FNV-1a over the bytes of plain values, to tell whether two
+// processes or two runs set up the same render
+class Hasher
+{
+    private:
+        uint64_t value = 14695981039346656037ull;
+
+    public:
+        void addBytes(const void* data, size_t size)
+        {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            for (size_t i = 0; i < size; i++)
+            {
+                value = (value ^ bytes[i]) * 1099511628211ull;
+            }
+        }
+
+        template<typename T>
+        void add(const T& v)
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "only plain values hash by their bytes");
+            addBytes(&v, sizeof(T));
+        }
+
+        uint64_t get() const { return value; }
+};
+
+#endif
@@ -1,132 +1,236 @@
-#include "instance.h"
-
-Instance::Instance(std::unique_ptr<Shape> shape)
-    : type(InstanceType::NONE), shape(std::move(shape)), transform(std::make_unique<Transform>()) {}
-
-Instance::~Instance()
-{
-    light = nullptr;
-    material = nullptr;
-}
-
-Instance::Instance(Instance&& other) noexcept
-    : type(other.type), shape(std::move(other.shape)), transform(std::move(other.transform))
-{
-    if (type == InstanceType::LIGHT) 
-    {
-        light = other.light;
-        other.light = nullptr;
-    } 
-    else if (type == InstanceType::MATERIAL) 
-    {
-        material = other.material;
-        other.material = nullptr;
-    }
-    other.type = InstanceType::NONE;
-}
-
-Instance& Instance::operator=(Instance&& other) noexcept
-{
-    if (this != &other) 
-    {
-        // Clean up current state
-        if (type == InstanceType::LIGHT) 
-        {
-            light = nullptr;
-        } 
-        else if (type == InstanceType::MATERIAL) 
-        {
-            material = nullptr;
-        }
-
-        type = other.type;
-        shape = std::move(other.shape);
-        transform = std::move(other.transform);
-        
-        if (type == InstanceType::LIGHT) 
-        {
-            light = other.light;
-            other.light = nullptr;
-        } 
-        else if (type == InstanceType::MATERIAL) 
-        {
-            material = other.material;
-            other.material = nullptr;
-        }
-        other.type = InstanceType::NONE;
-    }
-    return *this;
-}
-
-void Instance::setMaterial(Material* material)
-{
-    if (type == InstanceType::LIGHT) 
-    {
-        light = nullptr;
-    }
-    this->material = material;
-    type = material ? InstanceType::MATERIAL : InstanceType::NONE;
-}
-
-void Instance::setLight(Light* light)
-{
-    if (type == InstanceType::MATERIAL) 
-    {
-        material = nullptr;
-    }
-    this->light = light;
-    type = light ? InstanceType::LIGHT : InstanceType::NONE;
-}
-
-
-std::unique_ptr<Hit> Instance::computeIntersection(const Ray& ray) const
-{
-    if (!shape) 
-    {
-        return nullptr;
-    }
-
-    auto hit = std::make_unique<Hit>();
-
-    // Transform the ray to the local space of the instance
-    glm::vec3 localRayOrigin = transform->inverseTransformPoint(ray.getRayOrigin());
-    // Transform direction as a point, then subtract origin to get direction vector
-    glm::vec3 localRayEnd = transform->inverseTransformPoint(ray.getRayOrigin() + ray.getRayDirection());
-    glm::vec3 localRayDirection = glm::normalize(localRayEnd - localRayOrigin);
-    
-    Ray localRay(localRayOrigin, localRayDirection);
-    if (shape->intersect(localRay, hit.get())) 
-    {
-        if (type == InstanceType::LIGHT) 
-        {
-            hit->setLight(light);
-        } 
-        else if (type == InstanceType::MATERIAL) 
-        {
-            hit->setMaterial(material);
-        }
-
-        // Transform the hit to the world space of the instance
-        hit->position = transform->transformPoint(hit->position);
-        hit->normal = transform->transformNormal(hit->normal);
-
-        return hit;
-    }
-    return nullptr;
-}
-
-void Instance::translate(const glm::vec3& translation)
-{
-    transform->translate(translation);
-}
-
-void Instance::scale(const glm::vec3& scale)
-{
-    transform->scale(scale);
-}
-
-void Instance::rotate(float angle, const glm::vec3& axis)
-{
-    transform->rotate(angle, axis);
-}
+#include "instance.h"
+
+Instance::Instance(std::unique_ptr<Shape> shape)
+    : type(InstanceType::NONE), shape(std::move(shape)) {}
+
+Instance::~Instance()
+{
+    light = nullptr;
+    material = nullptr;
+}
+
+Instance::Instance(Instance&& other) noexcept
+    : type(other.type), shape(std::move(other.shape)), transform(other.transform)
+{
+    if (type == InstanceType::LIGHT) 
+    {
+        light = other.light;
+        other.light = nullptr;
+    } 
+    else if (type == InstanceType::MATERIAL) 
+    {
+        material = other.material;
+        other.material = nullptr;
+    }
+    other.type = InstanceType::NONE;
+}
+
+Instance& Instance::operator=(Instance&& other) noexcept
+{
+    if (this != &other) 
+    {
+        // Clean up current state
+        if (type == InstanceType::LIGHT) 
+        {
+            light = nullptr;
+        } 
+        else if (type == InstanceType::MATERIAL) 
+        {
+            material = nullptr;
+        }
+
+        type = other.type;
+        shape = std::move(other.shape);
+        transform = other.transform;
+        
+        if (type == InstanceType::LIGHT) 
+        {
+            light = other.light;
+            other.light = nullptr;
+        } 
+        else if (type == InstanceType::MATERIAL) 
+        {
+            material = other.material;
+            other.material = nullptr;
+        }
+        other.type = InstanceType::NONE;
+    }
+    return *this;
+}
+
+void Instance::setMaterial(Material* material)
+{
+    if (type == InstanceType::LIGHT) 
+    {
+        light = nullptr;
+    }
+    this->material = material;
+    type = material ? InstanceType::MATERIAL : InstanceType::NONE;
+}
+
+void Instance::setLight(Light* light)
+{
+    if (type == InstanceType::MATERIAL) 
+    {
+        material = nullptr;
+    }
+    this->light = light;
+    type = light ? InstanceType::LIGHT : InstanceType::NONE;
+}
+
+
+bool Instance::computeIntersection(const Ray& ray, float tMax, Hit* hit) const
+{
+    if (!shape) 
+    {
+        return false;
+    }
+
+    if (shape->intersect(transform.isIdentity() ? ray : toLocal(ray), tMax, hit))
+    {
+        toWorldHit(hit);
+        return true;
+    }
+    return false;
+}
+
+uint32_t Instance::computeIntersectionPacket(const RayPacket& packet, uint32_t laneMask, float* tMax, Hit* hits,
+                                             const WideKernels& kernels) const
+{
+    if (!shape) 
+    {
+        return 0;
+    }
+
+    uint32_t hitMask;
+    if (transform.isIdentity())
+    {
+        hitMask = shape->intersectPacket(packet, laneMask, tMax, hits, kernels);
+    }
+    else
+    {
+        // directions stay unnormalized like in toLocal()
+        RayPacket localPacket;
+        transform.inverseTransformPacket(packet, &localPacket);
+        hitMask = shape->intersectPacket(localPacket, laneMask, tMax, hits, kernels);
+    }
+
+    for (int k = 0; k < PacketSize; k++)
+    {
+        if (hitMask & (1u << k))
+        {
+            toWorldHit(&hits[k]);
+            tMax[k] = hits[k].t;
+        }
+    }
+    return hitMask;
+}
+
+void Instance::toWorldHit(Hit* hit) const
+{
+    if (type == InstanceType::LIGHT) 
+    {
+        hit->setLight(light);
+    } 
+    else if (type == InstanceType::MATERIAL) 
+    {
+        hit->setMaterial(material);
+    }
+    else
+    {
+        hit->clearSurface();
+    }
+
+    // Transform the hit to the world space of the instance, t needs no change
+    hit->position = transform.transformPoint(hit->position);
+    hit->normal = transform.transformNormal(hit->normal);
+}
+
+bool Instance::occluded(const Ray& ray, float tMax) const
+{
+    if (!shape) 
+    {
+        return false;
+    }
+    return shape->occluded(transform.isIdentity() ? ray : toLocal(ray), tMax);
+}
+
+uint32_t Instance::occludedPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax, const WideKernels& kernels) const
+{
+    if (!shape) 
+    {
+        return 0;
+    }
+    if (transform.isIdentity())
+    {
+        return shape->occludedPacket(packet, laneMask, tMax, kernels);
+    }
+    RayPacket localPacket;
+    transform.inverseTransformPacket(packet, &localPacket);
+    return shape->occludedPacket(localPacket, laneMask, tMax, kernels);
+}
+
+void Instance::hash(Hasher& hasher) const
+{
+    hasher.add(type);
+    if (shape)
+    {
+        shape->hash(hasher);
+    }
+    hasher.add(transform.getMatrix());
+    if (type == InstanceType::MATERIAL)
+    {
+        hasher.add(material->getType());
+        hasher.add(material->getAlbedo());
+        hasher.add(material->GetBRDF());
+    }
+    else if (type == InstanceType::LIGHT)
+    {
+        // three corners of the sampled domain pin down a quad
+        hasher.add(light->getType());
+        hasher.add(light->getPower());
+        hasher.add(light->getSampleCount());
+        for (const glm::vec2& u : { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(0.0f, 1.0f) })
+        {
+            float pdf;
+            glm::vec3 ns;
+            hasher.add(light->getSampleAt(u, &pdf, ns));
+            hasher.add(ns);
+        }
+    }
+}
+
+AABB Instance::getWorldBounds() const
+{
+    AABB localBounds = shape->getBounds();
+    AABB worldBounds;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        glm::vec3 p((corner & 1) ? localBounds.bMax.x : localBounds.bMin.x,
+                    (corner & 2) ? localBounds.bMax.y : localBounds.bMin.y,
+                    (corner & 4) ? localBounds.bMax.z : localBounds.bMin.z);
+        worldBounds.grow(transform.transformPoint(p));
+    }
+    return worldBounds;
+}
+
+void Instance::translate(const glm::vec3& translation)
+{
+    transform.translate(translation);
+}
+
+void Instance::scale(const glm::vec3& scale)
+{
+    transform.scale(scale);
+}
+
+void Instance::rotate(float angle, const glm::vec3& axis)
+{
+    transform.rotate(angle, axis);
+}
+
+void Instance::setTransform(const glm::mat4& matrix, const glm::mat4& inverse)
+{
+    transform.setMatrix(matrix, inverse);
+}
     
\ No newline at end of file
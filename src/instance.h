@@ -1,52 +1,70 @@
-#ifndef INSTANCE_H
-#define INSTANCE_H
-
-#include "material.h"
-#include "light.h"
-#include "shape.h"
-#include "hit.h"
-#include "ray.h"
-#include "transform.h"
-#include <memory>
-
-class Instance
-{
-    private:
-        enum class InstanceType { NONE, LIGHT, MATERIAL };
-        union 
-        {
-            Light* light;
-            Material* material;
-        };
-        InstanceType type;
-        std::unique_ptr<Shape> shape;
-        std::unique_ptr<Transform> transform;
-
-    public:
-        Instance(std::unique_ptr<Shape> shape);
-        ~Instance();
-
-        // Prevent copying
-        Instance(const Instance&) = delete;
-        Instance& operator=(const Instance&) = delete;
-
-        // Allow moving
-        Instance(Instance&& other) noexcept;
-        Instance& operator=(Instance&& other) noexcept;
-
-        void setMaterial(Material* material);
-        void setLight(Light* light);
-
-        bool isLight() const { return type == InstanceType::LIGHT; }
-        bool isMaterial() const { return type == InstanceType::MATERIAL; }
-        Light* getLight() const { return type == InstanceType::LIGHT ? light : nullptr; }
-        Material* getMaterial() const { return type == InstanceType::MATERIAL ? material : nullptr; }
-        const Shape* getShape() const { return shape.get(); }
-        const Transform* getTransform() const { return transform.get(); }
-        void translate(const glm::vec3& translation);
-        void scale(const glm::vec3& scale);
-        void rotate(float angle, const glm::vec3& axis);    
-
-        std::unique_ptr<Hit> computeIntersection(const Ray& ray) const;
-};
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "material.h"
+#include "light.h"
+#include "shape.h"
+#include "hit.h"
+#include "ray.h"
+#include "transform.h"
+#include <memory>
+
+class Instance
+{
+    private:
+        enum class InstanceType { NONE, LIGHT, MATERIAL };
+        union 
+        {
+            Light* light;
+            Material* material;
+        };
+        InstanceType type;
+        std::unique_ptr<Shape> shape;
+        Transform transform;
+
+        // local rays keep the scale of the transform, so their t is already in world units
+        Ray toLocal(const Ray& ray) const
+        {
+            return Ray::unnormalized(transform.inverseTransformPoint(ray.getRayOrigin()),
+                                     transform.inverseTransformVector(ray.getRayDirection()));
+        }
+        void toWorldHit(Hit* hit) const;
+
+    public:
+        Instance(std::unique_ptr<Shape> shape);
+        ~Instance();
+
+        // Prevent copying
+        Instance(const Instance&) = delete;
+        Instance& operator=(const Instance&) = delete;
+
+        // Allow moving
+        Instance(Instance&& other) noexcept;
+        Instance& operator=(Instance&& other) noexcept;
+
+        void setMaterial(Material* material);
+        void setLight(Light* light);
+
+        bool isLight() const { return type == InstanceType::LIGHT; }
+        bool isMaterial() const { return type == InstanceType::MATERIAL; }
+        Light* getLight() const { return type == InstanceType::LIGHT ? light : nullptr; }
+        Material* getMaterial() const { return type == InstanceType::MATERIAL ? material : nullptr; }
+        const Shape* getShape() const { return shape.get(); }
+        const Transform* getTransform() const { return &transform; }
+        void translate(const glm::vec3& translation);
+        void scale(const glm::vec3& scale);
+        void rotate(float angle, const glm::vec3& axis);    
+        void setTransform(const glm::mat4& matrix, const glm::mat4& inverse);
+
+        AABB getWorldBounds() const;
+        // adds the shape, placement and surface to hasher
+        void hash(Hasher& hasher) const;
+        bool computeIntersection(const Ray& ray, float tMax, Hit* hit) const;
+        // tests the lanes in laneMask, lowering tMax for every lane it hits
+        uint32_t computeIntersectionPacket(const RayPacket& packet, uint32_t laneMask, float* tMax, Hit* hits,
+                                           const WideKernels& kernels) const;
+        bool occluded(const Ray& ray, float tMax) const;
+        // the lanes in laneMask blocked within their tMax
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax, const WideKernels& kernels) const;
+};
 #endif
\ No newline at end of file
@@ -1,29 +1,165 @@
-#include "light.h"
-#include "scene.h"
-#include "ray.h"
-
-    
-inline float Random()
-{
-    return static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-}
-
-AreaLight::AreaLight(const glm::vec3& position, const glm::vec3& power, const glm::vec3& ei, const glm::vec3& ej, int nSamples)
-    : Light(), position(position), power(power), ei(ei), ej(ej), nSamples(nSamples)
-    {
-        glm::vec3 crossProduct = glm::cross(ei, ej);
-        normal = glm::normalize(crossProduct);
-        area = glm::length(crossProduct);
-    } 
-
-glm::vec3 AreaLight::getSample(float* pdf, glm::vec3& ns) const
-{   
-    ns = this->normal;
-    *pdf = 1.0f / this->getArea();
-    return position + ei * Random() + ej * Random();
-}
-
-glm::vec3 AreaLight::GetIrradiance() const
-{
-    return this->power / this->getArea();
-}
\ No newline at end of file
+#include "light.h"
+#include "scene.h"
+#include "ray.h"
+#include <cmath>
+
+AreaLight::AreaLight(const glm::vec3& position, const glm::vec3& power, const glm::vec3& ei, const glm::vec3& ej, int nSamples)
+    : Light(LightType::Area), position(position), power(power), ei(ei), ej(ej), nSamples(nSamples)
+    {
+        glm::vec3 crossProduct = glm::cross(ei, ej);
+        normal = glm::normalize(crossProduct);
+        area = glm::length(crossProduct);
+    } 
+
+float AreaLight::getPdf(const glm::vec3& p, const glm::vec3& wi) const
+{
+    // only the side the normal faces emits
+    float cosLight = -glm::dot(normal, wi);
+    if (cosLight <= 0.0f)
+    {
+        return 0.0f;
+    }
+    float t = glm::dot(p - position, normal) / cosLight;
+    if (t <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    // coordinates of the hit point along ei and ej
+    glm::vec3 d = p + t * wi - position;
+    glm::vec3 c = glm::cross(ei, ej);
+    float cc = glm::dot(c, c);
+    float u = glm::dot(glm::cross(d, ej), c) / cc;
+    float v = glm::dot(glm::cross(ei, d), c) / cc;
+    if (u < 0.0f || u > 1.0f || v < 0.0f || v > 1.0f)
+    {
+        return 0.0f;
+    }
+    return t * t / (area * cosLight);
+}
+
+LightBounds AreaLight::getBounds() const
+{
+    // one sided, emitting over the hemisphere around the normal
+    LightBounds b;
+    b.bounds.grow(position);
+    b.bounds.grow(position + ei);
+    b.bounds.grow(position + ej);
+    b.bounds.grow(position + ei + ej);
+    b.w = normal;
+    b.phi = power.x + power.y + power.z;
+    b.cosThetaO = 1.0f;
+    b.cosThetaE = 0.0f;
+    return b;
+}
+
+namespace
+{
+    const float Pi = 3.14159265358979f;
+
+    float safeSqrt(float x)
+    {
+        return std::sqrt(glm::max(0.0f, x));
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+    }
+
+    float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+    }
+
+    // v rotated by angle around the unit axis k
+    glm::vec3 rotate(const glm::vec3& v, const glm::vec3& k, float angle)
+    {
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        return v * c + glm::cross(k, v) * s + k * glm::dot(k, v) * (1.0f - c);
+    }
+}
+
+float LightBounds::importance(const glm::vec3& p, const glm::vec3& n) const
+{
+    // distance to the center, clamped so points inside the bounds stay finite
+    glm::vec3 toPoint = p - bounds.centroid();
+    float distance2 = glm::dot(toPoint, toPoint);
+    float d2 = glm::max(distance2, 0.5f * glm::length(bounds.extent()));
+    glm::vec3 wp = distance2 > 0.0f ? toPoint / std::sqrt(distance2) : w;
+
+    // angle between the emission axis and the point
+    float cosThetaW = glm::dot(w, wp);
+    float sinThetaW = safeSqrt(1.0f - cosThetaW * cosThetaW);
+
+    // half angle the bounds subtend from p, everything when p is inside
+    float radius2 = 0.25f * glm::dot(bounds.extent(), bounds.extent());
+    float cosThetaB = distance2 < radius2 ? -1.0f : safeSqrt(1.0f - radius2 / distance2);
+    float sinThetaB = safeSqrt(1.0f - cosThetaB * cosThetaB);
+
+    // smallest angle between the emission cone and p over all of the bounds
+    float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE)
+    {
+        return 0.0f;
+    }
+
+    // the surface at p only receives light from above its normal
+    float cosThetaI = -glm::dot(n, wp);
+    float sinThetaI = safeSqrt(1.0f - cosThetaI * cosThetaI);
+    float cosThetaPI = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+    return glm::max(0.0f, phi * cosThetaP * cosThetaPI / d2);
+}
+
+LightBounds merge(const LightBounds& a, const LightBounds& b)
+{
+    if (a.phi == 0.0f)
+    {
+        return b;
+    }
+    if (b.phi == 0.0f)
+    {
+        return a;
+    }
+
+    LightBounds m;
+    m.bounds = a.bounds;
+    m.bounds.grow(b.bounds);
+    m.phi = a.phi + b.phi;
+    m.cosThetaE = glm::min(a.cosThetaE, b.cosThetaE);
+
+    // smallest cone around both emission cones
+    float thetaA = std::acos(glm::clamp(a.cosThetaO, -1.0f, 1.0f));
+    float thetaB = std::acos(glm::clamp(b.cosThetaO, -1.0f, 1.0f));
+    float thetaD = std::acos(glm::clamp(glm::dot(a.w, b.w), -1.0f, 1.0f));
+    if (glm::min(thetaD + thetaB, Pi) <= thetaA)
+    {
+        m.w = a.w;
+        m.cosThetaO = a.cosThetaO;
+        return m;
+    }
+    if (glm::min(thetaD + thetaA, Pi) <= thetaB)
+    {
+        m.w = b.w;
+        m.cosThetaO = b.cosThetaO;
+        return m;
+    }
+
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    glm::vec3 axis = glm::cross(a.w, b.w);
+    if (thetaO >= Pi || glm::dot(axis, axis) == 0.0f)
+    {
+        m.w = a.w;
+        m.cosThetaO = -1.0f;
+        return m;
+    }
+    m.w = glm::normalize(rotate(a.w, glm::normalize(axis), thetaO - thetaA));
+    m.cosThetaO = std::cos(thetaO);
+    return m;
+}
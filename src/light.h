@@ -1,38 +1,127 @@
-#ifndef LIGHT_H
-#define LIGHT_H
-
-#include <glm/glm.hpp>
-
-// Forward declaration
-class Scene;
-
-class Light
-{
-    public:
-        virtual ~Light() = default;
-        virtual glm::vec3 GetIrradiance() const = 0;
-        virtual glm::vec3 getPower() const = 0;
-        virtual int getSampleCount() const = 0;
-        virtual glm::vec3 getSample(float* pdf, glm::vec3& ns) const = 0;
-};
-
-class AreaLight : public Light
-{   
-    private:
-        glm::vec3 position;
-        glm::vec3 power;
-        glm::vec3 ei;
-        glm::vec3 ej;
-        glm::vec3 normal;
-        float area;	
-        int nSamples;
-
-    public:
-        AreaLight(const glm::vec3& position, const glm::vec3& power, const glm::vec3& ei, const glm::vec3& ej, int nSamples);
-        glm::vec3 GetIrradiance() const override;
-        glm::vec3 getSample(float* pdf, glm::vec3& ns) const;
-        int getSampleCount() const { return nSamples; }
-        float getArea() const { return area; }
-        glm::vec3 getPower() const override { return power; }
-};
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <glm/glm.hpp>
+#include "bounds.h"
+#include "sampler.h"
+
+// Forward declaration
+class Scene;
+
+// Where a light, or a group of them, sits and where it emits to: power phi
+// inside bounds, emitted around the cone of half angle thetaO about w plus
+// up to thetaE beyond the normals, the same bounds as in PBRT's light BVH.
+struct LightBounds
+{
+    AABB bounds;
+    glm::vec3 w;
+    float phi;
+    float cosThetaO;
+    float cosThetaE;
+
+    // conservative estimate of the light reaching point p with normal n,
+    // only relative values matter
+    float importance(const glm::vec3& p, const glm::vec3& n) const;
+};
+
+LightBounds merge(const LightBounds& a, const LightBounds& b);
+
+// the closed set of lights the render loops know, anything else is Custom
+enum class LightType : uint8_t { Area, Custom };
+
+class Light
+{
+    private:
+        LightType type;
+
+    protected:
+        Light(LightType type)
+            : type(type) {}
+
+    public:
+        Light()
+            : type(LightType::Custom) {}
+        virtual ~Light() = default;
+        virtual glm::vec3 GetIrradiance() const = 0;
+        virtual glm::vec3 getPower() const = 0;
+        virtual int getSampleCount() const = 0;
+        virtual glm::vec3 getSample(Sampler& sampler, float* pdf, glm::vec3& ns) const = 0;
+        // the point getSample returns for the uniform numbers u, for stratified sampling
+        virtual glm::vec3 getSampleAt(const glm::vec2& u, float* pdf, glm::vec3& ns) const = 0;
+        // solid angle density of getSample picking a point in direction wi from p,
+        // 0 if that direction does not reach the emitting side of the light
+        virtual float getPdf(const glm::vec3& p, const glm::vec3& wi) const = 0;
+        virtual LightBounds getBounds() const = 0;
+
+        LightType getType() const { return type; }
+};
+
+class AreaLight : public Light
+{   
+    private:
+        glm::vec3 position;
+        glm::vec3 power;
+        glm::vec3 ei;
+        glm::vec3 ej;
+        glm::vec3 normal;
+        float area;	
+        int nSamples;
+
+    public:
+        AreaLight(const glm::vec3& position, const glm::vec3& power, const glm::vec3& ei, const glm::vec3& ej, int nSamples);
+        glm::vec3 GetIrradiance() const override { return power / area; }
+        glm::vec3 getSample(Sampler& sampler, float* pdf, glm::vec3& ns) const override
+        {
+            return AreaLight::getSampleAt(sampler.next2D(), pdf, ns);
+        }
+        glm::vec3 getSampleAt(const glm::vec2& u, float* pdf, glm::vec3& ns) const override
+        {
+            ns = normal;
+            *pdf = 1.0f / area;
+            return position + ei * u.x + ej * u.y;
+        }
+        float getPdf(const glm::vec3& p, const glm::vec3& wi) const override;
+        int getSampleCount() const { return nSamples; }
+        float getArea() const { return area; }
+        glm::vec3 getPower() const override { return power; }
+        LightBounds getBounds() const override;
+};
+
+// Calls for the integrators that switch on the type instead of going through
+// the vtable, like sampleMaterial().
+inline glm::vec3 sampleLight(const Light& light, Sampler& sampler, float* pdf, glm::vec3& ns)
+{
+    switch (light.getType())
+    {
+        case LightType::Area: return static_cast<const AreaLight&>(light).AreaLight::getSample(sampler, pdf, ns);
+        default:              return light.getSample(sampler, pdf, ns);
+    }
+}
+
+inline glm::vec3 sampleLight(const Light& light, const glm::vec2& u, float* pdf, glm::vec3& ns)
+{
+    switch (light.getType())
+    {
+        case LightType::Area: return static_cast<const AreaLight&>(light).AreaLight::getSampleAt(u, pdf, ns);
+        default:              return light.getSampleAt(u, pdf, ns);
+    }
+}
+
+inline glm::vec3 lightRadiance(const Light& light)
+{
+    switch (light.getType())
+    {
+        case LightType::Area: return static_cast<const AreaLight&>(light).AreaLight::GetIrradiance();
+        default:              return light.GetIrradiance();
+    }
+}
+
+inline float lightPdf(const Light& light, const glm::vec3& p, const glm::vec3& wi)
+{
+    switch (light.getType())
+    {
+        case LightType::Area: return static_cast<const AreaLight&>(light).AreaLight::getPdf(p, wi);
+        default:              return light.getPdf(p, wi);
+    }
+}
 #endif 
\ No newline at end of file
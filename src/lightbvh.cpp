@@ -0,0 +1,246 @@
+#include "lightbvh.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const float Pi = 3.14159265358979f;
+    const float OneMinusEpsilon = 0x1.fffffep-1f;
+
+    // solid angle measure of an emission cone, the orientation term of the
+    // surface area orientation heuristic
+    float orientationMeasure(const LightBounds& b)
+    {
+        float thetaO = std::acos(glm::clamp(b.cosThetaO, -1.0f, 1.0f));
+        float thetaE = std::acos(glm::clamp(b.cosThetaE, -1.0f, 1.0f));
+        float thetaW = glm::min(thetaO + thetaE, Pi);
+        float sinThetaO = std::sin(thetaO);
+        return 2.0f * Pi * (1.0f - b.cosThetaO)
+            + 0.5f * Pi * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW)
+                           - 2.0f * thetaO * sinThetaO + b.cosThetaO);
+    }
+
+    LightBounds emptyBounds()
+    {
+        LightBounds b;
+        b.w = glm::vec3(0.0f, 0.0f, 1.0f);
+        b.phi = 0.0f;
+        b.cosThetaO = 1.0f;
+        b.cosThetaE = 1.0f;
+        return b;
+    }
+}
+
+void LightBVH::build(const std::vector<Light*>& sceneLights)
+{
+    nodes.clear();
+    parents.clear();
+    lights.clear();
+    leafOfLight.clear();
+
+    std::vector<LightBounds> lightBounds;
+    for (Light* light : sceneLights)
+    {
+        LightBounds b = light->getBounds();
+        if (b.phi > 0.0f && leafOfLight.emplace(light, -1).second)
+        {
+            lights.push_back(light);
+            lightBounds.push_back(b);
+        }
+    }
+    if (lights.empty())
+    {
+        return;
+    }
+
+    nodes.reserve(2 * lights.size() - 1);
+    parents.reserve(2 * lights.size() - 1);
+    std::vector<int> order(lights.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = static_cast<int>(i);
+    }
+    buildRecursive(order, 0, static_cast<int>(order.size()), lightBounds);
+}
+
+int LightBVH::buildRecursive(std::vector<int>& order, int begin, int end, const std::vector<LightBounds>& lightBounds)
+{
+    int nodeIndex = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    parents.push_back(-1);
+
+    if (end - begin == 1)
+    {
+        nodes[nodeIndex].bounds = lightBounds[order[begin]];
+        nodes[nodeIndex].offset = order[begin];
+        nodes[nodeIndex].leaf = true;
+        leafOfLight[lights[order[begin]]] = nodeIndex;
+        return nodeIndex;
+    }
+
+    AABB bounds;
+    AABB centroidBounds;
+    for (int i = begin; i < end; i++)
+    {
+        bounds.grow(lightBounds[order[i]].bounds);
+        centroidBounds.grow(lightBounds[order[i]].bounds.centroid());
+    }
+
+    // binned split minimizing power * orientation measure * area, with the
+    // regularizer of PBRT against thin nodes along the split axis
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestBin = 0;
+    glm::vec3 extent = bounds.extent();
+    float maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float lo = centroidBounds.bMin[axis];
+        float hi = centroidBounds.bMax[axis];
+        if (hi <= lo)
+        {
+            continue;
+        }
+
+        LightBounds bins[numBins];
+        std::fill(bins, bins + numBins, emptyBounds());
+        for (int i = begin; i < end; i++)
+        {
+            const LightBounds& b = lightBounds[order[i]];
+            int bin = glm::min(numBins - 1, static_cast<int>(numBins * (b.bounds.centroid()[axis] - lo) / (hi - lo)));
+            bins[bin] = merge(bins[bin], b);
+        }
+
+        auto cost = [](const LightBounds& b)
+        {
+            return b.phi * orientationMeasure(b) * b.bounds.surfaceArea();
+        };
+        float regularizer = extent[axis] > 0.0f ? maxExtent / extent[axis] : 1.0f;
+        for (int split = 1; split < numBins; split++)
+        {
+            LightBounds below = emptyBounds();
+            LightBounds above = emptyBounds();
+            for (int bin = 0; bin < split; bin++)
+            {
+                below = merge(below, bins[bin]);
+            }
+            for (int bin = split; bin < numBins; bin++)
+            {
+                above = merge(above, bins[bin]);
+            }
+            if (below.phi == 0.0f || above.phi == 0.0f)
+            {
+                continue;
+            }
+            float splitCost = regularizer * (cost(below) + cost(above));
+            if (splitCost < bestCost)
+            {
+                bestCost = splitCost;
+                bestAxis = axis;
+                bestBin = split;
+            }
+        }
+    }
+
+    int mid;
+    if (bestAxis < 0)
+    {
+        // every centroid in the same place, any halving will do
+        mid = (begin + end) / 2;
+    }
+    else
+    {
+        float lo = centroidBounds.bMin[bestAxis];
+        float hi = centroidBounds.bMax[bestAxis];
+        int* split = std::partition(order.data() + begin, order.data() + end, [&](int light)
+        {
+            float c = lightBounds[light].bounds.centroid()[bestAxis];
+            return glm::min(numBins - 1, static_cast<int>(numBins * (c - lo) / (hi - lo))) < bestBin;
+        });
+        mid = static_cast<int>(split - order.data());
+    }
+
+    int left = buildRecursive(order, begin, mid, lightBounds);
+    int right = buildRecursive(order, mid, end, lightBounds);
+    parents[left] = nodeIndex;
+    parents[right] = nodeIndex;
+    nodes[nodeIndex].bounds = merge(nodes[left].bounds, nodes[right].bounds);
+    nodes[nodeIndex].offset = right;
+    nodes[nodeIndex].leaf = false;
+    return nodeIndex;
+}
+
+Light* LightBVH::sample(const glm::vec3& p, const glm::vec3& n, float u, float* pmf) const
+{
+    if (nodes.empty())
+    {
+        return nullptr;
+    }
+
+    // descend by the relative importance of the children, reusing u
+    int nodeIndex = 0;
+    float probability = 1.0f;
+    while (!nodes[nodeIndex].leaf)
+    {
+        int left = nodeIndex + 1;
+        int right = nodes[nodeIndex].offset;
+        float importanceLeft = nodes[left].bounds.importance(p, n);
+        float importanceRight = nodes[right].bounds.importance(p, n);
+        if (importanceLeft == 0.0f && importanceRight == 0.0f)
+        {
+            return nullptr;
+        }
+
+        float pLeft = importanceLeft / (importanceLeft + importanceRight);
+        if (u < pLeft)
+        {
+            u = glm::min(u / pLeft, OneMinusEpsilon);
+            probability *= pLeft;
+            nodeIndex = left;
+        }
+        else
+        {
+            u = glm::min((u - pLeft) / (1.0f - pLeft), OneMinusEpsilon);
+            probability *= 1.0f - pLeft;
+            nodeIndex = right;
+        }
+    }
+
+    if (nodeIndex == 0 && nodes[0].bounds.importance(p, n) == 0.0f)
+    {
+        return nullptr;
+    }
+    *pmf = probability;
+    return lights[nodes[nodeIndex].offset];
+}
+
+float LightBVH::pmf(const glm::vec3& p, const glm::vec3& n, const Light* light) const
+{
+    auto it = leafOfLight.find(light);
+    if (it == leafOfLight.end())
+    {
+        return 0.0f;
+    }
+
+    // the same choices sample() makes, from the leaf up
+    int nodeIndex = it->second;
+    if (nodeIndex == 0)
+    {
+        return nodes[0].bounds.importance(p, n) > 0.0f ? 1.0f : 0.0f;
+    }
+    float probability = 1.0f;
+    while (nodeIndex != 0)
+    {
+        int parent = parents[nodeIndex];
+        int sibling = nodeIndex == parent + 1 ? nodes[parent].offset : parent + 1;
+        float importance = nodes[nodeIndex].bounds.importance(p, n);
+        float total = importance + nodes[sibling].bounds.importance(p, n);
+        if (importance == 0.0f)
+        {
+            return 0.0f;
+        }
+        probability *= importance / total;
+        nodeIndex = parent;
+    }
+    return probability;
+}
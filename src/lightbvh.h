@@ -0,0 +1,44 @@
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include "light.h"
+#include <unordered_map>
+#include <vector>
+
+// Hierarchy over the lights of a scene for picking one in proportion to its
+// estimated contribution at a shading point. Every node stores the
+// LightBounds of its subtree; sampling walks down from the root choosing a
+// child by the importance of its bounds, one light per leaf.
+class LightBVH
+{
+    private:
+        static const int numBins = 12;
+
+        // stored depth first like BVHNode, the left child follows its parent
+        struct Node
+        {
+            LightBounds bounds;
+            int offset;     // leaf: index into lights, interior: index of the right child
+            bool leaf;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<int> parents;
+        std::vector<Light*> lights;
+        std::unordered_map<const Light*, int> leafOfLight;
+
+        int buildRecursive(std::vector<int>& order, int begin, int end, const std::vector<LightBounds>& lightBounds);
+
+    public:
+        // lights without power are left out
+        void build(const std::vector<Light*>& sceneLights);
+        bool empty() const { return nodes.empty(); }
+        int getNodeCount() const { return static_cast<int>(nodes.size()); }
+
+        // picks a light for the point p with normal n from u in [0, 1), null
+        // if no light can reach the point
+        Light* sample(const glm::vec3& p, const glm::vec3& n, float u, float* pmf) const;
+        // probability of sample() returning light at p
+        float pmf(const glm::vec3& p, const glm::vec3& n, const Light* light) const;
+};
+#endif
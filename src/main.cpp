@@ -1,4 +1,6 @@
 #include "pathtracer.h"
+#include "distributed.h"
+#include "server.h"
 #include "camera.h"
 #include "film.h"
 #include "scene.h"
@@ -6,106 +8,488 @@
 #include "instance.h"
 #include "material.h"
 #include "shape.h"
+#include "mesh.h"
 #include "transform.h"
+#include "sceneloader.h"
+#include "stats.h"
 #include "glm/glm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
 
-int main() 
+static void printUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [--threads N] [--obj file.obj] [--packets] [--bench-primary] [--output file.ppm|.pfm|.exr] [--gamma G]" << std::endl;
+    std::cerr << "       [--scene file] [--samples N] [--depth N] [--roulette N] [--progressive N] [--checkpoint file] [--checkpoint-interval seconds] [--adaptive error]" << std::endl;
+    std::cerr << "       [--stats file.json] [--light-sampling power|bvh] [--compiled] [--simd scalar|sse|avx2]" << std::endl;
+    std::cerr << "       [--integrator nee|mis] [--light-samples N] [--time seconds] [--reference file.pfm] [--denoise]" << std::endl;
+    std::cerr << "       [--coordinator unix:path|host:port] [--job-samples N] [--job-timeout seconds] [--worker unix:path|host:port]" << std::endl;
+    std::cerr << "       [--set key=value] [--server unix:path|localhost:port] [--server-root dir]" << std::endl;
+    std::cerr << "       [--submit address] [--status address] [--shutdown address]" << std::endl;
+    std::cerr << "--compiled traces single rays against a flattened copy of the scene. It is groundwork for the" << std::endl;
+    std::cerr << "sse and avx2 kernels of --simd; with --simd scalar it is no faster than tracing the instances." << std::endl;
+    std::cerr << "--simd also picks the node, sphere and box tests of packet traversals, used by --packets and by shadow rays." << std::endl;
+}
+
+// the scene used when no scene file is given, same as scenes/default.scene
+static std::unique_ptr<Scene> createDefaultScene()
+{
+    // create scene
+    auto scene = std::make_unique<Scene>();
+    scene->setAmbientLight(glm::vec3(0.2, 0.2, 0.2));
+
+    // create materials
+    Material* redMaterial = scene->addMaterial(std::make_unique<PhongMaterial>(
+        glm::vec3(0.8f, 0.1f, 0.1f)    // diffuse
+    ));
+
+    Material* blueMaterial = scene->addMaterial(std::make_unique<PhongMaterial>(
+        glm::vec3(0.1f, 0.1f, 0.8f)    // diffuse 
+    ));
+
+    Material* floorMaterial = scene->addMaterial(std::make_unique<PhongMaterial>(
+        glm::vec3(0.8f, 0.8f, 0.8f)    // diffuse (almost white)
+    ));
+
+    // add lights to the scene
+    glm::vec3 lightPosition(2.0f, 4.0f, 3.0f);
+    
+    // Add area light
+    Light* areaLight = scene->addLight(std::make_unique<AreaLight>(
+        glm::vec3(0.0f, 4.0f, 0.0f),                    // position
+        glm::vec3(1000.0f, 1000.0f, 100.0f),   // power
+        glm::vec3(2.0f, 0.0f, 0.0f),         // ei (x-axis)
+        glm::vec3(0.0f, 0.0f, 2.0f),         // ej (z-axis)
+        25                                 // number of samples
+    ));
+    
+    // Create a thin box to represent the area light
+    auto areaLightBox = std::make_unique<Box>(
+        glm::vec3(-1.0f, -0.1f, -1.0f),     // bMin (thin in y direction)
+        glm::vec3(1.0f, 0.1f, 1.0f)         // bMax (thin in y direction)
+    );
+
+    auto areaLightInstance = std::make_unique<Instance>(std::move(areaLightBox));
+    areaLightInstance->setLight(areaLight);
+    areaLightInstance->translate(glm::vec3(0.0f, 4.0f, 0.0f));
+    scene->addObject(std::move(areaLightInstance));
+    
+    // add objects to the scene
+    auto sphere = std::make_unique<Sphere>(glm::vec3(0.5f, 1.0f, 0.0f), 1.0f); // larger red sphere
+    auto sphereInstance = std::make_unique<Instance>(std::move(sphere));
+    sphereInstance->setMaterial(redMaterial);
+    scene->addObject(std::move(sphereInstance));
+
+    // create floor
+    auto floorBoxShape = std::make_unique<Box>(
+        glm::vec3(-10.0f, -0.1f, -5.0f), // bMin
+        glm::vec3(10.0f, 0.0f, 10.0f)     // bMax
+    );
+    auto floorInstance = std::make_unique<Instance>(std::move(floorBoxShape));
+    floorInstance->setMaterial(floorMaterial);
+    scene->addObject(std::move(floorInstance));
+
+    // create blue sphere
+    auto blueBox = std::make_unique<Box>(
+        glm::vec3(-3.0f, 0.0f, -2.0f), // bMin
+        glm::vec3(-1.0f, 2.0f, 1.0f));
+    
+    auto blueBoxInstance = std::make_unique<Instance>(std::move(blueBox));
+    blueBoxInstance->setMaterial(blueMaterial);
+    blueBoxInstance->translate(glm::vec3(0.0f, 1.0f, 0.0f));
+    blueBoxInstance->rotate(45.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+
+    scene->addObject(std::move(blueBoxInstance));
+    return scene;
+}
+
+int main(int argc, char* argv[]) 
 {
     try {
+        // parse command line options
+        int numThreads = 0; // 0 = all hardware threads
+        std::string objFile;
+        std::string sceneFile;
+        bool usePackets = false;
+        bool benchPrimary = false;
+        std::string outputFile = "output.ppm";
+        float gamma = 1.0f;
+        int numSamples = 0; // 0 = as set by the scene
+        int maxDepth = 0;
+        bool setRoulette = false;
+        int rouletteDepth = -1;
+        int samplesPerPass = 0;
+        std::string checkpointFile;
+        double checkpointInterval = 60.0;
+        float adaptiveThreshold = 0.0f;
+        std::string statsFile;
+        LightSampling lightSampling = LightSampling::Hierarchy;
+        PathIntegrator integrator = PathIntegrator::NextEvent;
+        int lightSamples = 0; // 0 = as set by every light
+        double timeLimit = 0.0;
+        std::string referenceFile;
+        bool denoise = false;
+        std::string coordinatorAddress;
+        std::string workerAddress;
+        int jobSamples = 0; // 0 = all samples of a tile in one job
+        double jobTimeout = 0.0; // 0 = follow the slowest job
+        std::vector<std::string> settingOverrides;
+        std::string serverAddress;
+        std::string serverRoot = ".";
+        std::string submitAddress;
+        std::string serverRequest;
+        bool useCompiled = false;
+        SimdLevel simdLevel = SimdLevel::AVX2;
+        for (int a = 1; a < argc; a++)
+        {
+            if ((std::strcmp(argv[a], "--threads") == 0 || std::strcmp(argv[a], "-t") == 0) && a + 1 < argc)
+            {
+                numThreads = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+            {
+                sceneFile = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--obj") == 0 && a + 1 < argc)
+            {
+                objFile = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--packets") == 0)
+            {
+                usePackets = true;
+            }
+            else if (std::strcmp(argv[a], "--output") == 0 && a + 1 < argc)
+            {
+                outputFile = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--gamma") == 0 && a + 1 < argc)
+            {
+                gamma = std::stof(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--samples") == 0 && a + 1 < argc)
+            {
+                numSamples = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--depth") == 0 && a + 1 < argc)
+            {
+                maxDepth = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--roulette") == 0 && a + 1 < argc)
+            {
+                // a negative depth turns roulette off for scenes that enable it
+                setRoulette = true;
+                rouletteDepth = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--progressive") == 0 && a + 1 < argc)
+            {
+                samplesPerPass = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc)
+            {
+                checkpointFile = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--checkpoint-interval") == 0 && a + 1 < argc)
+            {
+                checkpointInterval = std::stod(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--adaptive") == 0 && a + 1 < argc)
+            {
+                adaptiveThreshold = std::stof(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--stats") == 0 && a + 1 < argc)
+            {
+                statsFile = argv[++a];
+                if (!Stats::enabled)
+                {
+                    std::cerr << "Ignoring --stats, statistics need a build with make STATS=1" << std::endl;
+                }
+            }
+            else if (std::strcmp(argv[a], "--light-sampling") == 0 && a + 1 < argc)
+            {
+                std::string mode = argv[++a];
+                if (mode != "power" && mode != "bvh")
+                {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                lightSampling = mode == "power" ? LightSampling::Power : LightSampling::Hierarchy;
+            }
+            else if (std::strcmp(argv[a], "--integrator") == 0 && a + 1 < argc)
+            {
+                std::string mode = argv[++a];
+                if (mode != "nee" && mode != "mis")
+                {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                integrator = mode == "mis" ? PathIntegrator::MIS : PathIntegrator::NextEvent;
+            }
+            else if (std::strcmp(argv[a], "--light-samples") == 0 && a + 1 < argc)
+            {
+                lightSamples = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--time") == 0 && a + 1 < argc)
+            {
+                timeLimit = std::stod(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--reference") == 0 && a + 1 < argc)
+            {
+                referenceFile = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--denoise") == 0)
+            {
+                denoise = true;
+            }
+            else if (std::strcmp(argv[a], "--coordinator") == 0 && a + 1 < argc)
+            {
+                coordinatorAddress = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--worker") == 0 && a + 1 < argc)
+            {
+                workerAddress = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--job-samples") == 0 && a + 1 < argc)
+            {
+                jobSamples = std::stoi(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--job-timeout") == 0 && a + 1 < argc)
+            {
+                jobTimeout = std::stod(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--set") == 0 && a + 1 < argc)
+            {
+                settingOverrides.push_back(argv[++a]);
+            }
+            else if (std::strcmp(argv[a], "--server") == 0 && a + 1 < argc)
+            {
+                serverAddress = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--server-root") == 0 && a + 1 < argc)
+            {
+                serverRoot = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--submit") == 0 && a + 1 < argc)
+            {
+                submitAddress = argv[++a];
+                serverRequest = "render";
+            }
+            else if ((std::strcmp(argv[a], "--status") == 0 || std::strcmp(argv[a], "--shutdown") == 0) && a + 1 < argc)
+            {
+                serverRequest = argv[a] + 2;
+                submitAddress = argv[++a];
+            }
+            else if (std::strcmp(argv[a], "--compiled") == 0)
+            {
+                useCompiled = true;
+            }
+            else if (std::strcmp(argv[a], "--simd") == 0 && a + 1 < argc)
+            {
+                std::string level = argv[++a];
+                if (level != "scalar" && level != "sse" && level != "avx2")
+                {
+                    printUsage(argv[0]);
+                    return 1;
+                }
+                simdLevel = level == "scalar" ? SimdLevel::Scalar : (level == "sse" ? SimdLevel::SSE : SimdLevel::AVX2);
+            }
+            else if (std::strcmp(argv[a], "--bench-primary") == 0)
+            {
+                benchPrimary = true;
+            }
+            else
+            {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+
+        // requests to a render server, which opens the files itself
+        if (!submitAddress.empty())
+        {
+            std::vector<std::string> words = { serverRequest };
+            if (serverRequest == "render")
+            {
+                if (!sceneFile.empty())
+                {
+                    words.push_back("scene=" + std::filesystem::absolute(sceneFile).string());
+                }
+                if (numSamples > 0)
+                {
+                    words.push_back("samples=" + std::to_string(numSamples));
+                }
+                if (maxDepth > 0)
+                {
+                    words.push_back("depth=" + std::to_string(maxDepth));
+                }
+                if (setRoulette)
+                {
+                    words.push_back("roulette=" + std::to_string(rouletteDepth));
+                }
+                words.insert(words.end(), settingOverrides.begin(), settingOverrides.end());
+                words.push_back("output=" + std::filesystem::absolute(outputFile).string());
+            }
+            std::string request;
+            for (const std::string& word : words)
+            {
+                if (word.find_first_of(" \t\r\n") != std::string::npos)
+                {
+                    std::cerr << "Render server requests cannot hold spaces: " << word << std::endl;
+                    return 1;
+                }
+                request += request.empty() ? word : " " + word;
+            }
+            return sendServerRequest(submitAddress, request) ? 0 : 1;
+        }
+
+        // load or create the scene
+        RenderSettings settings;
+        std::unique_ptr<Scene> scene;
+        if (!sceneFile.empty())
+        {
+            scene = loadScene(sceneFile, &settings);
+            if (!scene)
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            scene = createDefaultScene();
+        }
+        if (numSamples > 0)
+        {
+            settings.numSamples = numSamples;
+        }
+        if (maxDepth > 0)
+        {
+            settings.dMax = maxDepth;
+        }
+        if (setRoulette)
+        {
+            settings.rouletteDepth = rouletteDepth;
+        }
+        for (const std::string& setting : settingOverrides)
+        {
+            size_t equals = setting.find('=');
+            if (equals == std::string::npos
+                || !applyRenderSetting(setting.substr(0, equals), setting.substr(equals + 1), &settings))
+            {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+
         // create film
-        const int width = 800;
-        const int height = 600;
-        const int numSamples = 64;
-        const int dMax = 4;
+        const int width = settings.width;
+        const int height = settings.height;
+        const int dMax = settings.dMax;
         auto film = std::make_unique<Film>(glm::ivec2(width, height));
 
         // create camera
-        glm::vec3 eye(0.0f, 2.5f, 7.0f);    // camera position
-        glm::vec3 lookAt(0.0f, 1.0f, 0.0f); // look at point (center)
-        glm::vec3 up(0.0f, 1.0f, 0.0f);     // up vector
-        float fov = 50.0f;                  // field of view
-        float focalDistance = 1.0f;         // distance from camera to look-at point (focal distance)
-        auto camera = std::make_unique<Camera>(eye, lookAt, up, fov, focalDistance, width, height);
-
-        // create scene
-        auto scene = std::make_unique<Scene>();
-        scene->setAmbientLight(glm::vec3(0.2, 0.2, 0.2));
-
-        // create materials
-        auto redMaterial = std::make_unique<PhongMaterial>(
-            glm::vec3(0.8f, 0.1f, 0.1f)    // diffuse
-        );
-
-        auto blueMaterial = std::make_unique<PhongMaterial>(
-            glm::vec3(0.1f, 0.1f, 0.8f)    // diffuse 
-        );
-
-        auto floorMaterial = std::make_unique<PhongMaterial>(
-            glm::vec3(0.8f, 0.8f, 0.8f)    // diffuse (almost white)
-        );
-
-        // add lights to the scene
-        glm::vec3 lightPosition(2.0f, 4.0f, 3.0f);
-        
-        // Add area light
-        auto areaLight = std::make_unique<AreaLight>(
-            glm::vec3(0.0f, 4.0f, 0.0f),                    // position
-            glm::vec3(1000.0f, 1000.0f, 100.0f),   // power
-            glm::vec3(2.0f, 0.0f, 0.0f),         // ei (x-axis)
-            glm::vec3(0.0f, 0.0f, 2.0f),         // ej (z-axis)
-            25                                 // number of samples
-        );
-        
-        // Create a thin box to represent the area light
-        auto areaLightBox = std::make_unique<Box>(
-            glm::vec3(-1.0f, -0.1f, -1.0f),     // bMin (thin in y direction)
-            glm::vec3(1.0f, 0.1f, 1.0f)         // bMax (thin in y direction)
-        );
-
-        auto areaLightInstance = std::make_unique<Instance>(std::move(areaLightBox));
-        areaLightInstance->setLight(areaLight.get());
-        areaLightInstance->translate(glm::vec3(0.0f, 4.0f, 0.0f));
-        scene->addObject(std::move(areaLightInstance));
-        
-        // add objects to the scene
-        auto sphere = std::make_unique<Sphere>(glm::vec3(0.5f, 1.0f, 0.0f), 1.0f); // larger red sphere
-        auto sphereInstance = std::make_unique<Instance>(std::move(sphere));
-        sphereInstance->setMaterial(redMaterial.get());
-        scene->addObject(std::move(sphereInstance));
-
-        // create floor
-        auto floorBoxShape = std::make_unique<Box>(
-            glm::vec3(-10.0f, -0.1f, -5.0f), // bMin
-            glm::vec3(10.0f, 0.0f, 10.0f)     // bMax
-        );
-        auto floorInstance = std::make_unique<Instance>(std::move(floorBoxShape));
-        floorInstance->setMaterial(floorMaterial.get());
-        scene->addObject(std::move(floorInstance));
-
-        // create blue sphere
-        auto blueBox = std::make_unique<Box>(
-            glm::vec3(-3.0f, 0.0f, -2.0f), // bMin
-            glm::vec3(-1.0f, 2.0f, 1.0f));
-        
-        auto blueBoxInstance = std::make_unique<Instance>(std::move(blueBox));
-        blueBoxInstance->setMaterial(blueMaterial.get());
-        blueBoxInstance->translate(glm::vec3(0.0f, 1.0f, 0.0f));
-        blueBoxInstance->rotate(45.0f, glm::vec3(1.0f, 0.0f, 0.0f));
-
-        scene->addObject(std::move(blueBoxInstance));
+        auto camera = std::make_unique<Camera>(settings.eye, settings.lookAt, settings.up, settings.fov,
+                                               settings.focalDistance, width, height);
+
+        // optional mesh from the command line
+        if (!objFile.empty())
+        {
+            auto mesh = loadOBJ(objFile);
+            if (!mesh)
+            {
+                return 1;
+            }
+            Material* meshMaterial = scene->addMaterial(std::make_unique<PhongMaterial>(
+                glm::vec3(0.7f, 0.7f, 0.7f)    // diffuse
+            ));
+            auto meshInstance = std::make_unique<Instance>(std::move(mesh));
+            meshInstance->setMaterial(meshMaterial);
+            scene->addObject(std::move(meshInstance));
+        }
+        // the render server prepares the scenes it loads later the same way
+        auto prepareScene = [&](Scene* target, const RenderSettings& targetSettings)
+        {
+            if (!target->isFinalized())
+            {
+                target->finalize();
+            }
+            target->setLightSampling(lightSampling);
+            target->setRussianRoulette(targetSettings.rouletteDepth);
+            target->setIntegrator(integrator);
+            target->setLightSampleCount(lightSamples);
+            target->setSimdLevel(simdLevel);
+            target->setCompiled(useCompiled);
+        };
+        prepareScene(scene.get(), settings);
 
         // Create and run raytracer
-        PathTracer pathtracer;
-        pathtracer.render(film.get(), camera.get(), scene.get(), numSamples, dMax);
+        PathTracer pathtracer(numThreads);
+        pathtracer.setPacketMode(usePackets);
+        pathtracer.setProgressive(samplesPerPass);
+        pathtracer.setAdaptive(adaptiveThreshold);
+        pathtracer.setStatsFile(statsFile);
+        pathtracer.setTimeLimit(timeLimit);
+        pathtracer.setReference(referenceFile);
+        pathtracer.setDenoise(denoise);
+        if (!serverAddress.empty())
+        {
+            // jobs bring their own camera and film, the scene stays loaded between them
+            RenderServer server(&pathtracer);
+            if (!server.setRoot(serverRoot))
+            {
+                return 1;
+            }
+            server.setGamma(gamma);
+            server.setScenePreparation(prepareScene);
+            server.addScene(sceneFile, std::move(scene), settings);
+            return server.run(serverAddress) ? 0 : 1;
+        }
+        if (!checkpointFile.empty())
+        {
+            pathtracer.setCheckpoint(checkpointFile, checkpointInterval);
+        }
+        if (benchPrimary)
+        {
+            pathtracer.measurePrimaryRays(film.get(), camera.get(), scene.get(), 16);
+            return 0;
+        }
+        if (!workerAddress.empty())
+        {
+            // workers render jobs for a coordinator started with the same scene and options
+            RenderWorker worker(workerAddress);
+            return worker.run(&pathtracer, film.get(), camera.get(), scene.get(), dMax) ? 0 : 1;
+        }
+        if (!coordinatorAddress.empty())
+        {
+            RenderCoordinator coordinator(coordinatorAddress);
+            coordinator.setJobSamples(static_cast<uint32_t>(std::max(jobSamples, 0)));
+            coordinator.setJobTimeout(jobTimeout);
+            if (!coordinator.render(film.get(), camera.get(), scene.get(), static_cast<uint32_t>(settings.numSamples), dMax,
+                                    pathtracer.settingsKey(film.get(), camera.get(), scene.get(), dMax)))
+            {
+                std::cerr << "Distributed render failed" << std::endl;
+                return 1;
+            }
+        }
+        else
+        {
+            pathtracer.render(film.get(), camera.get(), scene.get(), settings.numSamples, dMax);
+        }
 
         // Save the rendered image
-        if (!film->savePPM("output.ppm")) {
+        auto saveStart = std::chrono::steady_clock::now();
+        film->setToneMap(1.0f, gamma);
+        if (!film->saveImage(outputFile, pathtracer.getThreadPool())) {
             std::cerr << "Failed to save image" << std::endl;
             return 1;
         }
 
+        std::chrono::duration<double, std::milli> saveTime = std::chrono::steady_clock::now() - saveStart;
+        std::cout << "Saved " << outputFile << " in " << saveTime.count() << "ms" << std::endl;
+
         std::cout << "Rendering completed successfully!" << std::endl;
         return 0;
     }
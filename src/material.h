@@ -1,32 +1,105 @@
-#ifndef MATERIAL_H
-#define MATERIAL_H
-
-#include <glm/glm.hpp>
-
-// Forward declarations
-class Scene;
-class Hit;
-
-class Material
-{
-    public:
-        Material() = default;
-        virtual ~Material() = default;
-        virtual glm::vec3 GetSample(float* pdf) const = 0;
-        virtual glm::vec3 GetBRDF() const = 0;
-};
-
-class PhongMaterial : public Material
-{
-    private:
-        glm::vec3 diffuse;
-
-    public:
-        PhongMaterial(const glm::vec3& diffuse)
-            : diffuse(diffuse) {}
-        
-        glm::vec3 GetSample(float* pdf) const override;
-        glm::vec3 GetBRDF() const override;
-
-};
-#endif
\ No newline at end of file
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include "sampler.h"
+
+// Forward declarations
+class Scene;
+class Hit;
+
+// the closed set of materials the render loops know, anything else is Custom
+enum class MaterialType : uint8_t { Phong, Custom };
+
+class Material
+{
+    private:
+        MaterialType type;
+
+    protected:
+        Material(MaterialType type)
+            : type(type) {}
+
+    public:
+        Material()
+            : type(MaterialType::Custom) {}
+        virtual ~Material() = default;
+        virtual glm::vec3 GetSample(Sampler& sampler, float* pdf) const = 0;
+        virtual glm::vec3 GetBRDF() const = 0;
+        // density of GetSample returning the hemisphere direction wih
+        virtual float getPdf(const glm::vec3& wih) const = 0;
+        // fraction of light reflected overall, what the denoiser divides out
+        virtual glm::vec3 getAlbedo() const = 0;
+
+        MaterialType getType() const { return type; }
+};
+
+class PhongMaterial : public Material
+{
+    private:
+        glm::vec3 diffuse;
+
+    public:
+        PhongMaterial(const glm::vec3& diffuse)
+            : Material(MaterialType::Phong), diffuse(diffuse) {}
+        
+        glm::vec3 GetSample(Sampler& sampler, float* pdf) const override
+        {
+            float rand1 = sampler.next1D();
+            float rand2 = sampler.next1D();
+            float rand1sqrt = glm::sqrt(rand1);
+
+            float angle = glm::two_pi<float>() * rand2;
+
+            float x = rand1sqrt* glm::cos(angle);
+            float y = rand1sqrt * glm::sin(angle);
+            float z = glm::sqrt(1.0f - rand1);
+
+            *pdf = z / glm::pi<float>();
+            return glm::vec3(x, y, z);
+        }
+
+        glm::vec3 GetBRDF() const override { return diffuse / glm::pi<float>(); }
+        float getPdf(const glm::vec3& wih) const override { return glm::max(0.0f, wih.z) / glm::pi<float>(); }
+        glm::vec3 getAlbedo() const override { return diffuse; }
+};
+
+// Calls for the integrators that switch on the type instead of going through
+// the vtable, so the known materials are inlined into the shading loops.
+inline glm::vec3 sampleMaterial(const Material& material, Sampler& sampler, float* pdf)
+{
+    switch (material.getType())
+    {
+        case MaterialType::Phong: return static_cast<const PhongMaterial&>(material).PhongMaterial::GetSample(sampler, pdf);
+        default:                  return material.GetSample(sampler, pdf);
+    }
+}
+
+inline glm::vec3 materialBRDF(const Material& material)
+{
+    switch (material.getType())
+    {
+        case MaterialType::Phong: return static_cast<const PhongMaterial&>(material).PhongMaterial::GetBRDF();
+        default:                  return material.GetBRDF();
+    }
+}
+
+inline glm::vec3 materialAlbedo(const Material& material)
+{
+    switch (material.getType())
+    {
+        case MaterialType::Phong: return static_cast<const PhongMaterial&>(material).PhongMaterial::getAlbedo();
+        default:                  return material.getAlbedo();
+    }
+}
+
+inline float materialPdf(const Material& material, const glm::vec3& wih)
+{
+    switch (material.getType())
+    {
+        case MaterialType::Phong: return static_cast<const PhongMaterial&>(material).PhongMaterial::getPdf(wih);
+        default:                  return material.getPdf(wih);
+    }
+}
+#endif
@@ -0,0 +1,372 @@
+#include "mesh.h"
+#include "stats.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#define EPSILON 1e-4f
+
+TriangleMesh::TriangleMesh(std::vector<glm::vec3> positions, std::vector<glm::vec3> normals,
+                           std::vector<uint32_t> positionIndices, std::vector<uint32_t> normalIndices)
+    : positions(std::move(positions))
+    , normals(std::move(normals))
+    , positionIndices(std::move(positionIndices))
+    , normalIndices(std::move(normalIndices))
+{
+    int numTriangles = getTriangleCount();
+    std::vector<AABB> triangleBounds(numTriangles);
+    for (int i = 0; i < numTriangles; i++)
+    {
+        triangleBounds[i].grow(this->positions[this->positionIndices[3 * i]]);
+        triangleBounds[i].grow(this->positions[this->positionIndices[3 * i + 1]]);
+        triangleBounds[i].grow(this->positions[this->positionIndices[3 * i + 2]]);
+    }
+    bvh.build(triangleBounds);
+}
+
+void TriangleMesh::hash(Hasher& hasher) const
+{
+    hasher.addBytes(positions.data(), positions.size() * sizeof(glm::vec3));
+    hasher.addBytes(normals.data(), normals.size() * sizeof(glm::vec3));
+    hasher.addBytes(positionIndices.data(), positionIndices.size() * sizeof(uint32_t));
+    hasher.addBytes(normalIndices.data(), normalIndices.size() * sizeof(uint32_t));
+}
+
+size_t TriangleMesh::getMemoryUsage() const
+{
+    return positions.capacity() * sizeof(glm::vec3)
+         + normals.capacity() * sizeof(glm::vec3)
+         + positionIndices.capacity() * sizeof(uint32_t)
+         + normalIndices.capacity() * sizeof(uint32_t)
+         + bvh.getNodes().capacity() * sizeof(BVHNode)
+         + bvh.getPrimIndices().capacity() * sizeof(int);
+}
+
+bool TriangleMesh::intersectTriangle(int triangle, const Ray& ray, float tMax, float* t, float* u, float* v) const
+{
+    PT_STAT_ADD(StatTriangleTests, 1);
+    // Moller-Trumbore
+    const glm::vec3& p0 = positions[positionIndices[3 * triangle]];
+    const glm::vec3& p1 = positions[positionIndices[3 * triangle + 1]];
+    const glm::vec3& p2 = positions[positionIndices[3 * triangle + 2]];
+
+    glm::vec3 edge1 = p1 - p0;
+    glm::vec3 edge2 = p2 - p0;
+    glm::vec3 pvec = glm::cross(ray.getRayDirection(), edge2);
+    float det = glm::dot(edge1, pvec);
+    if (std::abs(det) < 1e-12f) // ray parallel to the triangle
+    {
+        return false;
+    }
+
+    float invDet = 1.0f / det;
+    glm::vec3 tvec = ray.getRayOrigin() - p0;
+    float b1 = glm::dot(tvec, pvec) * invDet;
+    if (b1 < 0.0f || b1 > 1.0f)
+    {
+        return false;
+    }
+
+    glm::vec3 qvec = glm::cross(tvec, edge1);
+    float b2 = glm::dot(ray.getRayDirection(), qvec) * invDet;
+    if (b2 < 0.0f || b1 + b2 > 1.0f)
+    {
+        return false;
+    }
+
+    float tHit = glm::dot(edge2, qvec) * invDet;
+    if (tHit < EPSILON || tHit >= tMax)
+    {
+        return false;
+    }
+
+    *t = tHit;
+    *u = b1;
+    *v = b2;
+    return true;
+}
+
+bool TriangleMesh::intersect(const Ray& ray, float tMax, Hit* hit) const
+{
+    PT_STAT_ADD(StatMeshTests, 1);
+    int closestTriangle = -1;
+    float closestT = tMax;
+    float closestU = 0.0f;
+    float closestV = 0.0f;
+
+    bvh.traverse(ray, tMax, [&](int triangle, float& tClosest)
+    {
+        float t, u, v;
+        if (intersectTriangle(triangle, ray, tClosest, &t, &u, &v))
+        {
+            tClosest = t;
+            closestTriangle = triangle;
+            closestT = t;
+            closestU = u;
+            closestV = v;
+            return true;
+        }
+        return false;
+    });
+
+    if (closestTriangle < 0)
+    {
+        return false;
+    }
+
+    const uint32_t* vertex = &positionIndices[3 * closestTriangle];
+    glm::vec3 geometricNormal = glm::normalize(glm::cross(positions[vertex[1]] - positions[vertex[0]],
+                                                          positions[vertex[2]] - positions[vertex[0]]));
+    glm::vec3 normal = geometricNormal;
+
+    const uint32_t* normalIndex = normalIndices.empty() ? nullptr : &normalIndices[3 * closestTriangle];
+    if (normalIndex && normalIndex[0] != noNormal && normalIndex[1] != noNormal && normalIndex[2] != noNormal)
+    {
+        float w = 1.0f - closestU - closestV;
+        normal = glm::normalize(w * normals[normalIndex[0]] + closestU * normals[normalIndex[1]] + closestV * normals[normalIndex[2]]);
+    }
+
+    hit->t = closestT;
+    hit->position = ray.getRayOrigin() + closestT * ray.getRayDirection();
+
+    // make the normal face the incoming ray, like the other shapes do for backfaces
+    hit->backface = glm::dot(geometricNormal, ray.getRayDirection()) > 0.0f;
+    if (hit->backface)
+    {
+        normal = -normal;
+    }
+    hit->normal = normal;
+    return true;
+}
+
+bool TriangleMesh::occluded(const Ray& ray, float tMax) const
+{
+    PT_STAT_ADD(StatMeshTests, 1);
+    return bvh.traverseAny(ray, tMax, [&](int triangle)
+    {
+        float t, u, v;
+        return intersectTriangle(triangle, ray, tMax, &t, &u, &v);
+    });
+}
+
+namespace
+{
+    inline bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    inline const char* skipSpaces(const char* p)
+    {
+        while (isSpace(*p))
+        {
+            p++;
+        }
+        return p;
+    }
+
+    inline glm::vec3 parseVec3(const char* p)
+    {
+        char* end;
+        glm::vec3 v;
+        v.x = std::strtof(p, &end);
+        v.y = std::strtof(end, &end);
+        v.z = std::strtof(end, &end);
+        return v;
+    }
+
+    // resolves a 1-based (or negative, relative) OBJ index to a 0-based one
+    inline uint32_t resolveIndex(long index, size_t count)
+    {
+        if (index > 0)
+        {
+            return static_cast<uint32_t>(index - 1);
+        }
+        return static_cast<uint32_t>(static_cast<long>(count) + index);
+    }
+}
+
+std::unique_ptr<TriangleMesh> loadOBJ(const std::string& filename)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file)
+    {
+        std::cerr << "Failed to open OBJ file: " << filename << std::endl;
+        return nullptr;
+    }
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<uint32_t> positionIndices;
+    std::vector<uint32_t> normalIndices;
+    bool anyNormals = false;
+
+    // scratch for the corners of one polygon, reused by every face
+    std::vector<uint32_t> facePositions;
+    std::vector<uint32_t> faceNormals;
+
+    // the file is streamed through a fixed buffer; a partial line at the end of
+    // a chunk is moved to the front and completed by the next read
+    const size_t chunkSize = 1 << 20;
+    std::vector<char> buffer(chunkSize + 2);
+    size_t carried = 0;
+    bool endOfFile = false;
+    long lineNumber = 0;
+
+    while (!endOfFile)
+    {
+        size_t bytesRead = std::fread(buffer.data() + carried, 1, chunkSize - carried, file);
+        size_t available = carried + bytesRead;
+        if (bytesRead == 0)
+        {
+            endOfFile = true;
+            if (available == 0)
+            {
+                break;
+            }
+            buffer[available++] = '\n';
+        }
+
+        size_t parsedEnd = available;
+        while (parsedEnd > 0 && buffer[parsedEnd - 1] != '\n')
+        {
+            parsedEnd--;
+        }
+        if (parsedEnd == 0)
+        {
+            if (available >= chunkSize)
+            {
+                std::cerr << "Line too long in OBJ file: " << filename << std::endl;
+                std::fclose(file);
+                return nullptr;
+            }
+            carried = available;
+            continue;
+        }
+        char saved = buffer[parsedEnd];
+        buffer[parsedEnd] = '\0'; // keeps strtof/strtol inside the complete lines
+
+        const char* p = buffer.data();
+        const char* end = buffer.data() + parsedEnd;
+        while (p < end)
+        {
+            lineNumber++;
+            const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            p = skipSpaces(p);
+
+            if (p[0] == 'v' && isSpace(p[1]))
+            {
+                positions.push_back(parseVec3(p + 2));
+            }
+            else if (p[0] == 'v' && p[1] == 'n' && isSpace(p[2]))
+            {
+                normals.push_back(parseVec3(p + 3));
+                anyNormals = true;
+            }
+            else if (p[0] == 'f' && isSpace(p[1]))
+            {
+                facePositions.clear();
+                faceNormals.clear();
+                const char* q = skipSpaces(p + 2);
+                while (q < lineEnd && *q != '\n')
+                {
+                    char* next;
+                    long vertexIndex = std::strtol(q, &next, 10);
+                    if (next == q)
+                    {
+                        break;
+                    }
+                    q = next;
+                    uint32_t normalIndex = TriangleMesh::noNormal;
+                    if (*q == '/')
+                    {
+                        q++;
+                        if (*q != '/')
+                        {
+                            std::strtol(q, &next, 10); // texture coordinates are not used
+                            q = next;
+                        }
+                        if (*q == '/')
+                        {
+                            q++;
+                            long n = std::strtol(q, &next, 10);
+                            if (next != q)
+                            {
+                                normalIndex = resolveIndex(n, normals.size());
+                            }
+                            q = next;
+                        }
+                    }
+                    facePositions.push_back(resolveIndex(vertexIndex, positions.size()));
+                    faceNormals.push_back(normalIndex);
+                    q = skipSpaces(q);
+                }
+
+                if (facePositions.size() < 3)
+                {
+                    std::cerr << filename << ":" << lineNumber << ": face with fewer than 3 vertices ignored" << std::endl;
+                }
+                for (size_t k = 2; k < facePositions.size(); k++)
+                {
+                    positionIndices.push_back(facePositions[0]);
+                    positionIndices.push_back(facePositions[k - 1]);
+                    positionIndices.push_back(facePositions[k]);
+                    normalIndices.push_back(faceNormals[0]);
+                    normalIndices.push_back(faceNormals[k - 1]);
+                    normalIndices.push_back(faceNormals[k]);
+                }
+            }
+
+            p = lineEnd + 1;
+        }
+
+        buffer[parsedEnd] = saved;
+        carried = available - parsedEnd;
+        std::memmove(buffer.data(), buffer.data() + parsedEnd, carried);
+    }
+    std::fclose(file);
+
+    for (uint32_t index : positionIndices)
+    {
+        if (index >= positions.size())
+        {
+            std::cerr << "Vertex index out of range in OBJ file: " << filename << std::endl;
+            return nullptr;
+        }
+    }
+    for (uint32_t& index : normalIndices)
+    {
+        if (index != TriangleMesh::noNormal && index >= normals.size())
+        {
+            index = TriangleMesh::noNormal;
+        }
+    }
+    if (positionIndices.empty())
+    {
+        std::cerr << "No triangles in OBJ file: " << filename << std::endl;
+        return nullptr;
+    }
+    if (!anyNormals)
+    {
+        normalIndices.clear();
+    }
+
+    auto parsed = std::chrono::steady_clock::now();
+    auto mesh = std::make_unique<TriangleMesh>(std::move(positions), std::move(normals),
+                                               std::move(positionIndices), std::move(normalIndices));
+    auto built = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double, std::milli> parseTime = parsed - start;
+    std::chrono::duration<double, std::milli> buildTime = built - parsed;
+    int numTriangles = mesh->getTriangleCount();
+    std::cout << "Loaded " << filename << ": " << mesh->getVertexCount() << " vertices, "
+              << numTriangles << " triangles in " << parseTime.count() << "ms (BVH "
+              << buildTime.count() << "ms), "
+              << (numTriangles > 0 ? static_cast<double>(mesh->getMemoryUsage()) / numTriangles : 0.0)
+              << " bytes per triangle" << std::endl;
+    return mesh;
+}
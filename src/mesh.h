@@ -0,0 +1,43 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "shape.h"
+#include "bvh.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Indexed triangle mesh with its own BVH over the triangles
+class TriangleMesh : public Shape
+{
+    private:
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> normals;
+        std::vector<uint32_t> positionIndices;  // 3 per triangle
+        std::vector<uint32_t> normalIndices;    // 3 per triangle, noNormal where the face has none
+        BVH bvh;
+
+        bool intersectTriangle(int triangle, const Ray& ray, float tMax, float* t, float* u, float* v) const;
+
+    public:
+        static const uint32_t noNormal = 0xffffffffu;
+
+        TriangleMesh(std::vector<glm::vec3> positions, std::vector<glm::vec3> normals,
+                     std::vector<uint32_t> positionIndices, std::vector<uint32_t> normalIndices);
+
+        bool intersect(const Ray& ray, float tMax, Hit* hit) const override;
+        bool occluded(const Ray& ray, float tMax) const override;
+        AABB getBounds() const override { return bvh.getBounds(); }
+        void hash(Hasher& hasher) const override;
+
+        int getTriangleCount() const { return static_cast<int>(positionIndices.size() / 3); }
+        int getVertexCount() const { return static_cast<int>(positions.size()); }
+        size_t getMemoryUsage() const;
+};
+
+// Streams a Wavefront OBJ file into a TriangleMesh. Only v, vn and f records are
+// used, polygons are fan triangulated. Returns nullptr if the file can't be read.
+std::unique_ptr<TriangleMesh> loadOBJ(const std::string& filename);
+
+#endif
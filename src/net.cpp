@@ -0,0 +1,220 @@
+#include "net.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool parseSocketAddress(const std::string& address, SocketAddress* out)
+{
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        out->local = true;
+        out->path = address.substr(5);
+        if (out->path.empty() || out->path.size() >= sizeof(sockaddr_un::sun_path))
+        {
+            std::cerr << "Invalid socket path in " << address << std::endl;
+            return false;
+        }
+        return true;
+    }
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size())
+    {
+        std::cerr << "Invalid address " << address << ", expected unix:/path or host:port" << std::endl;
+        return false;
+    }
+    out->local = false;
+    out->host = address.substr(0, colon);
+    out->port = address.substr(colon + 1);
+    return true;
+}
+
+bool isLoopback(const SocketAddress& address)
+{
+    if (address.local)
+    {
+        return true;
+    }
+    const std::string& host = address.host;
+    if (host == "localhost")
+    {
+        return true;
+    }
+    in_addr ipv4;
+    if (::inet_pton(AF_INET, host.c_str(), &ipv4) == 1)
+    {
+        return (ntohl(ipv4.s_addr) >> 24) == 127;
+    }
+    in6_addr ipv6;
+    return ::inet_pton(AF_INET6, host.c_str(), &ipv6) == 1 && IN6_IS_ADDR_LOOPBACK(&ipv6);
+}
+
+void enableKeepAlive(int fd)
+{
+    int on = 1;
+    int idle = 10;
+    int interval = 5;
+    int count = 3;
+    if (::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == 0)
+    {
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+}
+
+bool sendAll(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        // a peer that went away must not kill us with SIGPIPE
+        ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        bytes += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void* data, size_t size)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size > 0)
+    {
+        ssize_t received = ::recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+int listenOn(const SocketAddress& address)
+{
+    if (address.local)
+    {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to create socket: " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+        sockaddr_un local = {};
+        local.sun_family = AF_UNIX;
+        std::strncpy(local.sun_path, address.path.c_str(), sizeof(local.sun_path) - 1);
+        // a socket file left behind by an earlier run would make bind fail
+        ::unlink(address.path.c_str());
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 || ::listen(fd, 64) != 0)
+        {
+            std::cerr << "Failed to listen on " << address.path << ": " << std::strerror(errno) << std::endl;
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* results = nullptr;
+    const char* host = address.host.empty() || address.host == "*" ? nullptr : address.host.c_str();
+    int status = ::getaddrinfo(host, address.port.c_str(), &hints, &results);
+    if (status != 0)
+    {
+        std::cerr << "Failed to resolve " << address.host << ":" << address.port << ": " << gai_strerror(status) << std::endl;
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* info = results; info && fd < 0; info = info->ai_next)
+    {
+        fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+        int reuse = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(fd, info->ai_addr, info->ai_addrlen) != 0 || ::listen(fd, 64) != 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(results);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to listen on " << address.host << ":" << address.port << ": " << std::strerror(errno) << std::endl;
+    }
+    return fd;
+}
+
+int connectTo(const SocketAddress& address)
+{
+    if (address.local)
+    {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        sockaddr_un local = {};
+        local.sun_family = AF_UNIX;
+        std::strncpy(local.sun_path, address.path.c_str(), sizeof(local.sun_path) - 1);
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* results = nullptr;
+    if (::getaddrinfo(address.host.c_str(), address.port.c_str(), &hints, &results) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* info = results; info && fd < 0; info = info->ai_next)
+    {
+        fd = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (fd >= 0 && ::connect(fd, info->ai_addr, info->ai_addrlen) != 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(results);
+    if (fd >= 0)
+    {
+        // jobs are small messages that should leave right away
+        int noDelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    return fd;
+}
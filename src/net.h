@@ -0,0 +1,34 @@
+#ifndef NET_H
+#define NET_H
+
+#include <cstddef>
+#include <string>
+
+// Stream socket helpers shared by the distributed renderer and the render
+// server. An address is "unix:/path/to/socket" or "host:port" for TCP, an
+// empty host or "*" listens on every interface.
+struct SocketAddress
+{
+    bool local;
+    std::string path;
+    std::string host;
+    std::string port;
+};
+
+bool parseSocketAddress(const std::string& address, SocketAddress* out);
+// true for Unix sockets and TCP on localhost, 127.0.0.0/8 or ::1, which only
+// this machine can reach
+bool isLoopback(const SocketAddress& address);
+// a listening socket, or -1 after printing why; a stale Unix socket file is replaced
+int listenOn(const SocketAddress& address);
+// a connected socket, or -1 without a message so callers can retry quietly
+int connectTo(const SocketAddress& address);
+// probe an idle TCP peer every few seconds, so a machine that vanished
+// without closing the connection fails the socket within half a minute;
+// Unix sockets need no probes
+void enableKeepAlive(int fd);
+// loop until every byte went through, false once the peer is gone
+bool sendAll(int fd, const void* data, size_t size);
+bool receiveAll(int fd, void* data, size_t size);
+
+#endif
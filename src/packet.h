@@ -0,0 +1,68 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include "ray.h"
+
+// Number of rays traced together in packet mode, laid out as a 4x2 pixel block
+constexpr int PacketSize = 8;
+constexpr int PacketWidth = 4;
+constexpr int PacketHeight = 2;
+constexpr uint32_t FullPacketMask = (1u << PacketSize) - 1;
+
+// Structure of arrays ray packet. Lanes that are not set in activeMask hold
+// stale data and must be ignored by every kernel.
+struct alignas(32) RayPacket
+{
+    float originX[PacketSize];
+    float originY[PacketSize];
+    float originZ[PacketSize];
+    float directionX[PacketSize];
+    float directionY[PacketSize];
+    float directionZ[PacketSize];
+    uint32_t activeMask = 0;
+
+    void setRay(int lane, const Ray& ray)
+    {
+        const glm::vec3& origin = ray.getRayOrigin();
+        const glm::vec3& direction = ray.getRayDirection();
+        originX[lane] = origin.x;
+        originY[lane] = origin.y;
+        originZ[lane] = origin.z;
+        directionX[lane] = direction.x;
+        directionY[lane] = direction.y;
+        directionZ[lane] = direction.z;
+        activeMask |= 1u << lane;
+    }
+
+    glm::vec3 getOrigin(int lane) const { return glm::vec3(originX[lane], originY[lane], originZ[lane]); }
+    glm::vec3 getDirection(int lane) const { return glm::vec3(directionX[lane], directionY[lane], directionZ[lane]); }
+    Ray getRay(int lane) const { return Ray(getOrigin(lane), getDirection(lane)); }
+
+    // true when every active direction lies in the same octant, so the lanes
+    // walk the acceleration structure in the same order
+    bool isCoherent() const
+    {
+        int first = -1;
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if (!(activeMask & (1u << k)))
+            {
+                continue;
+            }
+            if (first < 0)
+            {
+                first = k;
+            }
+            else if ((directionX[k] < 0.0f) != (directionX[first] < 0.0f) ||
+                     (directionY[k] < 0.0f) != (directionY[first] < 0.0f) ||
+                     (directionZ[k] < 0.0f) != (directionZ[first] < 0.0f))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+#endif
@@ -1,26 +1,469 @@
-#include "pathtracer.h"
-#include "glm/glm.hpp"
-
-void PathTracer::render(Film* film, Camera* camera, Scene* scene, float numSamples, int dMax)
-{
-    for(int j = 0; j < film->getHeight(); j++)
-    {
-        for(int i = 0; i < film->getWidth(); i++)
-        {
-            glm::vec3 color(0.0f);
-            for(int s = 0; s < numSamples; s++)
-            {
-                // Sample pixel position
-                glm::vec2 sampledPixel = film->pixelSampler(i, j);
-                
-                // Generate ray for this pixel
-                Ray ray = camera->generateRay(sampledPixel.x, sampledPixel.y);
-            
-                // trace ray and get color
-                color += scene->tracePath(ray, dMax);
-            }                
-            // Set pixel color
-            film->setValue(i, j, color / numSamples);
-        }
-    }
-}
\ No newline at end of file
+#include "pathtracer.h"
+#include "allocation.h"
+#include "checkpoint.h"
+#include "hash.h"
+#include "stats.h"
+#include "glm/glm.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+PathTracer::PathTracer(int numThreads, int tileSize)
+    : threadPool(std::make_unique<ThreadPool>(numThreads)), tileSize(tileSize > 0 ? tileSize : 1), usePackets(false),
+      samplesPerPass(0), adaptiveThreshold(0.0f), checkpointInterval(60.0), timeLimit(0.0), denoise(false) {}
+
+uint64_t PathTracer::settingsKey(const Film* film, const Camera* camera, const Scene* scene, int dMax) const
+{
+    Hasher hasher;
+    hasher.add(film->getWidth());
+    hasher.add(film->getHeight());
+    hasher.add(camera->getHash());
+    hasher.add(scene->getContentHash());
+    hasher.add(dMax);
+    hasher.add(scene->getRouletteDepth());
+    hasher.add(scene->getIntegrator());
+    hasher.add(scene->getLightSampling());
+    hasher.add(scene->getLightSampleCount());
+    return hasher.get();
+}
+
+void PathTracer::setThreadCount(int numThreads)
+{
+    threadPool = std::make_unique<ThreadPool>(numThreads);
+}
+
+void PathTracer::render(Film* film, Camera* camera, Scene* scene, float numSamples, int dMax)
+{
+    if (!scene->isFinalized())
+    {
+        scene->finalize();
+    }
+
+    uint32_t targetSamples = static_cast<uint32_t>(numSamples);
+    Checkpoint checkpoint;
+    bool checkpointing = !checkpointFile.empty()
+        && checkpoint.open(checkpointFile, film->getWidth(), film->getHeight(), settingsKey(film, camera, scene, dMax));
+    if (checkpointing && checkpoint.hasState())
+    {
+        auto resumeStart = std::chrono::steady_clock::now();
+        checkpoint.restore(film);
+        std::chrono::duration<double, std::milli> resumeTime = std::chrono::steady_clock::now() - resumeStart;
+        std::cout << "Resumed from " << checkpointFile << " at " << film->getMinSampleCount()
+                  << " samples per pixel in " << resumeTime.count() << "ms" << std::endl;
+    }
+    else
+    {
+        film->clearAccumulation();
+    }
+
+    if (denoise)
+    {
+        film->enableAOVs();
+    }
+
+    // adaptive renders start with a pass over every pixel, then only go on where the error is high
+    bool adaptive = adaptiveThreshold > 0.0f;
+    const uint32_t adaptivePassSamples = 8;
+    film->clearConvergence();
+    if (adaptive && film->getMinSampleCount() > 0)
+    {
+        film->updateConvergence(adaptiveThreshold);
+    }
+
+    Stats::reset();
+    auto start = std::chrono::steady_clock::now();
+    auto lastCheckpoint = start;
+    uint64_t allocationsBefore = getAllocationCount();
+    uint64_t samplesBefore = film->getTotalSampleCount();
+    uint32_t passSamples = samplesPerPass > 0 ? samplesPerPass : (adaptive ? adaptivePassSamples : targetSamples);
+    // the first pass samples every pixel, which gives the cost of a uniform render
+    double uniformSecondsPerSample = 0.0;
+
+    // every tile covers its own pixels, so the film needs no locking
+    std::vector<Tile> tiles = film->generateTiles(tileSize);
+    for (uint32_t done = film->getMinSampleCount(); done < targetSamples; )
+    {
+        uint32_t passTarget = std::min(done + passSamples, targetSamples);
+        threadPool->parallelFor(static_cast<int>(tiles.size()), [&](int task, int)
+        {
+            renderTask(tiles[task], film, camera, scene, passTarget, dMax);
+        });
+        auto now = std::chrono::steady_clock::now();
+        if (uniformSecondsPerSample == 0.0 && samplesBefore == 0)
+        {
+            std::chrono::duration<double> passTime = now - start;
+            uniformSecondsPerSample = passTime.count() / film->getTotalSampleCount();
+        }
+        int remaining = adaptive ? film->updateConvergence(adaptiveThreshold) : 0;
+        done = film->getMinSampleCount();
+        std::chrono::duration<double> elapsed = now - start;
+        bool outOfTime = timeLimit > 0.0 && elapsed.count() >= timeLimit && done < targetSamples;
+
+        if (samplesPerPass > 0 || adaptive)
+        {
+            std::cout << "Pass done: " << passTarget << "/" << targetSamples << " samples per pixel after "
+                      << elapsed.count() << "s";
+            if (adaptive)
+            {
+                std::cout << ", " << remaining << " pixels above the error threshold";
+            }
+            std::cout << std::endl;
+        }
+        if (progressCallback)
+        {
+            progressCallback(done, targetSamples, elapsed.count());
+        }
+
+        // the final state is always saved, so rerunning a finished render costs nothing
+        std::chrono::duration<double> sinceCheckpoint = now - lastCheckpoint;
+        if (checkpointing && (done >= targetSamples || outOfTime || sinceCheckpoint.count() >= checkpointInterval))
+        {
+            auto saveStart = std::chrono::steady_clock::now();
+            if (checkpoint.save(*film))
+            {
+                std::chrono::duration<double, std::milli> saveTime = std::chrono::steady_clock::now() - saveStart;
+                std::cout << "Checkpoint saved to " << checkpointFile << " in " << saveTime.count() << "ms" << std::endl;
+            }
+            lastCheckpoint = std::chrono::steady_clock::now();
+        }
+        if (outOfTime)
+        {
+            std::cout << "Time limit of " << timeLimit << "s reached at " << done << " samples per pixel" << std::endl;
+            break;
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t allocations = getAllocationCount() - allocationsBefore;
+    double totalSamples = static_cast<double>(film->getTotalSampleCount() - samplesBefore);
+    std::cout << "Rendered " << tiles.size() << " tiles on " << getThreadCount()
+              << " threads in " << elapsed.count() << "s" << std::endl;
+    std::cout << "Heap allocations during render: " << allocations
+              << " (" << allocations / glm::max(totalSamples, 1.0) << " per sample)" << std::endl;
+
+    if (adaptive)
+    {
+        // compare against the uniform sample count that reaches the same estimated error
+        double numPixels = static_cast<double>(film->getWidth()) * film->getHeight();
+        double averageSamples = film->getTotalSampleCount() / numPixels;
+        float error = film->getImageError();
+        double uniformSamples = film->getUniformSamplesForError(error);
+        std::cout << "Adaptive sampling: " << averageSamples << " samples per pixel on average, RMS relative error "
+                  << error << std::endl;
+        std::cout << "Uniform sampling needs " << uniformSamples << " samples per pixel for the same error, adaptive saves "
+                  << 100.0 * (1.0 - averageSamples / uniformSamples) << "% of the samples";
+        if (uniformSecondsPerSample > 0.0)
+        {
+            double uniformTime = uniformSamples * numPixels * uniformSecondsPerSample;
+            std::cout << " and " << 100.0 * (1.0 - elapsed.count() / uniformTime) << "% of the time (~"
+                      << uniformTime << "s uniform)";
+        }
+        std::cout << std::endl;
+    }
+
+    double rmse;
+    double relativeRmse;
+    double displayRmse;
+    if (denoise)
+    {
+        if (!referenceFile.empty() && film->compareToReference(referenceFile, &rmse, &relativeRmse, &displayRmse))
+        {
+            std::cout << "RMSE against " << referenceFile << " before denoising: " << rmse << " ("
+                      << 100.0 * relativeRmse << "% of the mean, " << 100.0 * displayRmse << "% in display range)" << std::endl;
+        }
+        auto denoiseStart = std::chrono::steady_clock::now();
+        if (denoiser.denoise(film, threadPool.get()))
+        {
+            std::chrono::duration<double, std::milli> denoiseTime = std::chrono::steady_clock::now() - denoiseStart;
+            std::cout << "Denoised in " << denoiseTime.count() << "ms" << std::endl;
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    if (!referenceFile.empty() && film->compareToReference(referenceFile, &rmse, &relativeRmse, &displayRmse))
+    {
+        std::cout << "RMSE against " << referenceFile << ": " << rmse << " (" << 100.0 * relativeRmse
+                  << "% of the mean, " << 100.0 * displayRmse << "% in display range) after " << elapsed.count() << "s" << std::endl;
+    }
+
+    if (Stats::enabled)
+    {
+        Stats::report(std::cout);
+        if (!statsFile.empty() && Stats::writeJSON(statsFile))
+        {
+            std::cout << "Statistics written to " << statsFile << std::endl;
+        }
+    }
+}
+
+void PathTracer::renderRegion(Film* film, Camera* camera, Scene* scene, const Tile& region, uint32_t firstSample,
+                              uint32_t lastSample, int dMax)
+{
+    if (!scene->isFinalized())
+    {
+        scene->finalize();
+    }
+
+    // the sample count is also the index of the next sample, so starting from
+    // firstSample gives every pixel the same samples as a render of the whole film
+    PixelAccumulator start = { glm::vec3(0.0f), 0.0f, firstSample };
+    for (int j = region.y0; j < region.y1; j++)
+    {
+        for (int i = region.x0; i < region.x1; i++)
+        {
+            film->setAccumulation(i, j, start);
+        }
+    }
+
+    std::vector<Tile> tiles;
+    for (int y = region.y0; y < region.y1; y += tileSize)
+    {
+        for (int x = region.x0; x < region.x1; x += tileSize)
+        {
+            tiles.push_back({ x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1) });
+        }
+    }
+    threadPool->parallelFor(static_cast<int>(tiles.size()), [&](int task, int)
+    {
+        renderTask(tiles[task], film, camera, scene, lastSample, dMax);
+    });
+
+    for (int j = region.y0; j < region.y1; j++)
+    {
+        for (int i = region.x0; i < region.x1; i++)
+        {
+            PixelAccumulator pixel = film->getAccumulation(i, j);
+            pixel.count -= firstSample;
+            film->setAccumulation(i, j, pixel);
+        }
+    }
+}
+
+void PathTracer::renderTask(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax)
+{
+    PT_STAT_TIMER(workTicks);
+    if (usePackets)
+    {
+        renderTilePackets(tile, film, camera, scene, targetSamples, dMax);
+    }
+    else
+    {
+        renderTile(tile, film, camera, scene, targetSamples, dMax);
+    }
+}
+
+void PathTracer::renderTile(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax)
+{
+    bool recordAOVs = film->hasAOVs();
+    for(int j = tile.y0; j < tile.y1; j++)
+    {
+        for(int i = tile.x0; i < tile.x1; i++)
+        {
+            // continue the running sums, so passes add up to the same value as a single pass
+            PixelAccumulator pixel = film->getAccumulation(i, j);
+            AOVAccumulator features = recordAOVs ? film->getAOV(i, j) : AOVAccumulator{};
+            uint32_t firstSample = pixel.count;
+            uint32_t lastSample = film->isConverged(i, j) ? firstSample : targetSamples;
+            uint64_t pixelIndex = static_cast<uint64_t>(j) * film->getWidth() + i;
+            for(uint32_t s = firstSample; s < lastSample; s++)
+            {
+                // every (pixel, sample) pair gets its own random sequence
+                Sampler sampler(pixelIndex, s);
+
+                // Sample pixel position
+                glm::vec2 sampledPixel = film->pixelSampler(i, j, sampler);
+                
+                // Generate ray for this pixel
+                Ray ray = camera->generateRay(sampledPixel.x, sampledPixel.y);
+                PT_STAT_ADD(StatPrimaryRays, 1);
+            
+                // trace ray and get color
+                Hit hit;
+                bool found = scene->computeIntersection(ray, &hit);
+                if (recordAOVs)
+                {
+                    features.add(found ? &hit : nullptr);
+                }
+                pixel.add(scene->tracePath(ray, found ? &hit : nullptr, dMax, sampler));
+            }                
+            // Set pixel color
+            film->setAccumulation(i, j, pixel);
+            if (recordAOVs)
+            {
+                film->setAOV(i, j, features);
+            }
+        }
+    }
+}
+
+void PathTracer::renderTilePackets(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax)
+{
+    bool recordAOVs = film->hasAOVs();
+    for(int by = tile.y0; by < tile.y1; by += PacketHeight)
+    {
+        for(int bx = tile.x0; bx < tile.x1; bx += PacketWidth)
+        {
+            // one lane per pixel of the block, clipped to the tile
+            int pixelX[PacketSize];
+            int pixelY[PacketSize];
+            uint32_t pixelMask = 0;
+            PixelAccumulator pixels[PacketSize];
+            AOVAccumulator features[PacketSize];
+            uint32_t firstSample[PacketSize];
+            uint32_t lastSample[PacketSize];
+            uint32_t numSamples = 0;
+            for(int k = 0; k < PacketSize; k++)
+            {
+                pixelX[k] = bx + k % PacketWidth;
+                pixelY[k] = by + k / PacketWidth;
+                firstSample[k] = 0;
+                lastSample[k] = 0;
+                if (pixelX[k] < tile.x1 && pixelY[k] < tile.y1)
+                {
+                    pixelMask |= 1u << k;
+                    pixels[k] = film->getAccumulation(pixelX[k], pixelY[k]);
+                    features[k] = recordAOVs ? film->getAOV(pixelX[k], pixelY[k]) : AOVAccumulator{};
+                    firstSample[k] = pixels[k].count;
+                    lastSample[k] = film->isConverged(pixelX[k], pixelY[k]) ? firstSample[k] : targetSamples;
+                    if (firstSample[k] < lastSample[k])
+                    {
+                        numSamples = glm::max(numSamples, lastSample[k] - firstSample[k]);
+                    }
+                }
+            }
+
+            for(uint32_t s = 0; s < numSamples; s++)
+            {
+                // pixels that already hold more samples drop out early
+                uint32_t laneMask = 0;
+                Sampler samplers[PacketSize];
+                glm::vec2 samples[PacketSize];
+                for(int k = 0; k < PacketSize; k++)
+                {
+                    samples[k] = glm::vec2(0.5f, 0.5f);
+                    if ((pixelMask & (1u << k)) && firstSample[k] + s < lastSample[k])
+                    {
+                        laneMask |= 1u << k;
+                        uint64_t pixelIndex = static_cast<uint64_t>(pixelY[k]) * film->getWidth() + pixelX[k];
+                        samplers[k] = Sampler(pixelIndex, firstSample[k] + s);
+                        samples[k] = film->pixelSampler(pixelX[k], pixelY[k], samplers[k]);
+                    }
+                }
+
+                RayPacket packet;
+                camera->generatePacket(samples, laneMask, &packet);
+                PT_STAT_ADD(StatPrimaryRays, __builtin_popcount(laneMask));
+
+                Hit hits[PacketSize];
+                uint32_t hitMask = scene->intersectPacket(packet, hits);
+
+                // the rest of each path is traced on its own
+                for(int k = 0; k < PacketSize; k++)
+                {
+                    if (laneMask & (1u << k))
+                    {
+                        Ray ray = packet.getRay(k);
+                        const Hit* hit = (hitMask & (1u << k)) ? &hits[k] : nullptr;
+                        if (recordAOVs)
+                        {
+                            features[k].add(hit);
+                        }
+                        pixels[k].add(scene->tracePath(ray, hit, dMax, samplers[k]));
+                    }
+                }
+            }
+
+            for(int k = 0; k < PacketSize; k++)
+            {
+                if (pixelMask & (1u << k))
+                {
+                    film->setAccumulation(pixelX[k], pixelY[k], pixels[k]);
+                    if (recordAOVs)
+                    {
+                        film->setAOV(pixelX[k], pixelY[k], features[k]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+uint64_t PathTracer::castPrimaryRays(const Tile& tile, Film* film, Camera* camera, Scene* scene, int numSamples, bool packets)
+{
+    uint64_t hitCount = 0;
+    for(int by = tile.y0; by < tile.y1; by += PacketHeight)
+    {
+        for(int bx = tile.x0; bx < tile.x1; bx += PacketWidth)
+        {
+            for(int s = 0; s < numSamples; s++)
+            {
+                glm::vec2 samples[PacketSize];
+                uint32_t laneMask = 0;
+                for(int k = 0; k < PacketSize; k++)
+                {
+                    int x = bx + k % PacketWidth;
+                    int y = by + k / PacketWidth;
+                    samples[k] = glm::vec2(0.5f, 0.5f);
+                    if (x < tile.x1 && y < tile.y1)
+                    {
+                        Sampler sampler(static_cast<uint64_t>(y) * film->getWidth() + x, s);
+                        samples[k] = film->pixelSampler(x, y, sampler);
+                        laneMask |= 1u << k;
+                    }
+                }
+
+                Hit hits[PacketSize];
+                if (packets)
+                {
+                    RayPacket packet;
+                    camera->generatePacket(samples, laneMask, &packet);
+                    uint32_t hitMask = scene->intersectPacket(packet, hits);
+                    for(int k = 0; k < PacketSize; k++)
+                    {
+                        hitCount += (hitMask >> k) & 1u;
+                    }
+                }
+                else
+                {
+                    for(int k = 0; k < PacketSize; k++)
+                    {
+                        if (laneMask & (1u << k))
+                        {
+                            Ray ray = camera->generateRay(samples[k].x, samples[k].y);
+                            hitCount += scene->computeIntersection(ray, &hits[k]) ? 1 : 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return hitCount;
+}
+
+void PathTracer::measurePrimaryRays(Film* film, Camera* camera, Scene* scene, int numSamples)
+{
+    if (!scene->isFinalized())
+    {
+        scene->finalize();
+    }
+
+    std::vector<Tile> tiles = film->generateTiles(tileSize);
+    double numRays = static_cast<double>(film->getWidth()) * film->getHeight() * numSamples;
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        bool packets = mode == 1;
+        std::atomic<uint64_t> hitCount(0);
+
+        auto start = std::chrono::steady_clock::now();
+        threadPool->parallelFor(static_cast<int>(tiles.size()), [&](int task, int)
+        {
+            hitCount += castPrimaryRays(tiles[task], film, camera, scene, numSamples, packets);
+        });
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << "Primary rays (" << (packets ? "packets" : "single") << "): "
+                  << numRays / elapsed.count() * 1e-6 << " Mrays/s, "
+                  << hitCount.load() << " hits" << std::endl;
+    }
+}
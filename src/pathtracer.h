@@ -1,14 +1,84 @@
-#ifndef PATHTRACER_H
-#define PATHTRACER_H
-
-#include "scene.h"
-#include "camera.h"
-#include "film.h"
-
-class PathTracer
-{
-    public:
-        PathTracer() {};
-        void render(Film* Film, Camera* camera, Scene* scene, float numSamples, int dMax);
-};
-#endif
+#ifndef PATHTRACER_H
+#define PATHTRACER_H
+
+#include "scene.h"
+#include "camera.h"
+#include "film.h"
+#include "threadpool.h"
+#include "denoiser.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+class PathTracer
+{
+    private:
+        std::unique_ptr<ThreadPool> threadPool;
+        int tileSize;
+        bool usePackets;
+        uint32_t samplesPerPass;
+        float adaptiveThreshold;
+        std::string checkpointFile;
+        double checkpointInterval;
+        std::string statsFile;
+        double timeLimit;
+        std::string referenceFile;
+        bool denoise;
+        Denoiser denoiser;
+        std::function<void(uint32_t samples, uint32_t target, double seconds)> progressCallback;
+
+        // pixels take samples from their current count up to targetSamples
+        void renderTile(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax);
+        void renderTilePackets(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax);
+        // renders one tile with the packet or scalar path as configured
+        void renderTask(const Tile& tile, Film* film, Camera* camera, Scene* scene, uint32_t targetSamples, int dMax);
+        uint64_t castPrimaryRays(const Tile& tile, Film* film, Camera* camera, Scene* scene, int numSamples, bool packets);
+
+    public:
+        // numThreads <= 0 uses every hardware thread
+        PathTracer(int numThreads = 0, int tileSize = 16);
+        void setThreadCount(int numThreads);
+        int getThreadCount() const { return threadPool->getThreadCount(); }
+        ThreadPool* getThreadPool() const { return threadPool.get(); }
+        void setTileSize(int size) { tileSize = size > 0 ? size : 1; }
+        // trace primary rays as SIMD packets of 4x2 pixels
+        void setPacketMode(bool enabled) { usePackets = enabled; }
+        // render in passes of this many samples per pixel, 0 renders everything in one pass
+        void setProgressive(uint32_t samples) { samplesPerPass = samples; }
+        // stop sampling pixels once their relative error is below threshold, 0 samples every pixel fully
+        void setAdaptive(float threshold) { adaptiveThreshold = threshold; }
+        // resume from and periodically save the accumulation state to this file
+        void setCheckpoint(const std::string& filename, double intervalSeconds)
+        {
+            checkpointFile = filename;
+            checkpointInterval = intervalSeconds;
+        }
+        // write the render statistics to this JSON file, needs a build with make STATS=1
+        void setStatsFile(const std::string& filename) { statsFile = filename; }
+        // stop after the first pass that ends past this many seconds, 0 for no limit;
+        // use with setProgressive so there is more than one pass
+        void setTimeLimit(double seconds) { timeLimit = seconds; }
+        // report the error of the finished image against this PFM
+        void setReference(const std::string& filename) { referenceFile = filename; }
+        // record AOVs while rendering and denoise the image once it is done
+        void setDenoise(bool enabled) { denoise = enabled; }
+        // called after every pass with the samples per pixel done so far and the seconds since the start
+        void setProgressCallback(std::function<void(uint32_t samples, uint32_t target, double seconds)> callback)
+        {
+            progressCallback = std::move(callback);
+        }
+        // renders until every pixel holds numSamples samples or has converged, resuming from the checkpoint if one is set
+        void render(Film* Film, Camera* camera, Scene* scene, float numSamples, int dMax);
+        // renders samples [firstSample, lastSample) of the pixels in region and leaves just
+        // those samples in their accumulators, the rest of the film is untouched
+        void renderRegion(Film* film, Camera* camera, Scene* scene, const Tile& region, uint32_t firstSample,
+                          uint32_t lastSample, int dMax);
+        // samples only add up when rendered of the same scene from the same camera
+        // with the same settings, e.g. path depth; checkpoints and distributed
+        // renders compare this key
+        uint64_t settingsKey(const Film* film, const Camera* camera, const Scene* scene, int dMax) const;
+        // prints primary ray throughput with and without packets
+        void measurePrimaryRays(Film* film, Camera* camera, Scene* scene, int numSamples);
+};
+#endif
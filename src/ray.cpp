@@ -1,5 +1,5 @@
-#include "ray.h"
-#include <glm/glm.hpp>
-
-Ray::Ray(const glm::vec3& origin, const glm::vec3& direction)
+#include "ray.h"
+#include <glm/glm.hpp>
+
+Ray::Ray(const glm::vec3& origin, const glm::vec3& direction)
     : origin(origin), direction(glm::normalize(direction)) {}
\ No newline at end of file
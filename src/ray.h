@@ -1,16 +1,26 @@
-#ifndef RAY_H
-#define RAY_H
-
-#include <glm/glm.hpp>
-
-class Ray
-{   
-    private:
-        glm::vec3 direction;
-        glm::vec3 origin;
-    public:
-        Ray(const glm::vec3& origin, const glm::vec3& direction);
-        const glm::vec3& getRayDirection() const { return direction; }
-        const glm::vec3& getRayOrigin() const { return origin; }
-};
+#ifndef RAY_H
+#define RAY_H
+
+#include <glm/glm.hpp>
+
+class Ray
+{   
+    private:
+        glm::vec3 direction;
+        glm::vec3 origin;
+
+        Ray() = default;
+    public:
+        Ray(const glm::vec3& origin, const glm::vec3& direction);
+        // keeps the direction as it is, t then counts multiples of its length
+        static Ray unnormalized(const glm::vec3& origin, const glm::vec3& direction)
+        {
+            Ray ray;
+            ray.origin = origin;
+            ray.direction = direction;
+            return ray;
+        }
+        const glm::vec3& getRayDirection() const { return direction; }
+        const glm::vec3& getRayOrigin() const { return origin; }
+};
 #endif
\ No newline at end of file
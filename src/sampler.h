@@ -0,0 +1,90 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// PCG32 random number generator carrying the sampling state of one path.
+// A sampler seeded with (pixel, sample) always produces the same sequence, so
+// renders do not depend on thread count or tile order.
+class Sampler
+{
+    private:
+        uint64_t state;
+        uint64_t increment;
+
+        static uint64_t mixBits(uint64_t v)
+        {
+            // splitmix64 finalizer
+            v ^= v >> 30;
+            v *= 0xbf58476d1ce4e5b9ULL;
+            v ^= v >> 27;
+            v *= 0x94d049bb133111ebULL;
+            v ^= v >> 31;
+            return v;
+        }
+
+    public:
+        Sampler() : Sampler(0, 0) {}
+
+        Sampler(uint64_t pixelIndex, uint64_t sampleIndex, uint64_t seed = 0)
+            : state(0), increment((mixBits(pixelIndex ^ seed) << 1) | 1u)
+        {
+            nextUInt();
+            state += mixBits(sampleIndex + 0x9e3779b97f4a7c15ULL * (seed + 1));
+            nextUInt();
+        }
+
+        uint32_t nextUInt()
+        {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + increment;
+            uint32_t xorShifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+            uint32_t rot = static_cast<uint32_t>(old >> 59u);
+            return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+        }
+
+        // uniform float in [0, 1)
+        float next1D()
+        {
+            return static_cast<float>(nextUInt() >> 8) * (1.0f / 16777216.0f);
+        }
+
+        glm::vec2 next2D()
+        {
+            float x = next1D();
+            float y = next1D();
+            return glm::vec2(x, y);
+        }
+};
+
+// Jittered grid over the unit square for count samples, sample(index) lies in
+// cell index. The grid has as many rows as the largest divisor of count up to
+// its square root, so every cell is used exactly once.
+class StratifiedGrid
+{
+    private:
+        int columns;
+        int rows;
+
+    public:
+        explicit StratifiedGrid(int count)
+            : columns(count), rows(1)
+        {
+            for (int r = 2; r * r <= count; r++)
+            {
+                if (count % r == 0)
+                {
+                    rows = r;
+                }
+            }
+            columns = count / rows;
+        }
+
+        glm::vec2 sample(int index, Sampler& sampler) const
+        {
+            glm::vec2 u = sampler.next2D();
+            return glm::vec2((index % columns + u.x) / columns, (index / columns + u.y) / rows);
+        }
+};
+#endif
@@ -1,148 +1,505 @@
-#include "scene.h"
-#include "hit.h"
-#include "light.h"
-
-
-#define EPSILON 1e-4f
-
-std::unique_ptr<Hit> Scene::computeIntersection(const Ray& ray) const
-{
-    std::unique_ptr<Hit> closestHit = nullptr;
-    float min_t = std::numeric_limits<float>::infinity();
-
-    for (const auto& instance : sceneObjects)
-    {
-        auto currentHit = instance->computeIntersection(ray);
-        if (currentHit && currentHit->t < min_t)
-        {
-            min_t = currentHit->t;
-            closestHit = std::move(currentHit);
-        }
-    }
-    return closestHit;
-}
-
-const glm::vec3 Scene::HemisphereToGlobal(glm::vec3 p, glm::vec3 n, glm::vec3 wih) const
-{
-    glm::vec3 t = glm::vec3(1.0f, 0.0f, 0.0f);
-
-    if(glm::dot(t, n) > 0.9f)
-    {
-        t = glm::vec3(0.0f, 1.0f, 0.0f);
-    }
-
-    glm::vec3 b = glm::normalize(glm::cross(n, t));
-    t = glm::cross(b, n);
-
-    glm::mat3 M = glm::mat3(t, b, n);
-
-    return glm::normalize(M * wih);
-}
-
-Light* Scene::SampleLight(float* lpdf) const
-{   
-    if (lightInstances.empty()) {
-        *lpdf = 0.0f;
-        return nullptr;
-    }
-    
-    // calculate total power of all lights
-    float totalPower = 0.0f;
-    std::vector<float> lightPowers;
-    
-    for (const auto& instance : lightInstances) {
-        Light* light = instance->getLight();
-        glm::vec3 power = light->getPower();
-        float lightPower = power.x + power.y + power.z;
-        lightPowers.push_back(lightPower);
-        totalPower += lightPower;
-    }
-    
-    if (totalPower == 0.0f) {
-        *lpdf = 0.0f;
-        return nullptr;
-    }
-    
-    // sample based on power distribution
-    float randomValue = static_cast<float>(rand()) / static_cast<float>(RAND_MAX) * totalPower;
-    float cumulativePower = 0.0f;
-    
-    for (size_t i = 0; i < lightInstances.size(); ++i) {
-        cumulativePower += lightPowers[i];
-        if (randomValue <= cumulativePower) {
-            // set lpdf = Pi / ∑Pj (power of selected light / total power)
-            *lpdf = lightPowers[i] / totalPower;
-            return lightInstances[i]->getLight();
-        }
-    }
-    
-    // fallback
-    return nullptr;
-}
-
-const glm::vec3 Scene::GetLightRadiance(const glm::vec3 p, const glm::vec3 n) const 
-{   float lpdf = 0.0f;
-    float pdf = 0.0f;
-    glm::vec3 ns;
-    Light* light = this->SampleLight(&lpdf);
-    glm::vec3 s = light->getSample(&pdf, ns);
-
-    glm::vec3 dif = s - p;
-    float distance = glm::length(dif);
-    glm::vec3 wi = dif / distance;
-
-    Ray ray = Ray(p + EPSILON * n, wi);
-    auto hit = this->computeIntersection(ray);
-    if (!hit || !hit->isLight())
-    {
-        return glm::vec3(0.0f, 0.0f, 0.0f);
-    }
-    else
-    {
-        float d = distance * distance;
-        auto I = light->GetIrradiance();
-        return (I * glm::max(0.0f, glm::dot(n, wi)) * glm::max(0.0f, glm::dot(ns, -wi))) / (d * lpdf * pdf);
-    }
-}
-
-const glm::vec3 Scene::tracePath(Ray& ray, const int dMax) const
-{
-    glm::vec3 L = glm::vec3(0.0f, 0.0f, 0.0f);
-    glm::vec3 beta = glm::vec3(1.0f, 1.0f, 1.0f);
-
-    for (int i = 0; i < dMax; i++)
-    {
-        auto hit = computeIntersection(ray);
-        if (!hit) 
-        {
-            break;
-        }
-
-        if (hit->isLight()) 
-        {
-            if (i == 0)
-            {
-                const Light* light = hit->getLight();
-                L += beta * light->GetIrradiance();
-            }
-            break;
-        } 
-        else 
-        {
-            glm::vec3 p = hit->position;
-            glm::vec3 n = hit->normal;
-
-            glm::vec3 Le = this->GetLightRadiance(p, n);
-            L += Le * hit->getMaterial()->GetBRDF() * beta;
-
-            float pdf;
-            glm::vec3 wih = hit->getMaterial()->GetSample(&pdf);
-            glm::vec3 wi = this->HemisphereToGlobal(p, n, wih);
-            
-            beta *= hit->getMaterial()->GetBRDF() * glm::max(0.0f, glm::dot(n, wi)) / pdf;
-            ray = Ray(p + EPSILON * n, wi);
-        }
-    }
-
-    return L;
-}
+#include "scene.h"
+#include "hit.h"
+#include "light.h"
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+
+#define EPSILON 1e-4f
+
+void Scene::finalize()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<AABB> instanceBounds;
+    instanceBounds.reserve(sceneObjects.size());
+    for (const auto& instance : sceneObjects)
+    {
+        instanceBounds.push_back(instance->getWorldBounds());
+    }
+    bvh.build(instanceBounds);
+    buildLightDistribution();
+    finalized = true;
+    if (useCompiled)
+    {
+        compiled.build(sceneObjects, bvh, simdLevel);
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "BVH built over " << sceneObjects.size() << " instances: " << bvh.getNodeCount()
+              << " nodes in " << elapsed.count() << "ms" << std::endl;
+}
+
+void Scene::setCompiled(bool enabled)
+{
+    useCompiled = enabled;
+    if (!enabled)
+    {
+        compiled.clear();
+        return;
+    }
+    if (finalized)
+    {
+        auto start = std::chrono::steady_clock::now();
+        compiled.build(sceneObjects, bvh, simdLevel);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Compiled scene: " << compiled.getCount(CompiledScene::PrimitiveType::Sphere) << " spheres, "
+                  << compiled.getCount(CompiledScene::PrimitiveType::Box) << " boxes, "
+                  << compiled.getCount(CompiledScene::PrimitiveType::Instance) << " other instances, "
+                  << getSimdLevelName(compiled.getSimdLevel()) << " kernels, in " << elapsed.count() << "ms" << std::endl;
+    }
+}
+
+uint64_t Scene::getContentHash() const
+{
+    Hasher hasher;
+    hasher.add(ambientLight);
+    for (const auto& instance : sceneObjects)
+    {
+        instance->hash(hasher);
+    }
+    return hasher.get();
+}
+
+bool Scene::computeIntersection(const Ray& ray, Hit* hit) const
+{
+    PT_STAT_SAMPLED_TIMER(intersectTicks);
+    float min_t = std::numeric_limits<float>::infinity();
+
+    // instances only overwrite the hit when they are closer than min_t
+    if (finalized && useCompiled)
+    {
+        return compiled.intersect(ray, hit);
+    }
+    if (finalized)
+    {
+        return bvh.traverse(ray, min_t, [&](int index, float& tMax)
+        {
+            if (sceneObjects[index]->computeIntersection(ray, tMax, hit))
+            {
+                tMax = hit->t;
+                return true;
+            }
+            return false;
+        });
+    }
+
+    bool hitAnything = false;
+    for (const auto& instance : sceneObjects)
+    {
+        if (instance->computeIntersection(ray, min_t, hit))
+        {
+            min_t = hit->t;
+            hitAnything = true;
+        }
+    }
+    return hitAnything;
+}
+
+uint32_t Scene::intersectPacket(const RayPacket& packet, Hit* hits) const
+{
+    uint32_t hitMask = 0;
+
+    // lanes heading into different octants would split up at every node, trace them one by one
+    if (!finalized || !packet.isCoherent())
+    {
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if ((packet.activeMask & (1u << k)) && computeIntersection(packet.getRay(k), &hits[k]))
+            {
+                hitMask |= 1u << k;
+            }
+        }
+        return hitMask;
+    }
+
+    PT_STAT_SAMPLED_TIMER(intersectTicks);
+    float tMax[PacketSize];
+    for (int k = 0; k < PacketSize; k++)
+    {
+        tMax[k] = std::numeric_limits<float>::infinity();
+    }
+
+    if (useCompiled)
+    {
+        return compiled.intersectPacket(packet, tMax, hits);
+    }
+    const WideKernels& kernels = getWideKernels(simdLevel);
+    bvh.traversePacket(packet, tMax, kernels, [&](int index, uint32_t laneMask)
+    {
+        hitMask |= sceneObjects[index]->computeIntersectionPacket(packet, laneMask, tMax, hits, kernels);
+    });
+    return hitMask;
+}
+
+uint32_t Scene::occludedPacket(const RayPacket& packet, const float* tMax, const Light* source) const
+{
+    uint32_t blocked = 0;
+    if (!finalized)
+    {
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if ((packet.activeMask & (1u << k)) && occluded(packet.getOrigin(k), packet.getDirection(k), tMax[k], source))
+            {
+                blocked |= 1u << k;
+            }
+        }
+        return blocked;
+    }
+
+    PT_STAT_SAMPLED_TIMER(intersectTicks);
+    PT_STAT_ADD(StatShadowRays, __builtin_popcount(packet.activeMask));
+    if (useCompiled)
+    {
+        blocked = compiled.occludedPacket(packet, tMax, source);
+    }
+    else
+    {
+        const WideKernels& kernels = getWideKernels(simdLevel);
+        blocked = bvh.traverseAnyPacket(packet, tMax, kernels, [&](int index, uint32_t laneMask)
+        {
+            // the emitter of the sampled light does not shadow itself, like in occluded()
+            const Instance& instance = *sceneObjects[index];
+            return source && instance.getLight() == source ? 0u : instance.occludedPacket(packet, laneMask, tMax, kernels);
+        });
+    }
+    PT_STAT_ADD(StatShadowRaysOccluded, __builtin_popcount(blocked));
+    return blocked;
+}
+
+bool Scene::occluded(const glm::vec3& origin, const glm::vec3& direction, float tMax, const Light* source) const
+{
+    PT_STAT_SAMPLED_TIMER(intersectTicks);
+    PT_STAT_ADD(StatShadowRays, 1);
+    Ray ray(origin, direction);
+
+    // the emitter a light sample lies on does not shadow it, other emitters do
+    auto occludedBy = [&](const Instance& instance)
+    {
+        return !(source && instance.getLight() == source) && instance.occluded(ray, tMax);
+    };
+
+    if (finalized)
+    {
+        bool blocked = useCompiled ? compiled.occluded(ray, tMax, source) : bvh.traverseAny(ray, tMax, [&](int index)
+        {
+            return occludedBy(*sceneObjects[index]);
+        });
+        PT_STAT_ADD(StatShadowRaysOccluded, blocked ? 1 : 0);
+        return blocked;
+    }
+
+    for (const auto& instance : sceneObjects)
+    {
+        if (occludedBy(*instance))
+        {
+            PT_STAT_ADD(StatShadowRaysOccluded, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace
+{
+    // tangent, bitangent and normal as the columns of a rotation
+    glm::mat3 hemisphereBasis(const glm::vec3& n)
+    {
+        glm::vec3 t = glm::vec3(1.0f, 0.0f, 0.0f);
+
+        if(glm::dot(t, n) > 0.9f)
+        {
+            t = glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+
+        glm::vec3 b = glm::normalize(glm::cross(n, t));
+        t = glm::cross(b, n);
+
+        return glm::mat3(t, b, n);
+    }
+}
+
+const glm::vec3 Scene::HemisphereToGlobal(glm::vec3 p, glm::vec3 n, glm::vec3 wih) const
+{
+    glm::mat3 M = hemisphereBasis(n);
+
+    return glm::normalize(M * wih);
+}
+
+const glm::vec3 Scene::GlobalToHemisphere(glm::vec3 n, glm::vec3 wi) const
+{
+    return glm::transpose(hemisphereBasis(n)) * wi;
+}
+
+void Scene::buildLightDistribution()
+{
+    std::vector<float> powers;
+    powers.reserve(lightInstances.size());
+    sampledLights.clear();
+    lightPdfs.clear();
+    for (const Instance* instance : lightInstances)
+    {
+        // instances sharing a light emit once, so the light gets one entry
+        Light* light = instance->getLight();
+        if (!lightPdfs.emplace(light, 0.0f).second)
+        {
+            continue;
+        }
+        glm::vec3 power = light->getPower();
+        powers.push_back(power.x + power.y + power.z);
+        sampledLights.push_back(light);
+    }
+    lightDistribution.build(powers);
+
+    for (int i = 0; i < lightDistribution.size(); i++)
+    {
+        lightPdfs[sampledLights[i]] = lightDistribution.pdf(i);
+    }
+    lightBVH.build(sampledLights);
+}
+
+Light* Scene::SampleLight(Sampler& sampler, float* lpdf) const
+{
+    if (lightDistribution.empty())
+    {
+        *lpdf = 0.0f;
+        return nullptr;
+    }
+
+    int index = lightDistribution.sample(sampler.next1D(), lpdf);
+    return sampledLights[index];
+}
+
+float Scene::getLightPdf(const Light* light) const
+{
+    auto it = lightPdfs.find(light);
+    return it != lightPdfs.end() ? it->second : 0.0f;
+}
+
+Light* Scene::SampleLight(const glm::vec3& p, const glm::vec3& n, Sampler& sampler, float* lpdf) const
+{
+    if (lightSampling == LightSampling::Power)
+    {
+        return SampleLight(sampler, lpdf);
+    }
+    if (lightBVH.empty())
+    {
+        *lpdf = 0.0f;
+        return nullptr;
+    }
+    return lightBVH.sample(p, n, sampler.next1D(), lpdf);
+}
+
+float Scene::getLightPdf(const glm::vec3& p, const glm::vec3& n, const Light* light) const
+{
+    return lightSampling == LightSampling::Power ? getLightPdf(light) : lightBVH.pmf(p, n, light);
+}
+
+float Scene::getEmissionWeight(const glm::vec3& p, const glm::vec3& n, const glm::vec3& wi, const Light* light, float materialPdf) const
+{
+    float directionPdf = lightPdf(*light, p, wi);
+    if (directionPdf == 0.0f)
+    {
+        return 0.0f;
+    }
+    // light samples come getLightSampleCount at a time
+    return powerHeuristic(materialPdf, getLightSampleCount(light) * getLightPdf(p, n, light) * directionPdf);
+}
+
+bool Scene::SampleLightRay(const glm::vec3 p, const glm::vec3 n, Sampler& sampler, LightSample* sample) const
+{
+    float lpdf = 0.0f;
+    Light* light = this->SampleLight(p, n, sampler, &lpdf);
+    if (!light)
+    {
+        return false;
+    }
+    SampleLightRay(p, n, *light, lpdf, sampler.next2D(), sample);
+    return true;
+}
+
+void Scene::SampleLightRay(const glm::vec3 p, const glm::vec3 n, const Light& light, float lpdf, const glm::vec2& u, LightSample* sample) const
+{
+    float pdf = 0.0f;
+    glm::vec3 ns;
+    glm::vec3 s = sampleLight(light, u, &pdf, ns);
+
+    glm::vec3 dif = s - p;
+    float distance = glm::length(dif);
+    glm::vec3 wi = dif / distance;
+
+    float d = distance * distance;
+    auto I = lightRadiance(light);
+    sample->origin = p + EPSILON * n;
+    sample->direction = wi;
+    sample->tMax = distance - EPSILON;
+    sample->radiance = (I * glm::max(0.0f, glm::dot(n, wi)) * glm::max(0.0f, glm::dot(ns, -wi))) / (d * lpdf * pdf);
+    float cosLight = glm::dot(ns, -wi);
+    sample->pdf = cosLight > 0.0f ? lpdf * pdf * d / cosLight : 0.0f;
+}
+
+const glm::vec3 Scene::GetLightRadiance(const glm::vec3 p, const glm::vec3 n, Sampler& sampler, const Material* misMaterial) const 
+{
+    float lpdf = 0.0f;
+    Light* light = this->SampleLight(p, n, sampler, &lpdf);
+    if (!light)
+    {
+        return glm::vec3(0.0f, 0.0f, 0.0f);
+    }
+
+    int count = getLightSampleCount(light);
+    StratifiedGrid grid(count);
+    glm::vec3 L = glm::vec3(0.0f, 0.0f, 0.0f);
+    for (int first = 0; first < count; first += PacketSize)
+    {
+        int lanes = std::min(PacketSize, count - first);
+        RayPacket packet;
+        float tMax[PacketSize];
+        glm::vec3 radiance[PacketSize];
+        for (int k = 0; k < lanes; k++)
+        {
+            LightSample sample;
+            SampleLightRay(p, n, *light, lpdf, grid.sample(first + k, sampler), &sample);
+            // samples facing away from p or the light carry nothing, so there is nothing to trace
+            if (sample.radiance == glm::vec3(0.0f))
+            {
+                continue;
+            }
+            radiance[k] = sample.radiance;
+            if (misMaterial)
+            {
+                float materialDensity = materialPdf(*misMaterial, GlobalToHemisphere(n, sample.direction));
+                radiance[k] *= powerHeuristic(count * sample.pdf, materialDensity);
+            }
+            packet.setRay(k, Ray::unnormalized(sample.origin, sample.direction));
+            tMax[k] = sample.tMax;
+        }
+
+        // a lone shadow ray is cheaper through the single ray traversal
+        uint32_t blocked;
+        if (lanes == 1)
+        {
+            blocked = packet.activeMask && this->occluded(packet.getOrigin(0), packet.getDirection(0), tMax[0], light) ? 1u : 0u;
+        }
+        else
+        {
+            blocked = occludedPacket(packet, tMax, light);
+        }
+        for (int k = 0; k < lanes; k++)
+        {
+            if (packet.activeMask & ~blocked & (1u << k))
+            {
+                L += radiance[k];
+            }
+        }
+    }
+    return L / static_cast<float>(count);
+}
+
+const glm::vec3 Scene::tracePath(Ray& ray, const int dMax, Sampler& sampler) const
+{
+    Hit hit;
+    bool found = computeIntersection(ray, &hit);
+    return tracePath(ray, found ? &hit : nullptr, dMax, sampler);
+}
+
+const glm::vec3 Scene::tracePath(Ray& ray, const Hit* primaryHit, const int dMax, Sampler& sampler) const
+{
+    glm::vec3 L = glm::vec3(0.0f, 0.0f, 0.0f);
+    glm::vec3 beta = glm::vec3(1.0f, 1.0f, 1.0f);
+
+    PT_STAT_ADD(StatPaths, 1);
+    if (!primaryHit)
+    {
+        PT_STAT_DEPTH(0, 1);
+        return L;
+    }
+
+    Hit hit = *primaryHit;
+    // surfaces hit so far
+    int depth = 1;
+    bool mis = integrator == PathIntegrator::MIS;
+    // the previous surface and the density of the bounce leaving it, for MIS
+    glm::vec3 previousPosition;
+    glm::vec3 previousNormal;
+    float bouncePdf = 0.0f;
+    for (int i = 0; i < dMax; i++)
+    {
+        if (i > 0)
+        {
+            PT_STAT_ADD(StatBounceRays, 1);
+            if (!computeIntersection(ray, &hit))
+            {
+                break;
+            }
+            depth++;
+        }
+
+        if (hit.isLight()) 
+        {
+            const Light* light = hit.getLight();
+            if (i == 0)
+            {
+                L += beta * lightRadiance(*light);
+            }
+            else if (mis)
+            {
+                float weight = getEmissionWeight(previousPosition, previousNormal, ray.getRayDirection(), light, bouncePdf);
+                L += beta * lightRadiance(*light) * weight;
+            }
+            break;
+        } 
+        else 
+        {
+            glm::vec3 p = hit.position;
+            glm::vec3 n = hit.normal;
+            const Material& material = *hit.getMaterial();
+
+            glm::vec3 Le = this->GetLightRadiance(p, n, sampler, mis ? &material : nullptr);
+            L += Le * materialBRDF(material) * beta;
+
+            float pdf;
+            glm::vec3 wih = sampleMaterial(material, sampler, &pdf);
+            glm::vec3 wi = this->HemisphereToGlobal(p, n, wih);
+            
+            beta *= materialBRDF(material) * glm::max(0.0f, glm::dot(n, wi)) / pdf;
+            ray = Ray(p + EPSILON * n, wi);
+            previousPosition = p;
+            previousNormal = n;
+            bouncePdf = pdf;
+            if (i + 1 < dMax && !continuePath(depth, beta, sampler))
+            {
+                break;
+            }
+        }
+    }
+
+    PT_STAT_ADD(StatPathVertices, depth);
+    PT_STAT_DEPTH(depth, 1);
+    return L;
+}
+
+bool Scene::continuePath(int depth, glm::vec3& beta, Sampler& sampler) const
+{
+    if (rouletteDepth < 0 || depth < rouletteDepth)
+    {
+        return true;
+    }
+
+    // survive in proportion to the throughput, paths that still carry a lot
+    // of it always go on
+    float survival = std::max(beta.x, std::max(beta.y, beta.z));
+    if (survival >= 1.0f)
+    {
+        return true;
+    }
+    if (sampler.next1D() >= survival)
+    {
+        PT_STAT_ADD(StatRouletteTerminations, 1);
+        return false;
+    }
+    beta /= survival;
+    return true;
+}
@@ -1,48 +1,209 @@
-#ifndef SCENE_H
-#define SCENE_H
-
-#include "ray.h"
-#include "hit.h"
-#include "light.h"
-#include "instance.h"
-#include <memory>
-#include <vector>
-
-class Scene
-{
-    private:
-        std::vector<std::unique_ptr<Instance>> sceneObjects;
-        std::vector<Instance*> lightInstances;
-        glm::vec3 ambientLight;
-    public:
-        Scene() = default;
-        ~Scene() = default;
-
-        // Prevent copying
-        Scene(const Scene&) = delete;
-        Scene& operator=(const Scene&) = delete;
-
-        // Allow moving
-        Scene(Scene&&) = default;
-        Scene& operator=(Scene&&) = default;
-
-        Light* SampleLight(float* lpdf) const;
-        std::unique_ptr<Hit> computeIntersection(const Ray& ray) const;
-        const glm::vec3 tracePath(Ray& ray, const int dMax) const;
-
-        void addObject(std::unique_ptr<Instance> sceneObject) 
-        {
-            if (sceneObject->isLight()) 
-            {
-                lightInstances.push_back(sceneObject.get());
-            }
-            sceneObjects.push_back(std::move(sceneObject));
-        }
-
-        const std::vector<std::unique_ptr<Instance>>& getObjects() const { return sceneObjects; }
-        const glm::vec3& getAmbientLight() const { return ambientLight; }
-        void setAmbientLight(const glm::vec3& light) { ambientLight = light; }
-        const glm::vec3 GetLightRadiance(const glm::vec3 p, const glm::vec3 n) const;
-        const glm::vec3 HemisphereToGlobal(glm::vec3 p, glm::vec3 n, glm::vec3 wih) const;
-};
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "ray.h"
+#include "hit.h"
+#include "light.h"
+#include "material.h"
+#include "instance.h"
+#include "sampler.h"
+#include "bvh.h"
+#include "distribution.h"
+#include "lightbvh.h"
+#include "compiledscene.h"
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// A point sampled on a light as seen from a shading point: the radiance it
+// contributes if nothing blocks the shadow ray origin + t * direction, t < tMax
+struct LightSample
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float tMax;
+    glm::vec3 radiance;
+    // solid angle density of picking this direction, light selection included
+    float pdf;
+};
+
+// How a path estimates the light arriving at its surfaces
+enum class PathIntegrator
+{
+    NextEvent,  // a light sample per surface, emitters hit by bounces add nothing
+    MIS         // light samples and emitters hit by bounces, weighted by the power heuristic
+};
+
+// weight of a sample drawn with density pdf against a strategy that could
+// have drawn it with otherPdf
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+    if (pdf <= 0.0f)
+    {
+        return 0.0f;
+    }
+    float ratio = otherPdf / pdf;
+    return 1.0f / (1.0f + ratio * ratio);
+}
+
+// How a shading point picks the light for its shadow ray
+enum class LightSampling
+{
+    Power,      // in proportion to power alone
+    Hierarchy   // by the estimated contribution at the point, from a light BVH
+};
+
+class Scene
+{
+    private:
+        std::vector<std::unique_ptr<Instance>> sceneObjects;
+        std::vector<Instance*> lightInstances;
+        // picks one of the distinct lights of lightInstances proportional to
+        // its power, sampledLights holds them in table order
+        AliasTable lightDistribution;
+        std::vector<Light*> sampledLights;
+        // selection probability of every light in sampledLights
+        std::unordered_map<const Light*, float> lightPdfs;
+        LightBVH lightBVH;
+        LightSampling lightSampling = LightSampling::Hierarchy;
+        PathIntegrator integrator = PathIntegrator::NextEvent;
+        // shadow rays per light sample, 0 uses the count of each light
+        int lightSampleCount = 0;
+        // instances point into these, so the scene keeps them alive
+        std::vector<std::unique_ptr<Material>> materials;
+        std::vector<std::unique_ptr<Light>> lights;
+        glm::vec3 ambientLight;
+        BVH bvh;
+        bool finalized = false;
+        // type sorted copy of the instances that closest hit and shadow rays
+        // are traced against when enabled, rebuilt whenever the scene is finalized
+        CompiledScene compiled;
+        bool useCompiled = false;
+        // widest kernels the compiled scene and the packet traversals may use,
+        // limited to what the CPU has
+        SimdLevel simdLevel = SimdLevel::AVX2;
+        // paths hit this many surfaces before Russian roulette may end them, -1 disables it
+        int rouletteDepth = -1;
+
+        void buildLightDistribution();
+    public:
+        Scene() = default;
+        ~Scene() = default;
+
+        // Prevent copying
+        Scene(const Scene&) = delete;
+        Scene& operator=(const Scene&) = delete;
+
+        // Allow moving
+        Scene(Scene&&) = default;
+        Scene& operator=(Scene&&) = default;
+
+        // picks a light proportional to its power, needs a finalized scene
+        Light* SampleLight(Sampler& sampler, float* lpdf) const;
+        // probability of SampleLight returning light
+        float getLightPdf(const Light* light) const;
+        // picks a light for the shading point p with normal n as set by setLightSampling
+        Light* SampleLight(const glm::vec3& p, const glm::vec3& n, Sampler& sampler, float* lpdf) const;
+        // probability of the shading point version of SampleLight returning light
+        float getLightPdf(const glm::vec3& p, const glm::vec3& n, const Light* light) const;
+        void setLightSampling(LightSampling mode) { lightSampling = mode; }
+        LightSampling getLightSampling() const { return lightSampling; }
+        const LightBVH& getLightBVH() const { return lightBVH; }
+        // Multiple importance sampling treats a light as its sampled shape,
+        // so the geometry it is attached to should enclose that shape
+        void setIntegrator(PathIntegrator mode) { integrator = mode; }
+        PathIntegrator getIntegrator() const { return integrator; }
+        // every light sample takes this many stratified points on the picked light,
+        // 0 goes back to the sample count of each light
+        void setLightSampleCount(int count) { lightSampleCount = count > 0 ? count : 0; }
+        int getLightSampleCount() const { return lightSampleCount; }
+        int getLightSampleCount(const Light* light) const
+        {
+            return lightSampleCount > 0 ? lightSampleCount : std::max(1, light->getSampleCount());
+        }
+        // MIS weight of the emission picked up when a bounce from p with normal n,
+        // sampled with density materialPdf, hits light in direction wi; 0 if
+        // that direction misses the emitting side of the light
+        float getEmissionWeight(const glm::vec3& p, const glm::vec3& n, const glm::vec3& wi, const Light* light, float materialPdf) const;
+        // fills the caller's hit with the closest intersection, if any
+        bool computeIntersection(const Ray& ray, Hit* hit) const;
+        // any blocker within tMax; instances emitting source, the light the
+        // segment was sampled on, are skipped so it does not shadow itself
+        bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tMax, const Light* source = nullptr) const;
+        // the active lanes blocked within their tMax, lanes need not be coherent
+        uint32_t occludedPacket(const RayPacket& packet, const float* tMax, const Light* source = nullptr) const;
+        // closest hits of all active lanes, returns the mask of lanes that hit something
+        uint32_t intersectPacket(const RayPacket& packet, Hit* hits) const;
+        const glm::vec3 tracePath(Ray& ray, const int dMax, Sampler& sampler) const;
+        // continues a path whose first intersection is already known, primaryHit is null if the ray missed
+        const glm::vec3 tracePath(Ray& ray, const Hit* primaryHit, const int dMax, Sampler& sampler) const;
+        // Russian roulette for a path that has hit depth surfaces: returns false
+        // to end it, otherwise divides beta by the survival probability
+        bool continuePath(int depth, glm::vec3& beta, Sampler& sampler) const;
+        void setRussianRoulette(int minDepth) { rouletteDepth = minDepth < 0 ? -1 : minDepth; }
+        int getRouletteDepth() const { return rouletteDepth; }
+
+        void addObject(std::unique_ptr<Instance> sceneObject) 
+        {
+            if (sceneObject->isLight()) 
+            {
+                lightInstances.push_back(sceneObject.get());
+            }
+            sceneObjects.push_back(std::move(sceneObject));
+            finalized = false;
+        }
+
+        Material* addMaterial(std::unique_ptr<Material> material)
+        {
+            materials.push_back(std::move(material));
+            return materials.back().get();
+        }
+
+        Light* addLight(std::unique_ptr<Light> light)
+        {
+            lights.push_back(std::move(light));
+            return lights.back().get();
+        }
+
+        void reserveObjects(size_t count) { sceneObjects.reserve(count); }
+
+        // builds the acceleration structure and light distribution, call after the last addObject
+        void finalize();
+        // uses a hierarchy already built over the current objects instead, e.g. from a scene cache
+        void finalize(BVH&& prebuilt)
+        {
+            bvh = std::move(prebuilt);
+            buildLightDistribution();
+            finalized = true;
+            if (useCompiled)
+            {
+                compiled.build(sceneObjects, bvh, simdLevel);
+            }
+        }
+        bool isFinalized() const { return finalized; }
+        // switches single ray tracing to the compiled scene, packets keep using the instances
+        void setCompiled(bool enabled);
+        bool isCompiled() const { return useCompiled; }
+        // packets use it right away, the compiled scene when it is built next
+        void setSimdLevel(SimdLevel level) { simdLevel = level; }
+        const CompiledScene& getCompiledScene() const { return compiled; }
+        const BVH& getBVH() const { return bvh; }
+
+        const std::vector<std::unique_ptr<Instance>>& getObjects() const { return sceneObjects; }
+        // the same for scenes holding the same objects, lights and materials
+        uint64_t getContentHash() const;
+        const glm::vec3& getAmbientLight() const { return ambientLight; }
+        void setAmbientLight(const glm::vec3& light) { ambientLight = light; }
+        bool SampleLightRay(const glm::vec3 p, const glm::vec3 n, Sampler& sampler, LightSample* sample) const;
+        // the sample at the uniform numbers u on a light already picked with probability lpdf
+        void SampleLightRay(const glm::vec3 p, const glm::vec3 n, const Light& light, float lpdf, const glm::vec2& u, LightSample* sample) const;
+        // light arriving at p from the stratified samples of one picked light,
+        // their shadow rays traced a packet at a time; with a material each
+        // sample is weighted for MIS against the directions it samples
+        const glm::vec3 GetLightRadiance(const glm::vec3 p, const glm::vec3 n, Sampler& sampler, const Material* misMaterial = nullptr) const;
+        const glm::vec3 HemisphereToGlobal(glm::vec3 p, glm::vec3 n, glm::vec3 wih) const;
+        // inverse of HemisphereToGlobal, for the pdfs of directions the material did not sample
+        const glm::vec3 GlobalToHemisphere(glm::vec3 n, glm::vec3 wi) const;
+};
 #endif
\ No newline at end of file
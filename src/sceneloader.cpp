@@ -0,0 +1,706 @@
+#include "sceneloader.h"
+#include "instance.h"
+#include "light.h"
+#include "material.h"
+#include "shape.h"
+#include "transform.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char cacheMagic[8] = { 'P', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+    const uint32_t cacheVersion = 2;
+    // arrays in the cache start on cache line boundaries
+    const uint64_t cacheAlignment = 64;
+
+    enum ShapeType : uint32_t
+    {
+        SphereShape = 0,
+        BoxShape = 1
+    };
+
+    struct MaterialRecord
+    {
+        glm::vec3 diffuse;
+    };
+
+    struct LightRecord
+    {
+        glm::vec3 position;
+        glm::vec3 power;
+        glm::vec3 ei;
+        glm::vec3 ej;
+        int32_t nSamples;
+    };
+
+    // One instance. A sphere keeps its center in a and its radius in b.x,
+    // a box its two corners. material and light index the record arrays,
+    // -1 if unused.
+    struct ObjectRecord
+    {
+        uint32_t shape;
+        int32_t material;
+        int32_t light;
+        glm::vec3 a;
+        glm::vec3 b;
+        glm::mat4 matrix;
+        glm::mat4 inverse;
+    };
+
+    struct SceneRecords
+    {
+        glm::vec3 ambient = glm::vec3(0.0f);
+        std::vector<MaterialRecord> materials;
+        std::vector<LightRecord> lights;
+        std::vector<ObjectRecord> objects;
+    };
+
+    // The cache file: this header, then every array at the offset it lists
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        // size and modification time (ns) of the text file the cache was made from
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        RenderSettings settings;
+        glm::vec3 ambient;
+        uint64_t materialCount, materialOffset;
+        uint64_t lightCount, lightOffset;
+        uint64_t objectCount, objectOffset;
+        uint64_t nodeCount, nodeOffset;
+        uint64_t primCount, primOffset;
+    };
+
+    bool sourceStamp(const std::string& filename, uint64_t* size, int64_t* time)
+    {
+        struct stat info;
+        if (stat(filename.c_str(), &info) != 0)
+        {
+            return false;
+        }
+        *size = static_cast<uint64_t>(info.st_size);
+        *time = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        return true;
+    }
+
+    // whitespace separated words of one line
+    class LineReader
+    {
+        private:
+            const char* p;
+            const char* end;
+
+            void skipSpaces()
+            {
+                while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                {
+                    p++;
+                }
+                if (p < end && *p == '#')
+                {
+                    p = end;
+                }
+            }
+
+        public:
+            LineReader(const char* begin, const char* end) : p(begin), end(end) { skipSpaces(); }
+
+            bool atEnd() const { return p == end; }
+
+            bool word(std::string* out)
+            {
+                const char* start = p;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+                {
+                    p++;
+                }
+                out->assign(start, p);
+                skipSpaces();
+                return p != start;
+            }
+
+            bool number(float* out)
+            {
+                // the file buffer ends in a newline, so strtof stops inside it
+                char* next;
+                *out = std::strtof(p, &next);
+                if (next == p || next > end)
+                {
+                    return false;
+                }
+                p = next;
+                skipSpaces();
+                return true;
+            }
+
+            bool integer(int* out)
+            {
+                float value;
+                if (!number(&value))
+                {
+                    return false;
+                }
+                *out = static_cast<int>(value);
+                return true;
+            }
+
+            bool vec3(glm::vec3* out)
+            {
+                return number(&out->x) && number(&out->y) && number(&out->z);
+            }
+    };
+
+    bool parseObject(LineReader& line, const std::string& keyword, const std::unordered_map<std::string, int>& materialNames,
+                     const std::unordered_map<std::string, int>& lightNames, ObjectRecord* object, std::string* error)
+    {
+        object->material = -1;
+        object->light = -1;
+        object->b = glm::vec3(0.0f);
+        if (keyword == "sphere")
+        {
+            object->shape = SphereShape;
+            if (!line.vec3(&object->a) || !line.number(&object->b.x))
+            {
+                *error = "expected sphere <center> <radius>";
+                return false;
+            }
+        }
+        else
+        {
+            object->shape = BoxShape;
+            if (!line.vec3(&object->a) || !line.vec3(&object->b))
+            {
+                *error = "expected box <min> <max>";
+                return false;
+            }
+        }
+
+        std::string kind, name;
+        if (!line.word(&kind) || !line.word(&name) || (kind != "material" && kind != "light"))
+        {
+            *error = "expected material <name> or light <name>";
+            return false;
+        }
+        const auto& names = kind == "material" ? materialNames : lightNames;
+        auto found = names.find(name);
+        if (found == names.end())
+        {
+            *error = "unknown " + kind + " '" + name + "'";
+            return false;
+        }
+        (kind == "material" ? object->material : object->light) = found->second;
+
+        Transform transform;
+        std::string op;
+        while (line.word(&op))
+        {
+            glm::vec3 v;
+            float angle;
+            if (op == "translate" && line.vec3(&v))
+            {
+                transform.translate(v);
+            }
+            else if (op == "rotate" && line.number(&angle) && line.vec3(&v))
+            {
+                transform.rotate(angle, v);
+            }
+            else if (op == "scale" && line.vec3(&v))
+            {
+                transform.scale(v);
+            }
+            else
+            {
+                *error = "bad transform '" + op + "'";
+                return false;
+            }
+        }
+        object->matrix = transform.getMatrix();
+        object->inverse = transform.getInverseMatrix();
+        return true;
+    }
+
+    bool parseSceneFile(const std::string& filename, RenderSettings* settings, SceneRecords* records)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "Failed to open scene file: " << filename << std::endl;
+            return false;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+        text.push_back('\n');
+
+        std::unordered_map<std::string, int> materialNames;
+        std::unordered_map<std::string, int> lightNames;
+        std::string keyword, error;
+        int lineNumber = 0;
+        const char* p = text.data();
+        const char* end = p + text.size();
+        while (p < end)
+        {
+            lineNumber++;
+            const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            LineReader line(p, lineEnd);
+            p = lineEnd + 1;
+            if (line.atEnd())
+            {
+                continue;
+            }
+
+            line.word(&keyword);
+            bool ok = true;
+            if (keyword == "sphere" || keyword == "box")
+            {
+                ObjectRecord object;
+                ok = parseObject(line, keyword, materialNames, lightNames, &object, &error);
+                records->objects.push_back(object);
+            }
+            else if (keyword == "film")
+            {
+                ok = line.integer(&settings->width) && line.integer(&settings->height)
+                    && settings->width > 0 && settings->height > 0;
+                error = "expected film <width> <height>";
+            }
+            else if (keyword == "samples")
+            {
+                ok = line.integer(&settings->numSamples) && settings->numSamples > 0;
+                error = "expected samples <n> with n > 0";
+            }
+            else if (keyword == "depth")
+            {
+                ok = line.integer(&settings->dMax) && settings->dMax > 0;
+                error = "expected depth <n> with n > 0";
+            }
+            else if (keyword == "roulette")
+            {
+                ok = line.integer(&settings->rouletteDepth);
+                error = "expected roulette <min depth>";
+            }
+            else if (keyword == "ambient")
+            {
+                ok = line.vec3(&records->ambient);
+                error = "expected ambient r g b";
+            }
+            else if (keyword == "camera")
+            {
+                std::string key;
+                while (ok && line.word(&key))
+                {
+                    if (key == "eye")
+                    {
+                        ok = line.vec3(&settings->eye);
+                    }
+                    else if (key == "lookat")
+                    {
+                        ok = line.vec3(&settings->lookAt);
+                    }
+                    else if (key == "up")
+                    {
+                        ok = line.vec3(&settings->up);
+                    }
+                    else if (key == "fov")
+                    {
+                        ok = line.number(&settings->fov);
+                    }
+                    else if (key == "distance")
+                    {
+                        ok = line.number(&settings->focalDistance);
+                    }
+                    else
+                    {
+                        ok = false;
+                    }
+                }
+                error = "bad camera parameter '" + key + "'";
+            }
+            else if (keyword == "material")
+            {
+                std::string name, model;
+                MaterialRecord material;
+                ok = line.word(&name) && line.word(&model) && model == "phong" && line.vec3(&material.diffuse);
+                error = "expected material <name> phong r g b";
+                if (ok)
+                {
+                    materialNames[name] = static_cast<int>(records->materials.size());
+                    records->materials.push_back(material);
+                }
+            }
+            else if (keyword == "arealight")
+            {
+                std::string name, key;
+                LightRecord light = { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), 1 };
+                ok = line.word(&name);
+                while (ok && line.word(&key))
+                {
+                    if (key == "position")
+                    {
+                        ok = line.vec3(&light.position);
+                    }
+                    else if (key == "power")
+                    {
+                        ok = line.vec3(&light.power);
+                    }
+                    else if (key == "ei")
+                    {
+                        ok = line.vec3(&light.ei);
+                    }
+                    else if (key == "ej")
+                    {
+                        ok = line.vec3(&light.ej);
+                    }
+                    else if (key == "samples")
+                    {
+                        ok = line.integer(&light.nSamples);
+                    }
+                    else
+                    {
+                        ok = false;
+                    }
+                }
+                error = "bad arealight parameter '" + key + "'";
+                if (ok)
+                {
+                    lightNames[name] = static_cast<int>(records->lights.size());
+                    records->lights.push_back(light);
+                }
+            }
+            else
+            {
+                ok = false;
+                error = "unknown statement '" + keyword + "'";
+            }
+
+            if (ok && !line.atEnd())
+            {
+                ok = false;
+                error = "unexpected text after " + keyword;
+            }
+            if (!ok)
+            {
+                std::cerr << filename << ":" << lineNumber << ": " << error << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::unique_ptr<Scene> buildScene(const glm::vec3& ambient, const MaterialRecord* materialRecords, size_t materialCount,
+                                      const LightRecord* lightRecords, size_t lightCount,
+                                      const ObjectRecord* objectRecords, size_t objectCount)
+    {
+        auto scene = std::make_unique<Scene>();
+        scene->setAmbientLight(ambient);
+
+        std::vector<Material*> materials(materialCount);
+        for (size_t i = 0; i < materialCount; i++)
+        {
+            materials[i] = scene->addMaterial(std::make_unique<PhongMaterial>(materialRecords[i].diffuse));
+        }
+        std::vector<Light*> lights(lightCount);
+        for (size_t i = 0; i < lightCount; i++)
+        {
+            const LightRecord& light = lightRecords[i];
+            lights[i] = scene->addLight(std::make_unique<AreaLight>(light.position, light.power, light.ei, light.ej, light.nSamples));
+        }
+
+        scene->reserveObjects(objectCount);
+        for (size_t i = 0; i < objectCount; i++)
+        {
+            const ObjectRecord& object = objectRecords[i];
+            std::unique_ptr<Shape> shape;
+            if (object.shape == SphereShape)
+            {
+                shape = std::make_unique<Sphere>(object.a, object.b.x);
+            }
+            else
+            {
+                shape = std::make_unique<Box>(object.a, object.b);
+            }
+
+            auto instance = std::make_unique<Instance>(std::move(shape));
+            instance->setTransform(object.matrix, object.inverse);
+            if (object.light >= 0)
+            {
+                instance->setLight(lights[object.light]);
+            }
+            else
+            {
+                instance->setMaterial(materials[object.material]);
+            }
+            scene->addObject(std::move(instance));
+        }
+        return scene;
+    }
+
+    uint64_t alignOffset(uint64_t offset)
+    {
+        return (offset + cacheAlignment - 1) / cacheAlignment * cacheAlignment;
+    }
+
+    bool writeCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime, const RenderSettings& settings,
+                    const SceneRecords& records, const BVH& bvh)
+    {
+        CacheHeader header;
+        std::memset(static_cast<void*>(&header), 0, sizeof(header));
+        std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+        header.version = cacheVersion;
+        header.sourceSize = sourceSize;
+        header.sourceTime = sourceTime;
+        header.settings = settings;
+        header.ambient = records.ambient;
+
+        uint64_t offset = alignOffset(sizeof(CacheHeader));
+        auto place = [&](uint64_t count, size_t elementSize, uint64_t* countField, uint64_t* offsetField)
+        {
+            *countField = count;
+            *offsetField = offset;
+            offset = alignOffset(offset + count * elementSize);
+        };
+        place(records.materials.size(), sizeof(MaterialRecord), &header.materialCount, &header.materialOffset);
+        place(records.lights.size(), sizeof(LightRecord), &header.lightCount, &header.lightOffset);
+        place(records.objects.size(), sizeof(ObjectRecord), &header.objectCount, &header.objectOffset);
+        place(bvh.getNodes().size(), sizeof(BVHNode), &header.nodeCount, &header.nodeOffset);
+        place(bvh.getPrimIndices().size(), sizeof(int), &header.primCount, &header.primOffset);
+
+        // written next to the cache and renamed over it, so readers never see half a file
+        std::string tempFile = cacheFile + ".tmp";
+        FILE* file = std::fopen(tempFile.c_str(), "wb");
+        if (!file)
+        {
+            std::cerr << "Failed to write scene cache: " << cacheFile << std::endl;
+            return false;
+        }
+
+        bool written = true;
+        uint64_t position = 0;
+        auto put = [&](uint64_t at, const void* data, size_t size)
+        {
+            static const char padding[cacheAlignment] = {};
+            while (written && position < at)
+            {
+                size_t gap = static_cast<size_t>(std::min<uint64_t>(at - position, cacheAlignment));
+                written = std::fwrite(padding, 1, gap, file) == gap;
+                position += gap;
+            }
+            written = written && std::fwrite(data, 1, size, file) == size;
+            position += size;
+        };
+        put(0, &header, sizeof(header));
+        put(header.materialOffset, records.materials.data(), records.materials.size() * sizeof(MaterialRecord));
+        put(header.lightOffset, records.lights.data(), records.lights.size() * sizeof(LightRecord));
+        put(header.objectOffset, records.objects.data(), records.objects.size() * sizeof(ObjectRecord));
+        put(header.nodeOffset, bvh.getNodes().data(), bvh.getNodes().size() * sizeof(BVHNode));
+        put(header.primOffset, bvh.getPrimIndices().data(), bvh.getPrimIndices().size() * sizeof(int));
+
+        written = std::fclose(file) == 0 && written;
+        if (!written || std::rename(tempFile.c_str(), cacheFile.c_str()) != 0)
+        {
+            std::cerr << "Failed to write scene cache: " << cacheFile << std::endl;
+            std::remove(tempFile.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::unique_ptr<Scene> loadCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime, RenderSettings* settings)
+    {
+        int fd = open(cacheFile.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CacheHeader))
+        {
+            close(fd);
+            return nullptr;
+        }
+        size_t size = static_cast<size_t>(info.st_size);
+        void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        madvise(address, size, MADV_SEQUENTIAL);
+
+        const uint8_t* data = static_cast<const uint8_t*>(address);
+        const CacheHeader* header = reinterpret_cast<const CacheHeader*>(data);
+        auto fits = [&](uint64_t count, size_t elementSize, uint64_t offset)
+        {
+            return offset <= size && count <= (size - offset) / elementSize;
+        };
+        // a cache from an older build or an edited scene file is simply made again
+        if (std::memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0 || header->version != cacheVersion
+            || header->sourceSize != sourceSize || header->sourceTime != sourceTime)
+        {
+            munmap(address, size);
+            return nullptr;
+        }
+
+        bool valid = fits(header->materialCount, sizeof(MaterialRecord), header->materialOffset)
+            && fits(header->lightCount, sizeof(LightRecord), header->lightOffset)
+            && fits(header->objectCount, sizeof(ObjectRecord), header->objectOffset)
+            && fits(header->nodeCount, sizeof(BVHNode), header->nodeOffset)
+            && fits(header->primCount, sizeof(int), header->primOffset)
+            && header->primCount == header->objectCount
+            && header->objectCount <= static_cast<uint64_t>(std::numeric_limits<int>::max())
+            && header->nodeCount <= static_cast<uint64_t>(std::numeric_limits<int>::max())
+            && header->settings.width > 0 && header->settings.height > 0
+            && header->settings.numSamples > 0 && header->settings.dMax > 0;
+
+        // the records are used as indices and offsets, so a damaged or foreign
+        // file must not get past here
+        const ObjectRecord* objects = reinterpret_cast<const ObjectRecord*>(data + header->objectOffset);
+        for (uint64_t i = 0; valid && i < header->objectCount; i++)
+        {
+            const ObjectRecord& object = objects[i];
+            valid = (object.shape == SphereShape || object.shape == BoxShape)
+                && (object.light >= 0 ? static_cast<uint64_t>(object.light) < header->lightCount
+                                      : object.material >= 0 && static_cast<uint64_t>(object.material) < header->materialCount);
+        }
+        valid = valid && BVH::isValid(reinterpret_cast<const BVHNode*>(data + header->nodeOffset), static_cast<int>(header->nodeCount),
+                                      reinterpret_cast<const int*>(data + header->primOffset), static_cast<int>(header->primCount),
+                                      static_cast<int>(header->objectCount));
+        if (!valid)
+        {
+            std::cerr << "Ignoring damaged scene cache " << cacheFile << std::endl;
+            munmap(address, size);
+            return nullptr;
+        }
+
+        *settings = header->settings;
+        auto scene = buildScene(header->ambient,
+                                reinterpret_cast<const MaterialRecord*>(data + header->materialOffset), header->materialCount,
+                                reinterpret_cast<const LightRecord*>(data + header->lightOffset), header->lightCount,
+                                objects, header->objectCount);
+
+        BVH bvh;
+        bvh.assign(reinterpret_cast<const BVHNode*>(data + header->nodeOffset), static_cast<int>(header->nodeCount),
+                   reinterpret_cast<const int*>(data + header->primOffset), static_cast<int>(header->primCount));
+        scene->finalize(std::move(bvh));
+
+        munmap(address, size);
+        return scene;
+    }
+}
+
+std::unique_ptr<Scene> loadScene(const std::string& filename, RenderSettings* settings, bool useCache)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string cacheFile = filename + ".cache";
+
+    uint64_t sourceSize = 0;
+    int64_t sourceTime = 0;
+    if (!sourceStamp(filename, &sourceSize, &sourceTime))
+    {
+        std::cerr << "Failed to open scene file: " << filename << std::endl;
+        return nullptr;
+    }
+
+    if (useCache)
+    {
+        auto scene = loadCache(cacheFile, sourceSize, sourceTime, settings);
+        if (scene)
+        {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Loaded " << scene->getObjects().size() << " objects from " << cacheFile
+                      << " in " << elapsed.count() << "ms" << std::endl;
+            return scene;
+        }
+    }
+
+    SceneRecords records;
+    if (!parseSceneFile(filename, settings, &records))
+    {
+        return nullptr;
+    }
+    auto scene = buildScene(records.ambient, records.materials.data(), records.materials.size(),
+                            records.lights.data(), records.lights.size(),
+                            records.objects.data(), records.objects.size());
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Parsed " << records.objects.size() << " objects from " << filename
+              << " in " << elapsed.count() << "ms" << std::endl;
+
+    scene->finalize();
+    if (useCache)
+    {
+        writeCache(cacheFile, sourceSize, sourceTime, *settings, records, scene->getBVH());
+    }
+    return scene;
+}
+
+bool applyRenderSetting(const std::string& key, const std::string& value, RenderSettings* settings)
+{
+    std::string text = value;
+    std::replace(text.begin(), text.end(), ',', ' ');
+    LineReader line(text.data(), text.data() + text.size());
+    RenderSettings updated = *settings;
+    bool ok = false;
+    if (key == "width")
+    {
+        ok = line.integer(&updated.width) && updated.width > 0;
+    }
+    else if (key == "height")
+    {
+        ok = line.integer(&updated.height) && updated.height > 0;
+    }
+    else if (key == "samples")
+    {
+        ok = line.integer(&updated.numSamples) && updated.numSamples > 0;
+    }
+    else if (key == "depth")
+    {
+        ok = line.integer(&updated.dMax) && updated.dMax > 0;
+    }
+    else if (key == "roulette")
+    {
+        ok = line.integer(&updated.rouletteDepth);
+    }
+    else if (key == "eye")
+    {
+        ok = line.vec3(&updated.eye);
+    }
+    else if (key == "lookat")
+    {
+        ok = line.vec3(&updated.lookAt);
+    }
+    else if (key == "up")
+    {
+        ok = line.vec3(&updated.up);
+    }
+    else if (key == "fov")
+    {
+        ok = line.number(&updated.fov) && updated.fov > 0.0f;
+    }
+    else if (key == "distance")
+    {
+        ok = line.number(&updated.focalDistance);
+    }
+
+    if (!ok || !line.atEnd())
+    {
+        std::cerr << "Bad render setting " << key << "=" << value << std::endl;
+        return false;
+    }
+    *settings = updated;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef SCENELOADER_H
+#define SCENELOADER_H
+
+#include "scene.h"
+#include <glm/glm.hpp>
+#include <memory>
+#include <string>
+
+// Everything a scene file describes besides the scene itself
+struct RenderSettings
+{
+    int width = 800;
+    int height = 600;
+    int numSamples = 64;
+    int dMax = 4;
+    // see Scene::setRussianRoulette, -1 disables it
+    int rouletteDepth = -1;
+
+    glm::vec3 eye = glm::vec3(0.0f, 2.5f, 7.0f);
+    glm::vec3 lookAt = glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+    float fov = 50.0f;
+    float focalDistance = 1.0f;
+};
+
+// Loads a text scene file, one statement per line, # starts a comment:
+//
+//   film <width> <height>
+//   samples <n>
+//   depth <n>
+//   roulette <min depth>
+//   camera [eye x y z] [lookat x y z] [up x y z] [fov degrees] [distance d]
+//   ambient r g b
+//   material <name> phong <r g b>
+//   arealight <name> position x y z power r g b ei x y z ej x y z [samples n]
+//   sphere <cx cy cz> <radius> (material|light) <name> [transforms]
+//   box <min x y z> <max x y z> (material|light) <name> [transforms]
+//
+// where transforms is any sequence of "translate x y z", "rotate degrees
+// ax ay az" and "scale x y z", applied like the Instance methods of the
+// same name. The parsed scene and its BVH are cached in <filename>.cache,
+// which is memory mapped by later loads as long as the text file keeps its
+// size and modification time. Returns nullptr on error.
+std::unique_ptr<Scene> loadScene(const std::string& filename, RenderSettings* settings, bool useCache = true);
+
+// Overrides one setting by the name a scene file uses for it: width, height,
+// samples, depth, roulette, eye, lookat, up, fov or distance. Vectors are
+// written x,y,z. Leaves the settings alone and returns false on a bad value.
+bool applyRenderSetting(const std::string& key, const std::string& value, RenderSettings* settings);
+
+#endif
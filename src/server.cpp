@@ -0,0 +1,555 @@
+#include "server.h"
+#include "camera.h"
+#include "film.h"
+#include "net.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    // a request is one short line, anything longer is not a client of ours
+    const size_t maxRequestLength = 4096;
+    // passes per job, each one sends a progress line
+    const uint32_t progressPasses = 8;
+
+    // canonical path, so every spelling of a file shares one warm scene
+    bool resolvePath(const std::string& filename, std::string* path)
+    {
+        char resolved[PATH_MAX];
+        if (!::realpath(filename.c_str(), resolved))
+        {
+            return false;
+        }
+        *path = resolved;
+        return true;
+    }
+
+    int64_t getModifiedTime(const std::string& filename)
+    {
+        struct stat info;
+        if (::stat(filename.c_str(), &info) != 0)
+        {
+            return -1;
+        }
+        return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    }
+
+    // takes the first line out of buffer, false until one is complete
+    bool takeLine(std::string* buffer, std::string* line)
+    {
+        size_t end = buffer->find('\n');
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+        line->assign(*buffer, 0, end);
+        buffer->erase(0, end + 1);
+        if (!line->empty() && line->back() == '\r')
+        {
+            line->pop_back();
+        }
+        return true;
+    }
+
+    bool sendLine(int fd, const std::string& line)
+    {
+        std::string text = line + "\n";
+        return sendAll(fd, text.data(), text.size());
+    }
+
+    // path is directory itself or somewhere below it, both canonical
+    bool isInside(const std::string& path, const std::string& directory)
+    {
+        if (directory == "/")
+        {
+            return true;
+        }
+        return path.compare(0, directory.size(), directory) == 0
+            && (path.size() == directory.size() || path[directory.size()] == '/');
+    }
+}
+
+RenderServer::RenderServer(PathTracer* pathtracer)
+    : pathtracer(pathtracer), gamma(1.0f), runningJob(-1), nextJobId(1), numWarmScenes(0), stopping(false)
+{
+    setRoot(".");
+}
+
+bool RenderServer::setRoot(const std::string& directory)
+{
+    std::string path;
+    struct stat info;
+    if (!resolvePath(directory, &path) || ::stat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+    {
+        std::cerr << "Invalid server root directory: " << directory << std::endl;
+        return false;
+    }
+    root = path;
+    return true;
+}
+
+bool RenderServer::resolveJobPath(const std::string& path, bool existing, std::string* resolved, std::string* error) const
+{
+    std::istringstream parts(path);
+    std::string part;
+    while (std::getline(parts, part, '/'))
+    {
+        if (part == "..")
+        {
+            *error = "path may not contain ..: " + path;
+            return false;
+        }
+    }
+
+    std::string full = path.empty() || path[0] != '/' ? root + "/" + path : path;
+    if (existing)
+    {
+        if (!resolvePath(full, resolved) || !isInside(*resolved, root))
+        {
+            *error = "no such scene in the server root: " + path;
+            return false;
+        }
+        return true;
+    }
+
+    // the file may not exist yet, its directory must
+    size_t slash = full.rfind('/');
+    std::string name = full.substr(slash + 1);
+    std::string directory;
+    if (name.empty() || name == "." || !resolvePath(full.substr(0, slash + 1), &directory) || !isInside(directory, root))
+    {
+        *error = "output is not a file in the server root: " + path;
+        return false;
+    }
+    *resolved = directory + (directory == "/" ? "" : "/") + name;
+    // an existing file, e.g. a symbolic link, must not lead out of the root
+    std::string target;
+    struct stat info;
+    if (resolvePath(*resolved, &target)
+        && (!isInside(target, root) || ::stat(target.c_str(), &info) != 0 || !S_ISREG(info.st_mode)))
+    {
+        *error = "output is not a file in the server root: " + path;
+        return false;
+    }
+    return true;
+}
+
+void RenderServer::addScene(const std::string& filename, std::unique_ptr<Scene> scene, const RenderSettings& settings)
+{
+    std::string key;
+    if (!filename.empty() && !resolvePath(filename, &key))
+    {
+        key = filename;
+    }
+    if (scenes.empty())
+    {
+        defaultScene = key;
+    }
+    int64_t modified = filename.empty() ? 0 : getModifiedTime(key);
+    scenes[key] = WarmScene{ std::move(scene), settings, modified };
+    std::lock_guard<std::mutex> lock(mutex);
+    numWarmScenes = scenes.size();
+}
+
+RenderServer::WarmScene* RenderServer::getScene(const std::string& filename, double* loadTime)
+{
+    *loadTime = 0.0;
+    std::string key = defaultScene;
+    if (!filename.empty() && !resolvePath(filename, &key))
+    {
+        std::cerr << "Failed to open scene file: " << filename << std::endl;
+        return nullptr;
+    }
+
+    auto found = scenes.find(key);
+    int64_t modified = key.empty() ? 0 : getModifiedTime(key);
+    if (found != scenes.end() && found->second.modified == modified)
+    {
+        return &found->second;
+    }
+
+    // first use, or the file changed since it was loaded
+    auto start = std::chrono::steady_clock::now();
+    RenderSettings settings;
+    std::unique_ptr<Scene> scene = loadScene(key, &settings);
+    if (!scene)
+    {
+        return nullptr;
+    }
+    if (prepareScene)
+    {
+        prepareScene(scene.get(), settings);
+    }
+    WarmScene& warm = scenes[key];
+    warm = WarmScene{ std::move(scene), settings, modified };
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    *loadTime = elapsed.count();
+    std::lock_guard<std::mutex> lock(mutex);
+    numWarmScenes = scenes.size();
+    return &warm;
+}
+
+bool RenderServer::parseJob(const std::string& request, Job* job, std::string* error) const
+{
+    std::istringstream words(request);
+    std::string word;
+    words >> word;
+    std::string output = "output.ppm";
+    // settings are checked here so a bad job fails before it is queued
+    RenderSettings check;
+    while (words >> word)
+    {
+        size_t equals = word.find('=');
+        if (equals == std::string::npos || equals == 0)
+        {
+            *error = "expected key=value, got " + word;
+            return false;
+        }
+        std::string key = word.substr(0, equals);
+        std::string value = word.substr(equals + 1);
+        if (key == "scene")
+        {
+            if (!resolveJobPath(value, true, &job->sceneFile, error))
+            {
+                return false;
+            }
+        }
+        else if (key == "output")
+        {
+            output = value;
+        }
+        else if (applyRenderSetting(key, value, &check))
+        {
+            job->settings.emplace_back(key, value);
+        }
+        else
+        {
+            *error = "bad setting " + word;
+            return false;
+        }
+    }
+    return resolveJobPath(output, false, &job->output, error);
+}
+
+std::string RenderServer::handleRequest(int fd, const std::string& request, bool* keepOpen)
+{
+    *keepOpen = false;
+    std::string command = request.substr(0, request.find(' '));
+    if (command == "status")
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream status;
+        status << "status queued " << queue.size() << " running ";
+        if (runningJob >= 0)
+        {
+            status << runningJob;
+        }
+        else
+        {
+            status << "none";
+        }
+        status << " scenes " << numWarmScenes << " threads " << pathtracer->getThreadCount();
+        return status.str();
+    }
+    if (command == "shutdown")
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        return "shutting down";
+    }
+    if (command != "render")
+    {
+        return "error unknown request " + command;
+    }
+
+    Job job;
+    std::string error;
+    if (!parseJob(request, &job, &error))
+    {
+        return "error " + error;
+    }
+    job.fd = fd;
+    job.queued = std::chrono::steady_clock::now();
+    job.connected = true;
+
+    // the answer goes out before the job is visible to the render thread, so
+    // the client always reads queued before started
+    std::lock_guard<std::mutex> lock(mutex);
+    job.id = nextJobId++;
+    size_t ahead = queue.size() + (runningJob >= 0 ? 1 : 0);
+    if (!sendLine(fd, "queued " + std::to_string(job.id) + " " + std::to_string(ahead)))
+    {
+        return "";
+    }
+    *keepOpen = true;
+    queue.push_back(std::move(job));
+    jobAvailable.notify_one();
+    return "";
+}
+
+bool RenderServer::reply(Job& job, const std::string& line)
+{
+    // a client that left does not stop the job, its image is still written
+    job.connected = job.connected && sendLine(job.fd, line);
+    return job.connected;
+}
+
+void RenderServer::runJob(Job& job)
+{
+    double loadTime;
+    WarmScene* warm = getScene(job.sceneFile, &loadTime);
+    if (!warm)
+    {
+        reply(job, "error failed to load scene " + job.sceneFile);
+        return;
+    }
+    RenderSettings settings = warm->settings;
+    for (const auto& setting : job.settings)
+    {
+        applyRenderSetting(setting.first, setting.second, &settings);
+    }
+    std::string id = std::to_string(job.id);
+    if (loadTime > 0.0)
+    {
+        reply(job, "started " + id + " scene loaded in " + std::to_string(loadTime) + "ms");
+    }
+    else
+    {
+        reply(job, "started " + id + " scene warm");
+    }
+
+    Film film(glm::ivec2(settings.width, settings.height));
+    Camera camera(settings.eye, settings.lookAt, settings.up, settings.fov, settings.focalDistance,
+                  settings.width, settings.height);
+    warm->scene->setRussianRoulette(settings.rouletteDepth);
+    uint32_t numSamples = static_cast<uint32_t>(settings.numSamples);
+    pathtracer->setProgressive(std::max((numSamples + progressPasses - 1) / progressPasses, 1u));
+    double renderTime = 0.0;
+    pathtracer->setProgressCallback([&](uint32_t samples, uint32_t target, double seconds)
+    {
+        renderTime = seconds;
+        reply(job, "progress " + id + " " + std::to_string(samples) + "/" + std::to_string(target) + " "
+              + std::to_string(seconds) + "s");
+    });
+    pathtracer->render(&film, &camera, warm->scene.get(), static_cast<float>(numSamples), settings.dMax);
+    pathtracer->setProgressCallback(nullptr);
+
+    film.setToneMap(1.0f, gamma);
+    if (!film.saveImage(job.output, pathtracer->getThreadPool()))
+    {
+        reply(job, "error failed to save " + job.output);
+        return;
+    }
+    std::chrono::duration<double> sinceQueued = std::chrono::steady_clock::now() - job.queued;
+    reply(job, "done " + id + " " + std::to_string(renderTime) + "s " + std::to_string(sinceQueued.count()) + "s "
+          + job.output);
+}
+
+void RenderServer::runJobs()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobAvailable.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (stopping)
+        {
+            break;
+        }
+        Job job = std::move(queue.front());
+        queue.pop_front();
+        runningJob = job.id;
+        lock.unlock();
+
+        runJob(job);
+        ::close(job.fd);
+
+        lock.lock();
+        runningJob = -1;
+    }
+
+    // jobs still waiting when the server stops
+    for (Job& job : queue)
+    {
+        reply(job, "error server shutting down");
+        ::close(job.fd);
+    }
+    queue.clear();
+}
+
+bool RenderServer::run(const std::string& address)
+{
+    SocketAddress parsed;
+    if (!parseSocketAddress(address, &parsed))
+    {
+        return false;
+    }
+    // anyone who can connect can have files written in the root
+    if (!isLoopback(parsed))
+    {
+        std::cerr << "The render server only listens on unix: or loopback addresses, not " << address << std::endl;
+        return false;
+    }
+    int listenFd = listenOn(parsed);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+    if (parsed.local)
+    {
+        ::chmod(parsed.path.c_str(), S_IRUSR | S_IWUSR);
+    }
+    std::cout << "Serving render jobs on " << address << " with " << scenes.size() << " warm scenes, files in "
+              << root << std::endl;
+
+    std::thread renderThread(&RenderServer::runJobs, this);
+
+    // connections still sending their request, each with what arrived so far
+    std::vector<std::pair<int, std::string>> clients;
+    std::vector<pollfd> pollFds;
+    char chunk[1024];
+    bool serving = true;
+    while (serving)
+    {
+        pollFds.assign(1, pollfd{ listenFd, POLLIN, 0 });
+        for (const auto& client : clients)
+        {
+            pollFds.push_back(pollfd{ client.first, POLLIN, 0 });
+        }
+        if (::poll(pollFds.data(), pollFds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Failed to wait for clients: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            if (!(pollFds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+            int fd = clients[c].first;
+            std::string& buffer = clients[c].second;
+            ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (received > 0)
+            {
+                buffer.append(chunk, static_cast<size_t>(received));
+            }
+
+            std::string request;
+            bool keepOpen = false;
+            if (takeLine(&buffer, &request))
+            {
+                std::string answer = handleRequest(fd, request, &keepOpen);
+                if (!answer.empty())
+                {
+                    sendLine(fd, answer);
+                }
+            }
+            else if (received > 0 && buffer.size() <= maxRequestLength)
+            {
+                continue;
+            }
+            // answered, handed to a job, or gone before finishing its request
+            if (!keepOpen)
+            {
+                ::close(fd);
+            }
+            clients[c].first = -1;
+        }
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                     [](const std::pair<int, std::string>& client) { return client.first < 0; }),
+                      clients.end());
+
+        if (pollFds[0].revents & POLLIN)
+        {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                clients.emplace_back(fd, std::string());
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        serving = !stopping;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    renderThread.join();
+    for (const auto& client : clients)
+    {
+        ::close(client.first);
+    }
+    ::close(listenFd);
+    if (parsed.local)
+    {
+        ::unlink(parsed.path.c_str());
+    }
+    std::cout << "Render server stopped" << std::endl;
+    return true;
+}
+
+bool sendServerRequest(const std::string& address, const std::string& request)
+{
+    SocketAddress parsed;
+    if (!parseSocketAddress(address, &parsed))
+    {
+        return false;
+    }
+    int fd = connectTo(parsed);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to connect to the render server at " << address << std::endl;
+        return false;
+    }
+    if (!sendLine(fd, request))
+    {
+        std::cerr << "Failed to send the request to " << address << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    // print the answer as it streams in, the server closes the connection at the end
+    bool isRender = request.compare(0, 6, "render") == 0;
+    bool succeeded = false;
+    std::string buffer;
+    std::string line;
+    char chunk[1024];
+    while (true)
+    {
+        while (takeLine(&buffer, &line))
+        {
+            std::cout << line << std::endl;
+            succeeded = isRender ? line.compare(0, 5, "done ") == 0 : line.compare(0, 6, "error ") != 0;
+        }
+        ssize_t received = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            break;
+        }
+        buffer.append(chunk, static_cast<size_t>(received));
+    }
+    ::close(fd);
+    return succeeded;
+}
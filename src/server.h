@@ -0,0 +1,113 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "pathtracer.h"
+#include "sceneloader.h"
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Long running render service. Scenes stay loaded with their BVHs built
+// between jobs, so a job only pays for rendering it. Clients connect to a
+// socket address (see net.h) and send a single line, one of
+//
+//   render [scene=<file>] [output=<file>] [<setting>=<value> ...]
+//   status
+//   shutdown
+//
+// where the settings are those of applyRenderSetting, e.g. width=320 or
+// eye=0,2,7, and override the scene file. Values hold no spaces. Scene and
+// output paths are opened by the server and must lie inside its root
+// directory: relative ones are taken from the root, and paths with a ".."
+// or leading elsewhere, symbolic links included, are refused. Jobs without a
+// scene use the one the server was started with. Jobs run one after the
+// other on the whole thread pool, and the server streams back lines
+//
+//   queued <id> <jobs ahead>
+//   started <id> scene warm | started <id> scene loaded in <ms>ms
+//   progress <id> <samples>/<target> <seconds>s
+//   done <id> <render seconds>s <seconds since queued>s <output>
+//   error <message>
+//
+// closing the connection after done or error. There is no authentication,
+// so the server only listens on Unix sockets and loopback TCP addresses.
+class RenderServer
+{
+    private:
+        struct WarmScene
+        {
+            std::unique_ptr<Scene> scene;
+            RenderSettings settings;
+            // modification time of the scene file, a changed file is loaded again
+            int64_t modified;
+        };
+
+        struct Job
+        {
+            int id;
+            int fd;
+            std::string sceneFile;
+            std::string output;
+            std::vector<std::pair<std::string, std::string>> settings;
+            std::chrono::steady_clock::time_point queued;
+            // the client is still there to read progress
+            bool connected;
+        };
+
+        PathTracer* pathtracer;
+        std::function<void(Scene*, const RenderSettings&)> prepareScene;
+        float gamma;
+        // only touched by the render thread once the server runs
+        std::unordered_map<std::string, WarmScene> scenes;
+        std::string defaultScene;
+        // canonical directory that job paths must stay inside
+        std::string root;
+
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        std::deque<Job> queue;
+        int runningJob;
+        int nextJobId;
+        size_t numWarmScenes;
+        bool stopping;
+
+        // parses a render request, false with a reason for the client
+        bool parseJob(const std::string& request, Job* job, std::string* error) const;
+        // the canonical form of a scene (existing) or output path of a job,
+        // false with a reason if it is outside the root
+        bool resolveJobPath(const std::string& path, bool existing, std::string* resolved, std::string* error) const;
+        std::string handleRequest(int fd, const std::string& request, bool* keepOpen);
+        void runJobs();
+        void runJob(Job& job);
+        WarmScene* getScene(const std::string& filename, double* loadTime);
+        static bool reply(Job& job, const std::string& line);
+
+    public:
+        explicit RenderServer(PathTracer* pathtracer);
+        // applied to every scene after loading, e.g. light sampling and integrator
+        void setScenePreparation(std::function<void(Scene*, const RenderSettings&)> prepare) { prepareScene = std::move(prepare); }
+        void setGamma(float value) { gamma = value; }
+        // directory that job scenes and outputs must lie in, the working
+        // directory by default; false if it does not exist
+        bool setRoot(const std::string& directory);
+        // keeps a scene warm under its file name, "" for one without a file; the
+        // scene must be prepared already, and the first one added is used by
+        // jobs that do not name one
+        void addScene(const std::string& filename, std::unique_ptr<Scene> scene, const RenderSettings& settings);
+        // serves requests on the address until a client sends shutdown
+        bool run(const std::string& address);
+};
+
+// sends one request line to a render server and prints every line of the
+// answer, true if it ended in done or was not a render request
+bool sendServerRequest(const std::string& address, const std::string& request);
+
+#endif
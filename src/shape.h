@@ -1,34 +1,340 @@
-#ifndef SHAPE_H
-#define SHAPE_H
-
-#include <glm/glm.hpp>
-#include "ray.h"
-#include "hit.h"
-
-class Shape
-{
-    public:
-        virtual ~Shape() = default;
-        virtual bool intersect(const Ray& ray, Hit* hit) const = 0;
-};
-
-class Sphere : public Shape
-{
-    private:
-        glm::vec3 center;
-        float radius;
-    public:
-        Sphere(const glm::vec3& center, float radius);
-        bool intersect(const Ray& ray, Hit* hit) const override;
-};
-
-class Box : public Shape
-{
-    private:
-        glm::vec3 bMin;
-        glm::vec3 bMax;
-    public:
-        Box(const glm::vec3& bMin, const glm::vec3& bMax);
-        bool intersect(const Ray& ray, Hit* hit) const override;
-};
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <limits>
+#include "ray.h"
+#include "hit.h"
+#include "bounds.h"
+#include "packet.h"
+#include "stats.h"
+#include "hash.h"
+
+struct WideKernels;
+
+class Shape
+{
+    public:
+        // hits closer than this are ignored to avoid self intersection
+        static constexpr float epsilon = 1e-4f;
+
+        virtual ~Shape() = default;
+        // fills hit and returns true only for intersections in (EPSILON, tMax)
+        virtual bool intersect(const Ray& ray, float tMax, Hit* hit) const = 0;
+        // true if the shape is hit anywhere in (EPSILON, tMax)
+        virtual bool occluded(const Ray& ray, float tMax) const = 0;
+        virtual AABB getBounds() const = 0;
+        // adds what the shape looks like to hasher, spheres and boxes are
+        // given by their bounds
+        virtual void hash(Hasher& hasher) const { hasher.add(getBounds()); }
+
+        // Packet versions of intersect and occluded for the lanes in laneMask,
+        // each with its own tMax. intersectPacket returns the lanes whose hit
+        // record was filled, occludedPacket the lanes blocked. Directions are
+        // taken as they are, like Ray::unnormalized. The defaults test the
+        // lanes one at a time, spheres and boxes use the packet kernels.
+        virtual uint32_t intersectPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax, Hit* hits,
+                                         const WideKernels& kernels) const;
+        virtual uint32_t occludedPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax,
+                                        const WideKernels& kernels) const;
+};
+
+class Sphere : public Shape
+{
+    private:
+        glm::vec3 center;
+        float radius;
+
+    public:
+        Sphere(const glm::vec3& center, float radius);
+        bool intersect(const Ray& ray, float tMax, Hit* hit) const override { return intersectSphere(center, radius, ray, tMax, hit); }
+        bool occluded(const Ray& ray, float tMax) const override { return occludedSphere(center, radius, ray, tMax); }
+        uint32_t intersectPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax, Hit* hits,
+                                 const WideKernels& kernels) const override;
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax,
+                                const WideKernels& kernels) const override;
+        AABB getBounds() const override { return AABB(center - glm::vec3(radius), center + glm::vec3(radius)); }
+        const glm::vec3& getCenter() const { return center; }
+        float getRadius() const { return radius; }
+
+        // the tests on plain values, shared with the arrays of CompiledScene
+        static bool intersectSphere(const glm::vec3& center, float radius, const Ray& ray, float tMax, Hit* hit);
+        static bool occludedSphere(const glm::vec3& center, float radius, const Ray& ray, float tMax);
+        // fills hit for a t found by either test
+        static void setHit(const glm::vec3& center, float radius, const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float t, bool backface, Hit* hit);
+};
+
+class Box : public Shape
+{
+    private:
+        glm::vec3 bMin;
+        glm::vec3 bMax;
+
+        static bool intersectSlabs(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float* t_enter, float* t_exit);
+    public:
+        Box(const glm::vec3& bMin, const glm::vec3& bMax);
+        bool intersect(const Ray& ray, float tMax, Hit* hit) const override { return intersectBox(bMin, bMax, ray, tMax, hit); }
+        bool occluded(const Ray& ray, float tMax) const override { return occludedBox(bMin, bMax, ray, tMax); }
+        uint32_t intersectPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax, Hit* hits,
+                                 const WideKernels& kernels) const override;
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t laneMask, const float* tMax,
+                                const WideKernels& kernels) const override;
+        AABB getBounds() const override { return AABB(bMin, bMax); }
+        const glm::vec3& getMin() const { return bMin; }
+        const glm::vec3& getMax() const { return bMax; }
+
+        // the tests on plain values, shared with the arrays of CompiledScene
+        static bool intersectBox(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float tMax, Hit* hit);
+        static bool occludedBox(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float tMax);
+        // fills hit for a t found by either test
+        static void setHit(const glm::vec3& bMin, const glm::vec3& bMax, const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float t_final, bool inside, Hit* hit);
+};
+
+inline bool Sphere::intersectSphere(const glm::vec3& center, float radius, const Ray& ray, float tMax, Hit* hit)
+{
+    PT_STAT_ADD(StatSphereTests, 1);
+    const glm::vec3& rayDirection = ray.getRayDirection();
+    const glm::vec3& rayOrigin = ray.getRayOrigin();
+    glm::vec3 rayCenterDistance = rayOrigin - center;
+
+    float a = glm::dot(rayDirection, rayDirection);
+    float b = 2.0f * glm::dot(rayDirection, rayCenterDistance);
+    float c = glm::dot(rayCenterDistance, rayCenterDistance) - radius * radius;
+
+    float delta = b*b - 4*a*c;
+    if(delta < 0) // no intersection
+    {
+        return false;
+    }
+
+    float t1 = (-b - std::sqrt(delta))/(2*a);
+    float t2 = (-b + std::sqrt(delta))/(2*a);
+
+    float t;
+    if (t1 >= epsilon) // avoiding auto intersection
+    {
+        t = t1;
+    }
+    else if (t2 >= epsilon)
+    {
+        t = t2;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (t >= tMax) // something closer was already found
+    {
+        return false;
+    }
+    
+    setHit(center, radius, rayOrigin, rayDirection, t, t1 < 0 || t2 < 0, hit);
+    return true;
+}
+
+inline void Sphere::setHit(const glm::vec3& center, float radius, const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float t, bool backface, Hit* hit)
+{
+    hit->t = t;
+    hit->position = rayOrigin + t * rayDirection;      
+
+    glm::vec3 normal = (hit->position - center) / radius; // normalizing
+    if (backface)
+    {
+        hit->normal = -normal;
+        hit->backface = true;
+    }
+    else
+    {
+        hit->normal = normal;
+        hit->backface = false;
+    }
+}
+
+inline bool Sphere::occludedSphere(const glm::vec3& center, float radius, const Ray& ray, float tMax)
+{
+    PT_STAT_ADD(StatSphereTests, 1);
+    const glm::vec3& rayDirection = ray.getRayDirection();
+    glm::vec3 rayCenterDistance = ray.getRayOrigin() - center;
+
+    float a = glm::dot(rayDirection, rayDirection);
+    float b = 2.0f * glm::dot(rayDirection, rayCenterDistance);
+    float c = glm::dot(rayCenterDistance, rayCenterDistance) - radius * radius;
+
+    float delta = b*b - 4*a*c;
+    if(delta < 0)
+    {
+        return false;
+    }
+
+    // same root selection as intersect(), without filling a hit record
+    float t1 = (-b - std::sqrt(delta))/(2*a);
+    float t2 = (-b + std::sqrt(delta))/(2*a);
+    float t = t1 >= epsilon ? t1 : t2;
+    return t >= epsilon && t < tMax;
+}
+
+inline bool Box::intersectSlabs(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float* t_enter, float* t_exit)
+{
+    const glm::vec3& rayOrigin = ray.getRayOrigin();
+    const glm::vec3& rayDirection = ray.getRayDirection();
+
+    glm::vec3 invRayDirection;
+    float t_near_slabs[3];
+    float t_far_slabs[3];
+
+    // X slab
+    if (rayDirection.x == 0.0f) 
+    { // Ray parallel to X-axis
+        if (rayOrigin.x < bMin.x || rayOrigin.x > bMax.x) return false; // Misses if origin outside slab
+        t_near_slabs[0] = -std::numeric_limits<float>::infinity();
+        t_far_slabs[0] = std::numeric_limits<float>::infinity();
+    } 
+    else 
+    {
+        invRayDirection.x = 1.0f / rayDirection.x;
+        float t0_x = (bMin.x - rayOrigin.x) * invRayDirection.x;
+        float t1_x = (bMax.x - rayOrigin.x) * invRayDirection.x;
+        t_near_slabs[0] = glm::min(t0_x, t1_x);
+        t_far_slabs[0] = glm::max(t0_x, t1_x);
+    }
+
+    // Y slab
+    if (rayDirection.y == 0.0f) 
+    { // Ray parallel to Y-axis
+        if (rayOrigin.y < bMin.y || rayOrigin.y > bMax.y) return false; // Misses if origin outside slab
+        t_near_slabs[1] = -std::numeric_limits<float>::infinity();
+        t_far_slabs[1] = std::numeric_limits<float>::infinity();
+    } 
+    else 
+    {
+        invRayDirection.y = 1.0f / rayDirection.y;
+        float t0_y = (bMin.y - rayOrigin.y) * invRayDirection.y;
+        float t1_y = (bMax.y - rayOrigin.y) * invRayDirection.y;
+        t_near_slabs[1] = glm::min(t0_y, t1_y);
+        t_far_slabs[1] = glm::max(t0_y, t1_y);
+    }
+
+    // Z slab
+    if (rayDirection.z == 0.0f) 
+    { // Ray parallel to Z-axis
+        if (rayOrigin.z < bMin.z || rayOrigin.z > bMax.z) return false; // Misses if origin outside slab
+        t_near_slabs[2] = -std::numeric_limits<float>::infinity();
+        t_far_slabs[2] = std::numeric_limits<float>::infinity();
+    } 
+    else 
+    {
+        invRayDirection.z = 1.0f / rayDirection.z;
+        float t0_z = (bMin.z - rayOrigin.z) * invRayDirection.z;
+        float t1_z = (bMax.z - rayOrigin.z) * invRayDirection.z;
+        t_near_slabs[2] = glm::min(t0_z, t1_z);
+        t_far_slabs[2] = glm::max(t0_z, t1_z);
+    }
+
+    *t_enter = glm::max(glm::max(t_near_slabs[0], t_near_slabs[1]), t_near_slabs[2]);
+    *t_exit = glm::min(glm::min(t_far_slabs[0], t_far_slabs[1]), t_far_slabs[2]);
+    return true;
+}
+
+inline bool Box::intersectBox(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float tMax, Hit* hit)
+{
+    PT_STAT_ADD(StatBoxTests, 1);
+    const glm::vec3& rayOrigin = ray.getRayOrigin();
+    const glm::vec3& rayDirection = ray.getRayDirection();
+
+    float t_enter, t_exit;
+    if (!intersectSlabs(bMin, bMax, ray, &t_enter, &t_exit))
+    {
+        return false;
+    }
+
+    if (t_enter > t_exit || t_exit < epsilon) 
+    {
+        return false; // Misses the box or intersection is behind/too close
+    }
+
+    float t_final = t_enter;
+    bool ray_starts_inside = false;
+
+    if (t_enter < epsilon) 
+    { // Ray origin is inside the box or on its entry surface
+        if (t_exit < epsilon)
+        { 
+            return false; // Entire intersection (entry and exit) is behind/too close
+        }
+        t_final = t_exit;    // Use the exit point as the intersection
+        ray_starts_inside = true;
+    }
+
+    if (t_final > epsilon && t_final < tMax) 
+    {
+        setHit(bMin, bMax, rayOrigin, rayDirection, t_final, ray_starts_inside, hit);
+        
+        return true;
+    }
+
+    return false;
+}
+
+inline void Box::setHit(const glm::vec3& bMin, const glm::vec3& bMax, const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float t_final, bool inside, Hit* hit)
+{
+    hit->t = t_final;
+    hit->position = rayOrigin + t_final * rayDirection;
+
+    glm::vec3 p = hit->position;
+    glm::vec3 outNormal(0.0f);
+    const float norm_epsilon = 1e-4f; // Tolerance for comparing point to face
+
+    if(std::abs(p.x - bMin.x) < norm_epsilon)
+    { 
+        outNormal = glm::vec3(-1.0f, 0.0f, 0.0f);
+    }
+    else if(std::abs(p.x - bMax.x) < norm_epsilon)
+    {
+        outNormal = glm::vec3(1.0f, 0.0f, 0.0f);
+    }
+    else if(std::abs(p.y - bMin.y) < norm_epsilon)
+    {
+        outNormal = glm::vec3(0.0f, -1.0f, 0.0f);
+    }
+    else if(std::abs(p.y - bMax.y) < norm_epsilon){
+        outNormal = glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+    else if(std::abs(p.z - bMin.z) < norm_epsilon)
+    {
+        outNormal = glm::vec3(0.0f, 0.0f, -1.0f);
+    }
+    else if(std::abs(p.z - bMax.z) < norm_epsilon)
+    {
+        outNormal = glm::vec3(0.0f, 0.0f, 1.0f);
+    }
+
+    // Apply the consistent normal and backface setup discussed previously:
+    glm::vec3 normal = glm::normalize(outNormal); // Ensure normalized if not already unit
+
+    if (inside) 
+    {
+        hit->backface = true; 
+        hit->normal = -normal;
+    } 
+    else 
+    {
+        hit->backface = false; 
+        hit->normal = normal;
+    }
+}
+
+inline bool Box::occludedBox(const glm::vec3& bMin, const glm::vec3& bMax, const Ray& ray, float tMax)
+{
+    PT_STAT_ADD(StatBoxTests, 1);
+    float t_enter, t_exit;
+    if (!intersectSlabs(bMin, bMax, ray, &t_enter, &t_exit) || t_enter > t_exit || t_exit < epsilon)
+    {
+        return false;
+    }
+
+    float t_final = t_enter < epsilon ? t_exit : t_enter;
+    return t_final > epsilon && t_final < tMax;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+#include "stats.h"
+#include <iostream>
+
+#ifdef PT_STATS
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+thread_local ThreadStats threadStats;
+
+namespace
+{
+    const char* counterNames[StatCounterCount] = {
+        "primary_rays", "bounce_rays", "shadow_rays", "shadow_rays_occluded",
+        "sphere_tests", "box_tests", "mesh_tests", "triangle_tests", "paths", "path_vertices",
+        "roulette_terminations"
+    };
+
+    std::mutex registryMutex;
+    std::vector<ThreadStats*> registry;
+    // counters of threads that exited since the last reset
+    ThreadStats retired;
+    uint64_t startTicks;
+    std::chrono::steady_clock::time_point startTime;
+
+    // hands the counters of an exiting thread over to retired
+    struct ThreadStatsGuard
+    {
+        ~ThreadStatsGuard()
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            for (int c = 0; c < StatCounterCount; c++)
+            {
+                retired.counters[c] += threadStats.counters[c];
+            }
+            for (int d = 0; d < statDepthBins; d++)
+            {
+                retired.pathDepths[d] += threadStats.pathDepths[d];
+            }
+            retired.workTicks += threadStats.workTicks;
+            retired.intersectTicks += threadStats.intersectTicks;
+            registry.erase(std::remove(registry.begin(), registry.end(), &threadStats), registry.end());
+        }
+    };
+    thread_local ThreadStatsGuard threadStatsGuard;
+
+    struct Summary
+    {
+        uint64_t counters[StatCounterCount];
+        uint64_t pathDepths[statDepthBins];
+        // one past the deepest non empty bin
+        int depthBins;
+        double ticksPerSecond;
+        // work and intersection seconds of every thread that rendered
+        std::vector<double> workSeconds;
+        std::vector<double> intersectSeconds;
+    };
+
+    Summary summarize()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        Summary summary;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        summary.ticksPerSecond = (statTicks() - startTicks) / std::max(elapsed.count(), 1e-9);
+
+        std::copy(retired.counters, retired.counters + StatCounterCount, summary.counters);
+        std::copy(retired.pathDepths, retired.pathDepths + statDepthBins, summary.pathDepths);
+        for (const ThreadStats* stats : registry)
+        {
+            for (int c = 0; c < StatCounterCount; c++)
+            {
+                summary.counters[c] += stats->counters[c];
+            }
+            for (int d = 0; d < statDepthBins; d++)
+            {
+                summary.pathDepths[d] += stats->pathDepths[d];
+            }
+            if (stats->workTicks > 0)
+            {
+                summary.workSeconds.push_back(stats->workTicks / summary.ticksPerSecond);
+                summary.intersectSeconds.push_back(stats->intersectTicks / summary.ticksPerSecond);
+            }
+        }
+        summary.depthBins = statDepthBins;
+        while (summary.depthBins > 0 && summary.pathDepths[summary.depthBins - 1] == 0)
+        {
+            summary.depthBins--;
+        }
+        return summary;
+    }
+
+    double ratio(uint64_t a, uint64_t b)
+    {
+        return b > 0 ? static_cast<double>(a) / b : 0.0;
+    }
+}
+
+void registerThreadStats()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    // touching the guard makes it run on thread exit
+    (void)&threadStatsGuard;
+    threadStats.registered = true;
+    registry.push_back(&threadStats);
+}
+
+void Stats::reset()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (ThreadStats* stats : registry)
+    {
+        std::memset(stats->counters, 0, sizeof(stats->counters));
+        std::memset(stats->pathDepths, 0, sizeof(stats->pathDepths));
+        stats->workTicks = 0;
+        stats->intersectTicks = 0;
+        stats->sampledScopes = 0;
+    }
+    std::memset(static_cast<void*>(&retired), 0, sizeof(retired));
+    startTicks = statTicks();
+    startTime = std::chrono::steady_clock::now();
+}
+
+void Stats::report(std::ostream& out)
+{
+    Summary s = summarize();
+    const uint64_t* c = s.counters;
+    out << "Render statistics:" << std::endl;
+    out << "  primary rays: " << c[StatPrimaryRays] << ", bounce rays: " << c[StatBounceRays]
+        << ", shadow rays: " << c[StatShadowRays] << " (" << 100.0 * ratio(c[StatShadowRaysOccluded], c[StatShadowRays])
+        << "% occluded)" << std::endl;
+    out << "  intersection tests: " << c[StatSphereTests] << " sphere, " << c[StatBoxTests] << " box, "
+        << c[StatMeshTests] << " mesh (" << c[StatTriangleTests] << " triangles)" << std::endl;
+    out << "  paths: " << c[StatPaths] << ", average depth " << ratio(c[StatPathVertices], c[StatPaths])
+        << ", " << c[StatRouletteTerminations] << " ended by Russian roulette" << std::endl;
+    if (s.depthBins > 0)
+    {
+        out << "  paths by depth:";
+        const char* separator = " ";
+        for (int d = 0; d < s.depthBins; d++)
+        {
+            if (s.pathDepths[d] > 0)
+            {
+                out << separator << d << (d == statDepthBins - 1 ? "+" : "") << ": "
+                    << 100.0 * ratio(s.pathDepths[d], c[StatPaths]) << "%";
+                separator = ", ";
+            }
+        }
+        out << std::endl;
+    }
+    for (size_t t = 0; t < s.workSeconds.size(); t++)
+    {
+        double intersect = s.intersectSeconds[t];
+        double work = s.workSeconds[t];
+        out << "  thread " << t << ": " << work << "s rendering, " << intersect << "s intersecting ("
+            << 100.0 * intersect / work << "%), " << work - intersect << "s shading" << std::endl;
+    }
+}
+
+bool Stats::writeJSON(const std::string& filename)
+{
+    std::ofstream file(filename);
+    if (!file)
+    {
+        std::cerr << "Failed to open file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    Summary s = summarize();
+    file << "{\n";
+    for (int c = 0; c < StatCounterCount; c++)
+    {
+        file << "  \"" << counterNames[c] << "\": " << s.counters[c] << ",\n";
+    }
+    file << "  \"shadow_occlusion_ratio\": " << ratio(s.counters[StatShadowRaysOccluded], s.counters[StatShadowRays]) << ",\n";
+    file << "  \"average_path_depth\": " << ratio(s.counters[StatPathVertices], s.counters[StatPaths]) << ",\n";
+    file << "  \"path_depths\": [";
+    for (int d = 0; d < s.depthBins; d++)
+    {
+        file << (d > 0 ? ", " : "") << s.pathDepths[d];
+    }
+    file << "],\n";
+    file << "  \"threads\": [\n";
+    for (size_t t = 0; t < s.workSeconds.size(); t++)
+    {
+        file << "    {\"render_seconds\": " << s.workSeconds[t] << ", \"intersect_seconds\": " << s.intersectSeconds[t]
+             << ", \"shading_seconds\": " << s.workSeconds[t] - s.intersectSeconds[t] << "}"
+             << (t + 1 < s.workSeconds.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+    return static_cast<bool>(file);
+}
+
+#else
+
+void Stats::reset() {}
+
+void Stats::report(std::ostream&) {}
+
+bool Stats::writeJSON(const std::string& filename)
+{
+    std::cerr << "Cannot write " << filename << ", statistics need a build with make STATS=1" << std::endl;
+    return false;
+}
+
+#endif
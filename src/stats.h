@@ -0,0 +1,133 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#ifdef PT_STATS
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Render statistics. The counters are only compiled in when building with
+// -DPT_STATS (make STATS=1); otherwise the PT_STAT macros expand to nothing
+// and the Stats functions have nothing to report.
+enum StatCounter
+{
+    StatPrimaryRays,
+    StatBounceRays,
+    StatShadowRays,
+    StatShadowRaysOccluded,
+    StatSphereTests,
+    StatBoxTests,
+    StatMeshTests,
+    StatTriangleTests,
+    StatPaths,
+    // surfaces hit along all paths, the sum of their depths
+    StatPathVertices,
+    StatRouletteTerminations,
+    StatCounterCount
+};
+
+const int statDepthBins = 65;
+
+// Counters of one thread, written by that thread only and merged on report
+struct ThreadStats
+{
+    uint64_t counters[StatCounterCount];
+    // paths by the number of surfaces they hit, the last bin holds all deeper ones
+    uint64_t pathDepths[statDepthBins];
+    // ticks spent rendering tiles and, out of those, in intersection queries
+    uint64_t workTicks;
+    uint64_t intersectTicks;
+    uint64_t sampledScopes;
+    bool registered;
+};
+
+namespace Stats
+{
+#ifdef PT_STATS
+    constexpr bool enabled = true;
+#else
+    constexpr bool enabled = false;
+#endif
+
+    // clears the counters of every thread, call while no thread is rendering
+    void reset();
+    // prints the counters merged over all threads since the last reset
+    void report(std::ostream& out);
+    bool writeJSON(const std::string& filename);
+}
+
+#ifdef PT_STATS
+extern thread_local ThreadStats threadStats;
+void registerThreadStats();
+
+inline ThreadStats& localStats()
+{
+    if (!threadStats.registered)
+    {
+        registerThreadStats();
+    }
+    return threadStats;
+}
+
+inline uint64_t statTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// adds the ticks spent in its scope to one of the ThreadStats timers
+class StatTimer
+{
+    private:
+        uint64_t ThreadStats::* field;
+        uint64_t start;
+
+    public:
+        explicit StatTimer(uint64_t ThreadStats::* field) : field(field), start(statTicks()) {}
+        ~StatTimer() { localStats().*field += statTicks() - start; }
+};
+
+// Reading the clock costs about as much as a shadow ray, so scopes entered
+// millions of times only time every statTimerPeriod-th entry and weight it
+// by the period.
+const uint64_t statTimerPeriod = 32;
+
+class SampledStatTimer
+{
+    private:
+        uint64_t ThreadStats::* field;
+        // 0 when this entry is not timed
+        uint64_t start;
+
+    public:
+        explicit SampledStatTimer(uint64_t ThreadStats::* field)
+            : field(field), start(++localStats().sampledScopes % statTimerPeriod == 0 ? statTicks() : 0) {}
+        ~SampledStatTimer()
+        {
+            if (start != 0)
+            {
+                localStats().*field += (statTicks() - start) * statTimerPeriod;
+            }
+        }
+};
+
+#define PT_STAT_ADD(counter, n) (localStats().counters[counter] += (n))
+#define PT_STAT_DEPTH(depth, n) (localStats().pathDepths[(depth) < statDepthBins ? (depth) : statDepthBins - 1] += (n))
+#define PT_STAT_TIMER(field) StatTimer statTimer(&ThreadStats::field)
+#define PT_STAT_SAMPLED_TIMER(field) SampledStatTimer statTimer(&ThreadStats::field)
+#else
+#define PT_STAT_ADD(counter, n) ((void)(n))
+#define PT_STAT_DEPTH(depth, n) ((void)(depth), (void)(n))
+#define PT_STAT_TIMER(field) ((void)0)
+#define PT_STAT_SAMPLED_TIMER(field) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int numThreads)
+    : job(nullptr), generation(0), activeWorkers(0), stopping(false)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = defaultThreadCount();
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+
+    // thread 0 is the caller of parallelFor
+    for (int i = 1; i < numThreads; i++)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+int ThreadPool::defaultThreadCount()
+{
+    unsigned int count = std::thread::hardware_concurrency();
+    return count > 0 ? static_cast<int>(count) : 1;
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int task, int thread)>& fn)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+
+    // seed every queue with a contiguous slice so neighbouring tasks stay on one thread
+    int numQueues = getThreadCount();
+    for (int q = 0; q < numQueues; q++)
+    {
+        int begin = static_cast<int>(static_cast<int64_t>(count) * q / numQueues);
+        int end = static_cast<int>(static_cast<int64_t>(count) * (q + 1) / numQueues);
+
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        for (int task = begin; task < end; task++)
+        {
+            queues[q]->tasks.push_back(task);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        activeWorkers = static_cast<int>(workers.size());
+        generation++;
+    }
+    wakeCondition.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return activeWorkers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop(int workerIndex)
+{
+    uint64_t seenGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeCondition.wait(lock, [&] { return stopping || generation != seenGeneration; });
+            if (stopping)
+            {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        runTasks(workerIndex);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--activeWorkers == 0)
+            {
+                doneCondition.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::runTasks(int workerIndex)
+{
+    int task;
+    while (popTask(workerIndex, task) || stealTask(workerIndex, task))
+    {
+        (*job)(task, workerIndex);
+    }
+}
+
+bool ThreadPool::popTask(int workerIndex, int& task)
+{
+    WorkQueue& queue = *queues[workerIndex];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+    {
+        return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+bool ThreadPool::stealTask(int workerIndex, int& task)
+{
+    // take from the far end of the victim's queue, away from where its owner is working
+    int numQueues = getThreadCount();
+    for (int i = 1; i < numQueues; i++)
+    {
+        WorkQueue& victim = *queues[(workerIndex + i) % numQueues];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
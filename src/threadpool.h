@@ -0,0 +1,57 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. Work is submitted as a range of task
+// indices; every worker owns a deque seeded with a contiguous slice of the
+// range and steals from the other deques once its own runs dry.
+class ThreadPool
+{
+    private:
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::deque<int> tasks;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        std::mutex mutex;
+        std::condition_variable wakeCondition;
+        std::condition_variable doneCondition;
+        const std::function<void(int, int)>* job;
+        uint64_t generation;
+        int activeWorkers;
+        bool stopping;
+
+        void workerLoop(int workerIndex);
+        void runTasks(int workerIndex);
+        bool popTask(int workerIndex, int& task);
+        bool stealTask(int workerIndex, int& task);
+
+    public:
+        // numThreads <= 0 selects the hardware concurrency
+        explicit ThreadPool(int numThreads = 0);
+        ~ThreadPool();
+
+        // Prevent copying
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int getThreadCount() const { return static_cast<int>(queues.size()); }
+
+        // Runs fn(task, thread) for every task in [0, count) and blocks until all
+        // of them finished. The calling thread takes part as thread 0.
+        void parallelFor(int count, const std::function<void(int task, int thread)>& fn);
+
+        static int defaultThreadCount();
+};
+#endif
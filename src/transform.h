@@ -4,75 +4,178 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
+#include <cstdint>
+#include "packet.h"
 
-class Transform 
+// Affine transform kept as its upper 3x4 part, a linear map plus a
+// translation, together with its inverse. The kind tells callers when they
+// can skip the matrix work: most instances are not transformed at all or
+// only moved.
+class Transform
 {
+public:
+    enum class Kind : uint8_t { Identity, Translation, Affine };
+
 private:
-    glm::mat4 transformMatrix;
-    glm::mat4 inverseMatrix;
-    glm::mat3 normalMatrix;
+    glm::mat3 linear;
+    glm::vec3 translation;
+    glm::mat3 inverseLinear;
+    glm::vec3 inverseTranslation;
+    Kind kind;
+
+    // takes the affine part of matrix and derives the inverse from it
+    void set(const glm::mat4& matrix)
+    {
+        linear = glm::mat3(matrix);
+        translation = glm::vec3(matrix[3]);
+        inverseLinear = glm::inverse(linear);
+        inverseTranslation = -(inverseLinear * translation);
+        updateKind();
+    }
+
+    void updateKind()
+    {
+        if (linear != glm::mat3(1.0f))
+        {
+            kind = Kind::Affine;
+        }
+        else
+        {
+            kind = translation == glm::vec3(0.0f) ? Kind::Identity : Kind::Translation;
+        }
+    }
 
 public:
-    Transform() : transformMatrix(1.0f), inverseMatrix(1.0f), normalMatrix(1.0f) {}
+    Transform() { setIdentity(); }
+
+    void setIdentity()
+    {
+        linear = glm::mat3(1.0f);
+        translation = glm::vec3(0.0f);
+        inverseLinear = glm::mat3(1.0f);
+        inverseTranslation = glm::vec3(0.0f);
+        kind = Kind::Identity;
+    }
 
-    void setIdentity() 
+    // sets a matrix whose inverse is already known
+    void setMatrix(const glm::mat4& matrix, const glm::mat4& inverse)
     {
-        transformMatrix = glm::mat4(1.0f);
-        inverseMatrix = glm::mat4(1.0f);
-        normalMatrix = glm::mat3(1.0f);
+        linear = glm::mat3(matrix);
+        translation = glm::vec3(matrix[3]);
+        inverseLinear = glm::mat3(inverse);
+        inverseTranslation = glm::vec3(inverse[3]);
+        updateKind();
     }
 
-    void translate(const glm::vec3& translation) 
+    void translate(const glm::vec3& offset)
+    {
+        set(glm::translate(getMatrix(), offset));
+    }
+
+    void scale(const glm::vec3& factors)
+    {
+        set(glm::scale(getMatrix(), factors));
+    }
+
+    void rotate(float angle, const glm::vec3& axis)
+    {
+        set(glm::rotate(getMatrix(), glm::radians(angle), axis));
+    }
+
+    Kind getKind() const { return kind; }
+    bool isIdentity() const { return kind == Kind::Identity; }
+
+    glm::vec3 transformPoint(const glm::vec3& point) const
     {
-        transformMatrix = glm::translate(transformMatrix, translation);
-        inverseMatrix = glm::inverse(transformMatrix);
-        normalMatrix = glm::mat3(glm::transpose(inverseMatrix));
+        switch (kind)
+        {
+            case Kind::Identity:    return point;
+            case Kind::Translation: return point + translation;
+            default:                return linear * point + translation;
+        }
     }
 
-    void scale(const glm::vec3& scale) 
+    glm::vec3 transformVector(const glm::vec3& vector) const
     {
-        transformMatrix = glm::scale(transformMatrix, scale);
-        inverseMatrix = glm::inverse(transformMatrix);
-        normalMatrix = glm::mat3(glm::transpose(inverseMatrix));
+        return kind == Kind::Affine ? linear * vector : vector;
     }
 
-    void rotate(float angle, const glm::vec3& axis) 
+    // normals go through the inverse transpose, v * M is transpose(M) * v
+    glm::vec3 transformNormal(const glm::vec3& normal) const
     {
-        transformMatrix = glm::rotate(transformMatrix, glm::radians(angle), axis);
-        inverseMatrix = glm::inverse(transformMatrix);
-        normalMatrix = glm::mat3(glm::transpose(inverseMatrix));
+        return kind == Kind::Affine ? glm::normalize(normal * inverseLinear) : normal;
     }
 
-    glm::vec3 transformPoint(const glm::vec3& point) const 
+    glm::vec3 inverseTransformPoint(const glm::vec3& point) const
     {
-        glm::vec4 transformed = transformMatrix * glm::vec4(point, 1.0f);
-        return glm::vec3(transformed) / transformed.w;
+        switch (kind)
+        {
+            case Kind::Identity:    return point;
+            case Kind::Translation: return point + inverseTranslation;
+            default:                return inverseLinear * point + inverseTranslation;
+        }
     }
 
-    glm::vec3 transformVector(const glm::vec3& vector) const 
+    // not normalized, so a parameter t along it means the same in both spaces
+    glm::vec3 inverseTransformVector(const glm::vec3& vector) const
     {
-        return glm::vec3(transformMatrix * glm::vec4(vector, 0.0f));
+        return kind == Kind::Affine ? inverseLinear * vector : vector;
     }
 
-    glm::vec3 transformNormal(const glm::vec3& normal) const 
+    // all lanes of packet at once, what inverseTransformPoint and
+    // inverseTransformVector do to one ray
+    void inverseTransformPacket(const RayPacket& packet, RayPacket* local) const
     {
-        return glm::normalize(normalMatrix * normal);
+        const glm::mat3& m = inverseLinear;
+        const glm::vec3& offset = inverseTranslation;
+        bool affine = kind == Kind::Affine;
+        local->activeMask = packet.activeMask;
+        for (int k = 0; k < PacketSize; k++)
+        {
+            float ox = packet.originX[k];
+            float oy = packet.originY[k];
+            float oz = packet.originZ[k];
+            float dx = packet.directionX[k];
+            float dy = packet.directionY[k];
+            float dz = packet.directionZ[k];
+            if (affine)
+            {
+                local->originX[k] = m[0][0] * ox + m[1][0] * oy + m[2][0] * oz + offset.x;
+                local->originY[k] = m[0][1] * ox + m[1][1] * oy + m[2][1] * oz + offset.y;
+                local->originZ[k] = m[0][2] * ox + m[1][2] * oy + m[2][2] * oz + offset.z;
+                local->directionX[k] = m[0][0] * dx + m[1][0] * dy + m[2][0] * dz;
+                local->directionY[k] = m[0][1] * dx + m[1][1] * dy + m[2][1] * dz;
+                local->directionZ[k] = m[0][2] * dx + m[1][2] * dy + m[2][2] * dz;
+            }
+            else
+            {
+                local->originX[k] = ox + offset.x;
+                local->originY[k] = oy + offset.y;
+                local->originZ[k] = oz + offset.z;
+                local->directionX[k] = dx;
+                local->directionY[k] = dy;
+                local->directionZ[k] = dz;
+            }
+        }
     }
 
-    glm::vec3 inverseTransformPoint(const glm::vec3& point) const 
+    glm::mat4 getMatrix() const
     {
-        glm::vec4 transformed = inverseMatrix * glm::vec4(point, 1.0f);
-        return glm::vec3(transformed) / transformed.w;
+        glm::mat4 matrix(linear);
+        matrix[3] = glm::vec4(translation, 1.0f);
+        return matrix;
     }
 
-    glm::vec3 inverseTransformVector(const glm::vec3& vector) const 
+    glm::mat4 getInverseMatrix() const
     {
-        return glm::vec3(inverseMatrix * glm::vec4(vector, 0.0f));
+        glm::mat4 matrix(inverseLinear);
+        matrix[3] = glm::vec4(inverseTranslation, 1.0f);
+        return matrix;
     }
 
-    const glm::mat4& getMatrix() const { return transformMatrix; }
-    const glm::mat4& getInverseMatrix() const { return inverseMatrix; }
-    const glm::mat3& getNormalMatrix() const { return normalMatrix; }
+    glm::mat3 getNormalMatrix() const { return glm::transpose(inverseLinear); }
+    const glm::mat3& getInverseLinear() const { return inverseLinear; }
+    const glm::vec3& getInverseTranslation() const { return inverseTranslation; }
 };
 
-#endif // TRANSFORM_H 
\ No newline at end of file
+#endif // TRANSFORM_H
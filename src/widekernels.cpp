@@ -0,0 +1,776 @@
+#include "widekernels.h"
+#include "shape.h"
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PT_WIDE_X86
+#include <immintrin.h>
+#endif
+
+WideRay::WideRay(const Ray& ray)
+    : origin(ray.getRayOrigin()), direction(ray.getRayDirection())
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        parallel[axis] = direction[axis] == 0.0f;
+    }
+}
+
+// Every kernel writes t and the backface flag of all lanes and returns the
+// mask of lanes hit in (epsilon, tMax); the intersect and occluded entry
+// points only differ in what they make of it. The arithmetic follows the
+// scalar tests operation by operation, so the same t comes out, and there is
+// no fma target so the compiler can't contract it either.
+namespace
+{
+    const float epsilon = Shape::epsilon;
+    const float infinity = std::numeric_limits<float>::infinity();
+
+    uint32_t countMask(int count)
+    {
+        return (1u << count) - 1u;
+    }
+
+    // first lane with the smallest t, the one the scalar loop would keep
+    WideHit closestLane(const float* t, uint32_t hitMask, uint32_t backfaceMask, float tMax)
+    {
+        WideHit hit = { -1, tMax, false };
+        while (hitMask)
+        {
+            int lane = __builtin_ctz(hitMask);
+            hitMask &= hitMask - 1;
+            if (t[lane] < hit.t)
+            {
+                hit.lane = lane;
+                hit.t = t[lane];
+                hit.backface = (backfaceMask >> lane) & 1u;
+            }
+        }
+        return hit;
+    }
+
+    uint32_t spheresScalar(const WideRay& ray, const SphereBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        const glm::vec3& d = ray.direction;
+        float a = d.x*d.x + d.y*d.y + d.z*d.z;
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int k = 0; k < block.count; k++)
+        {
+            float ocx = ray.origin.x - block.centerX[k];
+            float ocy = ray.origin.y - block.centerY[k];
+            float ocz = ray.origin.z - block.centerZ[k];
+            float b = 2.0f * (d.x*ocx + d.y*ocy + d.z*ocz);
+            float c = (ocx*ocx + ocy*ocy + ocz*ocz) - block.radius[k] * block.radius[k];
+            float delta = b*b - 4*a*c;
+            if (delta < 0)
+            {
+                continue;
+            }
+            float t1 = (-b - std::sqrt(delta))/(2*a);
+            float t2 = (-b + std::sqrt(delta))/(2*a);
+            t[k] = t1 >= epsilon ? t1 : t2;
+            if (t[k] >= epsilon && t[k] < tMax)
+            {
+                hitMask |= 1u << k;
+                *backface |= (t1 < 0 || t2 < 0 ? 1u : 0u) << k;
+            }
+        }
+        return hitMask;
+    }
+
+    uint32_t boxesScalar(const WideRay& ray, const BoxBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        const float* mins[3] = { block.minX, block.minY, block.minZ };
+        const float* maxs[3] = { block.maxX, block.maxY, block.maxZ };
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int k = 0; k < block.count; k++)
+        {
+            float tNear[3];
+            float tFar[3];
+            bool miss = false;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float o = ray.origin[axis];
+                if (ray.parallel[axis])
+                {
+                    miss = miss || o < mins[axis][k] || o > maxs[axis][k];
+                    tNear[axis] = -infinity;
+                    tFar[axis] = infinity;
+                    continue;
+                }
+                float invDirection = 1.0f / ray.direction[axis];
+                float t0 = (mins[axis][k] - o) * invDirection;
+                float t1 = (maxs[axis][k] - o) * invDirection;
+                tNear[axis] = glm::min(t0, t1);
+                tFar[axis] = glm::max(t0, t1);
+            }
+            float tEnter = glm::max(glm::max(tNear[0], tNear[1]), tNear[2]);
+            float tExit = glm::min(glm::min(tFar[0], tFar[1]), tFar[2]);
+            if (miss || tEnter > tExit || tExit < epsilon)
+            {
+                continue;
+            }
+            bool inside = tEnter < epsilon;
+            t[k] = inside ? tExit : tEnter;
+            if (t[k] > epsilon && t[k] < tMax)
+            {
+                hitMask |= 1u << k;
+                *backface |= (inside ? 1u : 0u) << k;
+            }
+        }
+        return hitMask;
+    }
+
+    uint32_t packetBoundsScalar(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, const float* invX,
+                                const float* invY, const float* invZ, const float* tMax, uint32_t laneMask, float* tNear)
+    {
+        float tEnter[PacketSize];
+        float tExit[PacketSize];
+        for (int k = 0; k < PacketSize; k++)
+        {
+            float t0x = (bMin.x - packet.originX[k]) * invX[k];
+            float t1x = (bMax.x - packet.originX[k]) * invX[k];
+            float t0y = (bMin.y - packet.originY[k]) * invY[k];
+            float t1y = (bMax.y - packet.originY[k]) * invY[k];
+            float t0z = (bMin.z - packet.originZ[k]) * invZ[k];
+            float t1z = (bMax.z - packet.originZ[k]) * invZ[k];
+            tEnter[k] = glm::max(glm::max(glm::min(t0x, t1x), glm::min(t0y, t1y)), glm::max(glm::min(t0z, t1z), 0.0f));
+            tExit[k] = glm::min(glm::min(glm::max(t0x, t1x), glm::max(t0y, t1y)), glm::min(glm::max(t0z, t1z), tMax[k]));
+        }
+
+        uint32_t mask = 0;
+        float nearest = infinity;
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if ((laneMask & (1u << k)) && tEnter[k] <= tExit[k])
+            {
+                mask |= 1u << k;
+                nearest = glm::min(nearest, tEnter[k]);
+            }
+        }
+        *tNear = nearest;
+        return mask;
+    }
+
+    uint32_t spherePacketScalar(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                                const float* tMax, float* t, uint32_t* backface)
+    {
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if (!(laneMask & (1u << k)))
+            {
+                continue;
+            }
+            float dx = packet.directionX[k];
+            float dy = packet.directionY[k];
+            float dz = packet.directionZ[k];
+            float ocx = packet.originX[k] - center.x;
+            float ocy = packet.originY[k] - center.y;
+            float ocz = packet.originZ[k] - center.z;
+            float a = dx*dx + dy*dy + dz*dz;
+            float b = 2.0f * (dx*ocx + dy*ocy + dz*ocz);
+            float c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius * radius;
+            float delta = b*b - 4*a*c;
+            if (delta < 0)
+            {
+                continue;
+            }
+            float t1 = (-b - std::sqrt(delta))/(2*a);
+            float t2 = (-b + std::sqrt(delta))/(2*a);
+            t[k] = t1 >= epsilon ? t1 : t2;
+            if (t[k] >= epsilon && t[k] < tMax[k])
+            {
+                hitMask |= 1u << k;
+                *backface |= (t1 < 0 || t2 < 0 ? 1u : 0u) << k;
+            }
+        }
+        return hitMask;
+    }
+
+    uint32_t boxPacketScalar(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                             const float* tMax, float* t, uint32_t* inside)
+    {
+        const float* origins[3] = { packet.originX, packet.originY, packet.originZ };
+        const float* directions[3] = { packet.directionX, packet.directionY, packet.directionZ };
+        uint32_t hitMask = 0;
+        *inside = 0;
+        for (int k = 0; k < PacketSize; k++)
+        {
+            if (!(laneMask & (1u << k)))
+            {
+                continue;
+            }
+            float tNear[3];
+            float tFar[3];
+            bool miss = false;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                float o = origins[axis][k];
+                float d = directions[axis][k];
+                if (d == 0.0f)
+                {
+                    miss = miss || o < bMin[axis] || o > bMax[axis];
+                    tNear[axis] = -infinity;
+                    tFar[axis] = infinity;
+                    continue;
+                }
+                float invDirection = 1.0f / d;
+                float t0 = (bMin[axis] - o) * invDirection;
+                float t1 = (bMax[axis] - o) * invDirection;
+                tNear[axis] = glm::min(t0, t1);
+                tFar[axis] = glm::max(t0, t1);
+            }
+            float tEnter = glm::max(glm::max(tNear[0], tNear[1]), tNear[2]);
+            float tExit = glm::min(glm::min(tFar[0], tFar[1]), tFar[2]);
+            if (miss || tEnter > tExit || tExit < epsilon)
+            {
+                continue;
+            }
+            bool startsInside = tEnter < epsilon;
+            t[k] = startsInside ? tExit : tEnter;
+            if (t[k] > epsilon && t[k] < tMax[k])
+            {
+                hitMask |= 1u << k;
+                *inside |= (startsInside ? 1u : 0u) << k;
+            }
+        }
+        return hitMask;
+    }
+
+#ifdef PT_WIDE_X86
+    // SSE2 is part of x86-64, two halves of four lanes cover a block
+    __attribute__((target("sse2")))
+    uint32_t spheresSSE(const WideRay& ray, const SphereBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        const glm::vec3& d = ray.direction;
+        float a = d.x*d.x + d.y*d.y + d.z*d.z;
+        __m128 dx = _mm_set1_ps(d.x);
+        __m128 dy = _mm_set1_ps(d.y);
+        __m128 dz = _mm_set1_ps(d.z);
+        __m128 fourA = _mm_set1_ps(4*a);
+        __m128 twoA = _mm_set1_ps(2*a);
+        __m128 eps = _mm_set1_ps(epsilon);
+        __m128 zero = _mm_setzero_ps();
+        __m128 signBit = _mm_set1_ps(-0.0f);
+
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int half = 0; half < block.count; half += 4)
+        {
+            __m128 ocx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(block.centerX + half));
+            __m128 ocy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(block.centerY + half));
+            __m128 ocz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(block.centerZ + half));
+            __m128 r = _mm_loadu_ps(block.radius + half);
+
+            __m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz)));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+            __m128 delta = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(fourA, c));
+            __m128 root = _mm_sqrt_ps(delta);
+            __m128 negB = _mm_xor_ps(b, signBit);
+            __m128 t1 = _mm_div_ps(_mm_sub_ps(negB, root), twoA);
+            __m128 t2 = _mm_div_ps(_mm_add_ps(negB, root), twoA);
+
+            __m128 useT1 = _mm_cmpge_ps(t1, eps);
+            __m128 tHit = _mm_or_ps(_mm_and_ps(useT1, t1), _mm_andnot_ps(useT1, t2));
+            __m128 valid = _mm_andnot_ps(_mm_cmplt_ps(delta, zero),
+                                         _mm_and_ps(_mm_cmpge_ps(tHit, eps), _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+            __m128 back = _mm_or_ps(_mm_cmplt_ps(t1, zero), _mm_cmplt_ps(t2, zero));
+
+            _mm_storeu_ps(t + half, tHit);
+            hitMask |= static_cast<uint32_t>(_mm_movemask_ps(valid)) << half;
+            *backface |= static_cast<uint32_t>(_mm_movemask_ps(back)) << half;
+        }
+        return hitMask & countMask(block.count);
+    }
+
+    // near and far distance of one slab in the argument order of glm::min/max
+    __attribute__((target("sse2")))
+    void slabSSE(const WideRay& ray, int axis, const float* mins, const float* maxs, __m128* tNear, __m128* tFar, __m128* miss)
+    {
+        __m128 o = _mm_set1_ps(ray.origin[axis]);
+        __m128 slabMin = _mm_loadu_ps(mins);
+        __m128 slabMax = _mm_loadu_ps(maxs);
+        if (ray.parallel[axis])
+        {
+            *miss = _mm_or_ps(*miss, _mm_or_ps(_mm_cmplt_ps(o, slabMin), _mm_cmpgt_ps(o, slabMax)));
+            *tNear = _mm_set1_ps(-infinity);
+            *tFar = _mm_set1_ps(infinity);
+            return;
+        }
+        __m128 inv = _mm_set1_ps(1.0f / ray.direction[axis]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(slabMin, o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(slabMax, o), inv);
+        *tNear = _mm_min_ps(t1, t0);
+        *tFar = _mm_max_ps(t1, t0);
+    }
+
+    __attribute__((target("sse2")))
+    uint32_t boxesSSE(const WideRay& ray, const BoxBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        __m128 eps = _mm_set1_ps(epsilon);
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int half = 0; half < block.count; half += 4)
+        {
+            __m128 nearX, farX, nearY, farY, nearZ, farZ;
+            __m128 miss = _mm_setzero_ps();
+            slabSSE(ray, 0, block.minX + half, block.maxX + half, &nearX, &farX, &miss);
+            slabSSE(ray, 1, block.minY + half, block.maxY + half, &nearY, &farY, &miss);
+            slabSSE(ray, 2, block.minZ + half, block.maxZ + half, &nearZ, &farZ, &miss);
+            __m128 tEnter = _mm_max_ps(nearZ, _mm_max_ps(nearY, nearX));
+            __m128 tExit = _mm_min_ps(farZ, _mm_min_ps(farY, farX));
+
+            __m128 inside = _mm_cmplt_ps(tEnter, eps);
+            __m128 tHit = _mm_or_ps(_mm_and_ps(inside, tExit), _mm_andnot_ps(inside, tEnter));
+            __m128 rejected = _mm_or_ps(miss, _mm_or_ps(_mm_cmpgt_ps(tEnter, tExit), _mm_cmplt_ps(tExit, eps)));
+            __m128 valid = _mm_andnot_ps(rejected, _mm_and_ps(_mm_cmpgt_ps(tHit, eps), _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+
+            _mm_storeu_ps(t + half, tHit);
+            hitMask |= static_cast<uint32_t>(_mm_movemask_ps(valid)) << half;
+            *backface |= static_cast<uint32_t>(_mm_movemask_ps(inside)) << half;
+        }
+        return hitMask & countMask(block.count);
+    }
+
+    // entry and exit distance of four lanes, in the argument order of glm::min/max
+    __attribute__((target("sse2")))
+    void packetSlabsSSE(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, const float* invX,
+                        const float* invY, const float* invZ, const float* tMax, int half, __m128* tEnter, __m128* tExit)
+    {
+        __m128 ix = _mm_loadu_ps(invX + half);
+        __m128 iy = _mm_loadu_ps(invY + half);
+        __m128 iz = _mm_loadu_ps(invZ + half);
+        __m128 ox = _mm_loadu_ps(packet.originX + half);
+        __m128 oy = _mm_loadu_ps(packet.originY + half);
+        __m128 oz = _mm_loadu_ps(packet.originZ + half);
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMin.x), ox), ix);
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMax.x), ox), ix);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMin.y), oy), iy);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMax.y), oy), iy);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMin.z), oz), iz);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bMax.z), oz), iz);
+        __m128 nearXY = _mm_max_ps(_mm_min_ps(t1y, t0y), _mm_min_ps(t1x, t0x));
+        __m128 nearZ = _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(t1z, t0z));
+        *tEnter = _mm_max_ps(nearZ, nearXY);
+        __m128 farXY = _mm_min_ps(_mm_max_ps(t1y, t0y), _mm_max_ps(t1x, t0x));
+        __m128 farZ = _mm_min_ps(_mm_loadu_ps(tMax + half), _mm_max_ps(t1z, t0z));
+        *tExit = _mm_min_ps(farZ, farXY);
+    }
+
+    __attribute__((target("sse2")))
+    uint32_t packetBoundsSSE(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, const float* invX,
+                             const float* invY, const float* invZ, const float* tMax, uint32_t laneMask, float* tNear)
+    {
+        __m128 nearest = _mm_set1_ps(infinity);
+        uint32_t mask = 0;
+        for (int half = 0; half < PacketSize; half += 4)
+        {
+            __m128 tEnter, tExit;
+            packetSlabsSSE(bMin, bMax, packet, invX, invY, invZ, tMax, half, &tEnter, &tExit);
+            __m128i bits = _mm_setr_epi32(1 << half, 2 << half, 4 << half, 8 << half);
+            __m128i lanes = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(static_cast<int>(laneMask)), bits), bits);
+            __m128 overlap = _mm_and_ps(_mm_cmple_ps(tEnter, tExit), _mm_castsi128_ps(lanes));
+            nearest = _mm_min_ps(nearest, _mm_or_ps(_mm_and_ps(overlap, tEnter), _mm_andnot_ps(overlap, _mm_set1_ps(infinity))));
+            mask |= static_cast<uint32_t>(_mm_movemask_ps(overlap)) << half;
+        }
+        nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+        nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+        *tNear = _mm_cvtss_f32(nearest);
+        return mask;
+    }
+
+    __attribute__((target("sse2")))
+    uint32_t spherePacketSSE(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                             const float* tMax, float* t, uint32_t* backface)
+    {
+        __m128 eps = _mm_set1_ps(epsilon);
+        __m128 zero = _mm_setzero_ps();
+        __m128 radius2 = _mm_set1_ps(radius * radius);
+
+        uint32_t hitMask = 0;
+        *backface = 0;
+        for (int half = 0; half < PacketSize; half += 4)
+        {
+            __m128 dx = _mm_load_ps(packet.directionX + half);
+            __m128 dy = _mm_load_ps(packet.directionY + half);
+            __m128 dz = _mm_load_ps(packet.directionZ + half);
+            __m128 ocx = _mm_sub_ps(_mm_load_ps(packet.originX + half), _mm_set1_ps(center.x));
+            __m128 ocy = _mm_sub_ps(_mm_load_ps(packet.originY + half), _mm_set1_ps(center.y));
+            __m128 ocz = _mm_sub_ps(_mm_load_ps(packet.originZ + half), _mm_set1_ps(center.z));
+
+            __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz)));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), radius2);
+            __m128 delta = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), a), c));
+            __m128 root = _mm_sqrt_ps(delta);
+            __m128 negB = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+            __m128 twoA = _mm_mul_ps(_mm_set1_ps(2.0f), a);
+            __m128 t1 = _mm_div_ps(_mm_sub_ps(negB, root), twoA);
+            __m128 t2 = _mm_div_ps(_mm_add_ps(negB, root), twoA);
+
+            __m128 useT1 = _mm_cmpge_ps(t1, eps);
+            __m128 tHit = _mm_or_ps(_mm_and_ps(useT1, t1), _mm_andnot_ps(useT1, t2));
+            __m128 valid = _mm_andnot_ps(_mm_cmplt_ps(delta, zero),
+                                         _mm_and_ps(_mm_cmpge_ps(tHit, eps), _mm_cmplt_ps(tHit, _mm_loadu_ps(tMax + half))));
+            __m128 back = _mm_or_ps(_mm_cmplt_ps(t1, zero), _mm_cmplt_ps(t2, zero));
+
+            _mm_storeu_ps(t + half, tHit);
+            hitMask |= static_cast<uint32_t>(_mm_movemask_ps(valid)) << half;
+            *backface |= static_cast<uint32_t>(_mm_movemask_ps(back)) << half;
+        }
+        *backface &= hitMask & laneMask;
+        return hitMask & laneMask;
+    }
+
+    // one slab for four lanes of their own direction, parallel lanes like in boxesScalar()
+    __attribute__((target("sse2")))
+    void packetBoxSlabSSE(__m128 o, __m128 d, float slabMin, float slabMax, __m128* tNear, __m128* tFar, __m128* miss)
+    {
+        __m128 lo = _mm_set1_ps(slabMin);
+        __m128 hi = _mm_set1_ps(slabMax);
+        __m128 parallel = _mm_cmpeq_ps(d, _mm_setzero_ps());
+        __m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), d);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, o), inv);
+        *tNear = _mm_or_ps(_mm_and_ps(parallel, _mm_set1_ps(-infinity)), _mm_andnot_ps(parallel, _mm_min_ps(t1, t0)));
+        *tFar = _mm_or_ps(_mm_and_ps(parallel, _mm_set1_ps(infinity)), _mm_andnot_ps(parallel, _mm_max_ps(t1, t0)));
+        *miss = _mm_or_ps(*miss, _mm_and_ps(parallel, _mm_or_ps(_mm_cmplt_ps(o, lo), _mm_cmpgt_ps(o, hi))));
+    }
+
+    __attribute__((target("sse2")))
+    uint32_t boxPacketSSE(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                          const float* tMax, float* t, uint32_t* inside)
+    {
+        __m128 eps = _mm_set1_ps(epsilon);
+        uint32_t hitMask = 0;
+        *inside = 0;
+        for (int half = 0; half < PacketSize; half += 4)
+        {
+            __m128 nearX, farX, nearY, farY, nearZ, farZ;
+            __m128 miss = _mm_setzero_ps();
+            packetBoxSlabSSE(_mm_load_ps(packet.originX + half), _mm_load_ps(packet.directionX + half), bMin.x, bMax.x, &nearX, &farX, &miss);
+            packetBoxSlabSSE(_mm_load_ps(packet.originY + half), _mm_load_ps(packet.directionY + half), bMin.y, bMax.y, &nearY, &farY, &miss);
+            packetBoxSlabSSE(_mm_load_ps(packet.originZ + half), _mm_load_ps(packet.directionZ + half), bMin.z, bMax.z, &nearZ, &farZ, &miss);
+            __m128 tEnter = _mm_max_ps(nearZ, _mm_max_ps(nearY, nearX));
+            __m128 tExit = _mm_min_ps(farZ, _mm_min_ps(farY, farX));
+
+            __m128 startsInside = _mm_cmplt_ps(tEnter, eps);
+            __m128 tHit = _mm_or_ps(_mm_and_ps(startsInside, tExit), _mm_andnot_ps(startsInside, tEnter));
+            __m128 rejected = _mm_or_ps(miss, _mm_or_ps(_mm_cmpgt_ps(tEnter, tExit), _mm_cmplt_ps(tExit, eps)));
+            __m128 valid = _mm_andnot_ps(rejected, _mm_and_ps(_mm_cmpgt_ps(tHit, eps), _mm_cmplt_ps(tHit, _mm_loadu_ps(tMax + half))));
+
+            _mm_storeu_ps(t + half, tHit);
+            hitMask |= static_cast<uint32_t>(_mm_movemask_ps(valid)) << half;
+            *inside |= static_cast<uint32_t>(_mm_movemask_ps(startsInside)) << half;
+        }
+        *inside &= hitMask & laneMask;
+        return hitMask & laneMask;
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t spheresAVX2(const WideRay& ray, const SphereBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        const glm::vec3& d = ray.direction;
+        float a = d.x*d.x + d.y*d.y + d.z*d.z;
+        __m256 dx = _mm256_set1_ps(d.x);
+        __m256 dy = _mm256_set1_ps(d.y);
+        __m256 dz = _mm256_set1_ps(d.z);
+        __m256 eps = _mm256_set1_ps(epsilon);
+        __m256 zero = _mm256_setzero_ps();
+
+        __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(block.centerX));
+        __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(block.centerY));
+        __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(block.centerZ));
+        __m256 r = _mm256_loadu_ps(block.radius);
+
+        __m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+        __m256 delta = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4*a), c));
+        __m256 root = _mm256_sqrt_ps(delta);
+        __m256 negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+        __m256 twoA = _mm256_set1_ps(2*a);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, root), twoA);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, root), twoA);
+
+        __m256 tHit = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, eps, _CMP_GE_OQ));
+        __m256 valid = _mm256_andnot_ps(_mm256_cmp_ps(delta, zero, _CMP_LT_OQ),
+                                        _mm256_and_ps(_mm256_cmp_ps(tHit, eps, _CMP_GE_OQ),
+                                                      _mm256_cmp_ps(tHit, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+        __m256 back = _mm256_or_ps(_mm256_cmp_ps(t1, zero, _CMP_LT_OQ), _mm256_cmp_ps(t2, zero, _CMP_LT_OQ));
+
+        _mm256_storeu_ps(t, tHit);
+        *backface = static_cast<uint32_t>(_mm256_movemask_ps(back));
+        return static_cast<uint32_t>(_mm256_movemask_ps(valid)) & countMask(block.count);
+    }
+
+    __attribute__((target("avx2")))
+    void slabAVX2(const WideRay& ray, int axis, const float* mins, const float* maxs, __m256* tNear, __m256* tFar, __m256* miss)
+    {
+        __m256 o = _mm256_set1_ps(ray.origin[axis]);
+        __m256 slabMin = _mm256_loadu_ps(mins);
+        __m256 slabMax = _mm256_loadu_ps(maxs);
+        if (ray.parallel[axis])
+        {
+            *miss = _mm256_or_ps(*miss, _mm256_or_ps(_mm256_cmp_ps(o, slabMin, _CMP_LT_OQ), _mm256_cmp_ps(o, slabMax, _CMP_GT_OQ)));
+            *tNear = _mm256_set1_ps(-infinity);
+            *tFar = _mm256_set1_ps(infinity);
+            return;
+        }
+        __m256 inv = _mm256_set1_ps(1.0f / ray.direction[axis]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(slabMin, o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(slabMax, o), inv);
+        *tNear = _mm256_min_ps(t1, t0);
+        *tFar = _mm256_max_ps(t1, t0);
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t boxesAVX2(const WideRay& ray, const BoxBlock& block, float tMax, float* t, uint32_t* backface)
+    {
+        __m256 eps = _mm256_set1_ps(epsilon);
+        __m256 nearX, farX, nearY, farY, nearZ, farZ;
+        __m256 miss = _mm256_setzero_ps();
+        slabAVX2(ray, 0, block.minX, block.maxX, &nearX, &farX, &miss);
+        slabAVX2(ray, 1, block.minY, block.maxY, &nearY, &farY, &miss);
+        slabAVX2(ray, 2, block.minZ, block.maxZ, &nearZ, &farZ, &miss);
+        __m256 tEnter = _mm256_max_ps(nearZ, _mm256_max_ps(nearY, nearX));
+        __m256 tExit = _mm256_min_ps(farZ, _mm256_min_ps(farY, farX));
+
+        __m256 inside = _mm256_cmp_ps(tEnter, eps, _CMP_LT_OQ);
+        __m256 tHit = _mm256_blendv_ps(tEnter, tExit, inside);
+        __m256 rejected = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_GT_OQ), _mm256_cmp_ps(tExit, eps, _CMP_LT_OQ)));
+        __m256 valid = _mm256_andnot_ps(rejected, _mm256_and_ps(_mm256_cmp_ps(tHit, eps, _CMP_GT_OQ),
+                                                                _mm256_cmp_ps(tHit, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+
+        _mm256_storeu_ps(t, tHit);
+        *backface = static_cast<uint32_t>(_mm256_movemask_ps(inside));
+        return static_cast<uint32_t>(_mm256_movemask_ps(valid)) & countMask(block.count);
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t packetBoundsAVX2(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, const float* invX,
+                              const float* invY, const float* invZ, const float* tMax, uint32_t laneMask, float* tNear)
+    {
+        __m256 ix = _mm256_loadu_ps(invX);
+        __m256 iy = _mm256_loadu_ps(invY);
+        __m256 iz = _mm256_loadu_ps(invZ);
+        __m256 ox = _mm256_load_ps(packet.originX);
+        __m256 oy = _mm256_load_ps(packet.originY);
+        __m256 oz = _mm256_load_ps(packet.originZ);
+        __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMin.x), ox), ix);
+        __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMax.x), ox), ix);
+        __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMin.y), oy), iy);
+        __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMax.y), oy), iy);
+        __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMin.z), oz), iz);
+        __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bMax.z), oz), iz);
+        __m256 nearXY = _mm256_max_ps(_mm256_min_ps(t1y, t0y), _mm256_min_ps(t1x, t0x));
+        __m256 nearZ = _mm256_max_ps(_mm256_setzero_ps(), _mm256_min_ps(t1z, t0z));
+        __m256 tEnter = _mm256_max_ps(nearZ, nearXY);
+        __m256 farXY = _mm256_min_ps(_mm256_max_ps(t1y, t0y), _mm256_max_ps(t1x, t0x));
+        __m256 farZ = _mm256_min_ps(_mm256_loadu_ps(tMax), _mm256_max_ps(t1z, t0z));
+        __m256 tExit = _mm256_min_ps(farZ, farXY);
+
+        __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(static_cast<int>(laneMask)), bits), bits);
+        __m256 overlap = _mm256_and_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ), _mm256_castsi256_ps(lanes));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(overlap));
+
+        __m256 nearest = _mm256_blendv_ps(_mm256_set1_ps(infinity), tEnter, overlap);
+        nearest = _mm256_min_ps(nearest, _mm256_permute2f128_ps(nearest, nearest, 1));
+        nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+        nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+        *tNear = _mm256_cvtss_f32(nearest);
+        return mask;
+    }
+    __attribute__((target("avx2")))
+    uint32_t spherePacketAVX2(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                              const float* tMax, float* t, uint32_t* backface)
+    {
+        __m256 eps = _mm256_set1_ps(epsilon);
+        __m256 zero = _mm256_setzero_ps();
+
+        __m256 dx = _mm256_load_ps(packet.directionX);
+        __m256 dy = _mm256_load_ps(packet.directionY);
+        __m256 dz = _mm256_load_ps(packet.directionZ);
+        __m256 ocx = _mm256_sub_ps(_mm256_load_ps(packet.originX), _mm256_set1_ps(center.x));
+        __m256 ocy = _mm256_sub_ps(_mm256_load_ps(packet.originY), _mm256_set1_ps(center.y));
+        __m256 ocz = _mm256_sub_ps(_mm256_load_ps(packet.originZ), _mm256_set1_ps(center.z));
+
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 _mm256_set1_ps(radius * radius));
+        __m256 delta = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), a), c));
+        __m256 root = _mm256_sqrt_ps(delta);
+        __m256 negB = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+        __m256 twoA = _mm256_mul_ps(_mm256_set1_ps(2.0f), a);
+        __m256 t1 = _mm256_div_ps(_mm256_sub_ps(negB, root), twoA);
+        __m256 t2 = _mm256_div_ps(_mm256_add_ps(negB, root), twoA);
+
+        __m256 tHit = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, eps, _CMP_GE_OQ));
+        __m256 valid = _mm256_andnot_ps(_mm256_cmp_ps(delta, zero, _CMP_LT_OQ),
+                                        _mm256_and_ps(_mm256_cmp_ps(tHit, eps, _CMP_GE_OQ),
+                                                      _mm256_cmp_ps(tHit, _mm256_loadu_ps(tMax), _CMP_LT_OQ)));
+        __m256 back = _mm256_or_ps(_mm256_cmp_ps(t1, zero, _CMP_LT_OQ), _mm256_cmp_ps(t2, zero, _CMP_LT_OQ));
+
+        _mm256_storeu_ps(t, tHit);
+        uint32_t hitMask = static_cast<uint32_t>(_mm256_movemask_ps(valid)) & laneMask;
+        *backface = static_cast<uint32_t>(_mm256_movemask_ps(back)) & hitMask;
+        return hitMask;
+    }
+
+    __attribute__((target("avx2")))
+    void packetBoxSlabAVX2(__m256 o, __m256 d, float slabMin, float slabMax, __m256* tNear, __m256* tFar, __m256* miss)
+    {
+        __m256 lo = _mm256_set1_ps(slabMin);
+        __m256 hi = _mm256_set1_ps(slabMax);
+        __m256 parallel = _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_EQ_OQ);
+        __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), d);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(hi, o), inv);
+        *tNear = _mm256_blendv_ps(_mm256_min_ps(t1, t0), _mm256_set1_ps(-infinity), parallel);
+        *tFar = _mm256_blendv_ps(_mm256_max_ps(t1, t0), _mm256_set1_ps(infinity), parallel);
+        *miss = _mm256_or_ps(*miss, _mm256_and_ps(parallel, _mm256_or_ps(_mm256_cmp_ps(o, lo, _CMP_LT_OQ), _mm256_cmp_ps(o, hi, _CMP_GT_OQ))));
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t boxPacketAVX2(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                           const float* tMax, float* t, uint32_t* inside)
+    {
+        __m256 eps = _mm256_set1_ps(epsilon);
+        __m256 nearX, farX, nearY, farY, nearZ, farZ;
+        __m256 miss = _mm256_setzero_ps();
+        packetBoxSlabAVX2(_mm256_load_ps(packet.originX), _mm256_load_ps(packet.directionX), bMin.x, bMax.x, &nearX, &farX, &miss);
+        packetBoxSlabAVX2(_mm256_load_ps(packet.originY), _mm256_load_ps(packet.directionY), bMin.y, bMax.y, &nearY, &farY, &miss);
+        packetBoxSlabAVX2(_mm256_load_ps(packet.originZ), _mm256_load_ps(packet.directionZ), bMin.z, bMax.z, &nearZ, &farZ, &miss);
+        __m256 tEnter = _mm256_max_ps(nearZ, _mm256_max_ps(nearY, nearX));
+        __m256 tExit = _mm256_min_ps(farZ, _mm256_min_ps(farY, farX));
+
+        __m256 startsInside = _mm256_cmp_ps(tEnter, eps, _CMP_LT_OQ);
+        __m256 tHit = _mm256_blendv_ps(tEnter, tExit, startsInside);
+        __m256 rejected = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_GT_OQ), _mm256_cmp_ps(tExit, eps, _CMP_LT_OQ)));
+        __m256 valid = _mm256_andnot_ps(rejected, _mm256_and_ps(_mm256_cmp_ps(tHit, eps, _CMP_GT_OQ),
+                                                                _mm256_cmp_ps(tHit, _mm256_loadu_ps(tMax), _CMP_LT_OQ)));
+
+        _mm256_storeu_ps(t, tHit);
+        uint32_t hitMask = static_cast<uint32_t>(_mm256_movemask_ps(valid)) & laneMask;
+        *inside = static_cast<uint32_t>(_mm256_movemask_ps(startsInside)) & hitMask;
+        return hitMask;
+    }
+#endif
+
+    using PacketBoundsFn = uint32_t (*)(const glm::vec3&, const glm::vec3&, const RayPacket&, const float*, const float*,
+                                        const float*, const float*, uint32_t, float*);
+
+    using SpherePacketFn = uint32_t (*)(const glm::vec3&, float, const RayPacket&, uint32_t, const float*, float*, uint32_t*);
+    using BoxPacketFn = uint32_t (*)(const glm::vec3&, const glm::vec3&, const RayPacket&, uint32_t, const float*, float*, uint32_t*);
+
+    // entry points for one kernel set, Spheres and Boxes are the lane kernels above
+    template<uint32_t (*Spheres)(const WideRay&, const SphereBlock&, float, float*, uint32_t*),
+             uint32_t (*Boxes)(const WideRay&, const BoxBlock&, float, float*, uint32_t*),
+             PacketBoundsFn PacketBounds, SpherePacketFn SpherePacket, BoxPacketFn BoxPacket>
+    struct KernelSet
+    {
+        static WideHit intersectSpheres(const WideRay& ray, const SphereBlock& block, float tMax)
+        {
+            float t[WideKernels::maxWidth];
+            uint32_t backface;
+            uint32_t hitMask = Spheres(ray, block, tMax, t, &backface);
+            return closestLane(t, hitMask, backface, tMax);
+        }
+
+        static uint32_t occludedSpheres(const WideRay& ray, const SphereBlock& block, float tMax)
+        {
+            float t[WideKernels::maxWidth];
+            uint32_t backface;
+            return Spheres(ray, block, tMax, t, &backface);
+        }
+
+        static WideHit intersectBoxes(const WideRay& ray, const BoxBlock& block, float tMax)
+        {
+            float t[WideKernels::maxWidth];
+            uint32_t backface;
+            uint32_t hitMask = Boxes(ray, block, tMax, t, &backface);
+            return closestLane(t, hitMask, backface, tMax);
+        }
+
+        static uint32_t occludedBoxes(const WideRay& ray, const BoxBlock& block, float tMax)
+        {
+            float t[WideKernels::maxWidth];
+            uint32_t backface;
+            return Boxes(ray, block, tMax, t, &backface);
+        }
+
+        static uint32_t occludedSpherePacket(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                                             const float* tMax)
+        {
+            float t[PacketSize];
+            uint32_t backface;
+            return SpherePacket(center, radius, packet, laneMask, tMax, t, &backface);
+        }
+
+        static uint32_t occludedBoxPacket(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                                          const float* tMax)
+        {
+            float t[PacketSize];
+            uint32_t inside;
+            return BoxPacket(bMin, bMax, packet, laneMask, tMax, t, &inside);
+        }
+
+        static WideKernels get(SimdLevel level)
+        {
+            return { level, intersectSpheres, occludedSpheres, intersectBoxes, occludedBoxes, PacketBounds,
+                     SpherePacket, occludedSpherePacket, BoxPacket, occludedBoxPacket };
+        }
+    };
+}
+
+SimdLevel detectSimdLevel()
+{
+#ifdef PT_WIDE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return SimdLevel::SSE;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+const char* getSimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE:  return "sse";
+        default:              return "scalar";
+    }
+}
+
+const WideKernels& getWideKernels(SimdLevel level)
+{
+    static const SimdLevel supported = detectSimdLevel();
+    static const WideKernels scalar = KernelSet<spheresScalar, boxesScalar, packetBoundsScalar, spherePacketScalar, boxPacketScalar>::get(SimdLevel::Scalar);
+#ifdef PT_WIDE_X86
+    static const WideKernels sse = KernelSet<spheresSSE, boxesSSE, packetBoundsSSE, spherePacketSSE, boxPacketSSE>::get(SimdLevel::SSE);
+    static const WideKernels avx2 = KernelSet<spheresAVX2, boxesAVX2, packetBoundsAVX2, spherePacketAVX2, boxPacketAVX2>::get(SimdLevel::AVX2);
+    if (level >= SimdLevel::AVX2 && supported >= SimdLevel::AVX2)
+    {
+        return avx2;
+    }
+    if (level >= SimdLevel::SSE && supported >= SimdLevel::SSE)
+    {
+        return sse;
+    }
+#endif
+    (void)supported;
+    return scalar;
+}
@@ -0,0 +1,96 @@
+#ifndef WIDEKERNELS_H
+#define WIDEKERNELS_H
+
+#include "ray.h"
+#include "packet.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// Instruction sets the wide kernels are written for, the best one the CPU
+// supports is picked at run time
+enum class SimdLevel : uint8_t { Scalar, SSE, AVX2 };
+
+SimdLevel detectSimdLevel();
+const char* getSimdLevelName(SimdLevel level);
+
+// one ray set up for testing against many primitives
+struct WideRay
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    bool parallel[3];   // direction is zero along the axis
+
+    WideRay(const Ray& ray);
+};
+
+// A run of at most maxWidth spheres or boxes, one array per coordinate.
+// The arrays must stay readable for maxWidth entries from the start, the
+// kernels load whole vectors and ignore the lanes past count.
+struct SphereBlock
+{
+    const float* centerX;
+    const float* centerY;
+    const float* centerZ;
+    const float* radius;
+    int count;
+};
+
+struct BoxBlock
+{
+    const float* minX;
+    const float* minY;
+    const float* minZ;
+    const float* maxX;
+    const float* maxY;
+    const float* maxZ;
+    int count;
+};
+
+// closest hit within a block, lane is -1 if there is none
+struct WideHit
+{
+    int lane;
+    float t;
+    bool backface;
+};
+
+// One ray against a block of primitives with the same results as
+// Sphere::intersectSphere and Box::intersectBox tried lane by lane: the hit
+// is the first lane with the smallest t in (epsilon, tMax). The occlusion
+// tests return the mask of lanes hit in (epsilon, tMax).
+//
+// intersectPacketBounds is the other way around, a ray packet against one
+// bounding box for the BVH packet traversals. invX, invY and invZ hold the
+// reciprocal directions of the lanes. It returns the lanes in laneMask that
+// overlap the box within their tMax and the smallest entry distance among
+// them, infinity if there are none.
+//
+// The packet kernels test the lanes of a packet against one sphere or box
+// with the same results as the scalar tests lane by lane. They return the
+// lanes in laneMask hit in (epsilon, tMax); the intersect versions also
+// write t and the backface flag of every lane, which for a box means the
+// lane starts inside it. Directions need not be normalized.
+struct WideKernels
+{
+    static const int maxWidth = 8;
+
+    SimdLevel level;
+    WideHit (*intersectSpheres)(const WideRay& ray, const SphereBlock& block, float tMax);
+    uint32_t (*occludedSpheres)(const WideRay& ray, const SphereBlock& block, float tMax);
+    WideHit (*intersectBoxes)(const WideRay& ray, const BoxBlock& block, float tMax);
+    uint32_t (*occludedBoxes)(const WideRay& ray, const BoxBlock& block, float tMax);
+    uint32_t (*intersectPacketBounds)(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, const float* invX,
+                                      const float* invY, const float* invZ, const float* tMax, uint32_t laneMask, float* tNear);
+    uint32_t (*intersectSpherePacket)(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                                      const float* tMax, float* t, uint32_t* backface);
+    uint32_t (*occludedSpherePacket)(const glm::vec3& center, float radius, const RayPacket& packet, uint32_t laneMask,
+                                     const float* tMax);
+    uint32_t (*intersectBoxPacket)(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                                   const float* tMax, float* t, uint32_t* inside);
+    uint32_t (*occludedBoxPacket)(const glm::vec3& bMin, const glm::vec3& bMax, const RayPacket& packet, uint32_t laneMask,
+                                  const float* tMax);
+};
+
+// levels the CPU lacks fall back to the best one it has
+const WideKernels& getWideKernels(SimdLevel level);
+#endif